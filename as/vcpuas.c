@@ -0,0 +1,1344 @@
+#include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vcpu16.h>
+#include "vcpuas.h"
+
+/* Longest label or section name */
+#define MAX_IDENTIFIER 63
+
+#define OBJECT_MAGIC    "VCPO"
+#define OBJECT_VERSION  1
+
+#define NO_IMPORT ((size_t)-1)
+
+#define TOKEN_END       0   /* End of the line, or a comment */
+#define TOKEN_NAME      1   /* Label, mnemonic or register */
+#define TOKEN_DIRECTIVE 2   /* A name that starts with a dot */
+#define TOKEN_NUMBER    3
+#define TOKEN_CHAR      4   /* 'c' */
+#define TOKEN_STRING    5   /* "text", quotes not included */
+#define TOKEN_OTHER     6   /* Any other single character */
+
+#define KEYWORD_OPCODE      0
+#define KEYWORD_REGISTER    1
+#define KEYWORD_DIRECTIVE   2
+
+#define DIRECTIVE_DW        0
+#define DIRECTIVE_ASCII     1
+#define DIRECTIVE_ASCIZ     2
+#define DIRECTIVE_SKIP      3
+#define DIRECTIVE_SECTION   4
+#define DIRECTIVE_GLOBAL    5
+
+struct keyword {
+    const char *name;               /* Lower case */
+    int kind;                       /* KEYWORD_* */
+    unsigned short value;           /* Opcode, register or DIRECTIVE_* */
+};
+
+static const struct keyword keywords[] = {
+    { "nop", KEYWORD_OPCODE, VCPU_OPCODE_NOP },
+    { "hlt", KEYWORD_OPCODE, VCPU_OPCODE_HLT },
+    { "pts", KEYWORD_OPCODE, VCPU_OPCODE_PTS },
+    { "pfs", KEYWORD_OPCODE, VCPU_OPCODE_PFS },
+    { "cal", KEYWORD_OPCODE, VCPU_OPCODE_CAL },
+    { "ret", KEYWORD_OPCODE, VCPU_OPCODE_RET },
+    { "ior", KEYWORD_OPCODE, VCPU_OPCODE_IOR },
+    { "iow", KEYWORD_OPCODE, VCPU_OPCODE_IOW },
+    { "mrd", KEYWORD_OPCODE, VCPU_OPCODE_MRD },
+    { "mwr", KEYWORD_OPCODE, VCPU_OPCODE_MWR },
+    { "cli", KEYWORD_OPCODE, VCPU_OPCODE_CLI },
+    { "sti", KEYWORD_OPCODE, VCPU_OPCODE_STI },
+    { "int", KEYWORD_OPCODE, VCPU_OPCODE_INT },
+    { "rfi", KEYWORD_OPCODE, VCPU_OPCODE_RFI },
+    { "xch", KEYWORD_OPCODE, VCPU_OPCODE_XCH },
+    { "ipi", KEYWORD_OPCODE, VCPU_OPCODE_IPI },
+    { "cpi", KEYWORD_OPCODE, VCPU_OPCODE_CPI },
+    { "ieq", KEYWORD_OPCODE, VCPU_OPCODE_IEQ },
+    { "ine", KEYWORD_OPCODE, VCPU_OPCODE_INE },
+    { "igt", KEYWORD_OPCODE, VCPU_OPCODE_IGT },
+    { "ige", KEYWORD_OPCODE, VCPU_OPCODE_IGE },
+    { "ilt", KEYWORD_OPCODE, VCPU_OPCODE_ILT },
+    { "ile", KEYWORD_OPCODE, VCPU_OPCODE_ILE },
+    { "mov", KEYWORD_OPCODE, VCPU_OPCODE_MOV },
+    { "add", KEYWORD_OPCODE, VCPU_OPCODE_ADD },
+    { "sub", KEYWORD_OPCODE, VCPU_OPCODE_SUB },
+    { "mul", KEYWORD_OPCODE, VCPU_OPCODE_MUL },
+    { "div", KEYWORD_OPCODE, VCPU_OPCODE_DIV },
+    { "mod", KEYWORD_OPCODE, VCPU_OPCODE_MOD },
+    { "shl", KEYWORD_OPCODE, VCPU_OPCODE_SHL },
+    { "shr", KEYWORD_OPCODE, VCPU_OPCODE_SHR },
+    { "and", KEYWORD_OPCODE, VCPU_OPCODE_AND },
+    { "bor", KEYWORD_OPCODE, VCPU_OPCODE_BOR },
+    { "xor", KEYWORD_OPCODE, VCPU_OPCODE_XOR },
+    { "not", KEYWORD_OPCODE, VCPU_OPCODE_NOT },
+    { "inc", KEYWORD_OPCODE, VCPU_OPCODE_INC },
+    { "dec", KEYWORD_OPCODE, VCPU_OPCODE_DEC },
+    { "r0", KEYWORD_REGISTER, VCPU_REGISTER_R0 },
+    { "r1", KEYWORD_REGISTER, VCPU_REGISTER_R1 },
+    { "r2", KEYWORD_REGISTER, VCPU_REGISTER_R2 },
+    { "r3", KEYWORD_REGISTER, VCPU_REGISTER_R3 },
+    { "r4", KEYWORD_REGISTER, VCPU_REGISTER_R4 },
+    { "r5", KEYWORD_REGISTER, VCPU_REGISTER_R5 },
+    { "r6", KEYWORD_REGISTER, VCPU_REGISTER_R6 },
+    { "r7", KEYWORD_REGISTER, VCPU_REGISTER_R7 },
+    { "r8", KEYWORD_REGISTER, VCPU_REGISTER_R8 },
+    { "r9", KEYWORD_REGISTER, VCPU_REGISTER_R9 },
+    { "ri", KEYWORD_REGISTER, VCPU_REGISTER_RI },
+    { "rj", KEYWORD_REGISTER, VCPU_REGISTER_RJ },
+    { "ia", KEYWORD_REGISTER, VCPU_REGISTER_IA },
+    { "of", KEYWORD_REGISTER, VCPU_REGISTER_OF },
+    { "sp", KEYWORD_REGISTER, VCPU_REGISTER_SP },
+    { "pc", KEYWORD_REGISTER, VCPU_REGISTER_PC },
+    { ".dw", KEYWORD_DIRECTIVE, DIRECTIVE_DW },
+    { ".dat", KEYWORD_DIRECTIVE, DIRECTIVE_DW },
+    { ".ascii", KEYWORD_DIRECTIVE, DIRECTIVE_ASCII },
+    { ".string", KEYWORD_DIRECTIVE, DIRECTIVE_ASCII },
+    { ".asciz", KEYWORD_DIRECTIVE, DIRECTIVE_ASCIZ },
+    { ".asciiz", KEYWORD_DIRECTIVE, DIRECTIVE_ASCIZ },
+    { ".skip", KEYWORD_DIRECTIVE, DIRECTIVE_SKIP },
+    { ".section", KEYWORD_DIRECTIVE, DIRECTIVE_SECTION },
+    { ".global", KEYWORD_DIRECTIVE, DIRECTIVE_GLOBAL },
+    { ".globl", KEYWORD_DIRECTIVE, DIRECTIVE_GLOBAL }
+};
+
+/* The keyword hash is FNV-1a over the name folded to lower case,
+ * started at KEYWORD_SEED. That seed sends every keyword to a slot
+ * of its own, which holds its index in keywords plus one; pick a new
+ * one and refill the slots when adding a keyword. */
+#define KEYWORD_SEED    7745UL
+#define KEYWORD_SLOT(hash) (((hash) >> 24) & 0xFF)
+
+static const unsigned char keyword_slots[256] = {
+     0,  0,  0, 47, 46,  0,  0,  0,  0, 59,  0, 39, 38, 41, 40, 43,
+    42, 45, 44,  0,  0, 11,  0, 56, 25,  0,  0,  0,  0, 32,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  9,  0, 58,  0,  0,  0,  6,  0,
+     0,  0, 27,  0,  0,  0,  0,  0, 24,  0,  0,  0, 28,  0,  0,  0,
+     0, 37,  0,  0, 10,  0, 29,  0,  0,  0,  0, 14,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 55,  0,  3,  0,  0, 33,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  4,  0,  0, 36,
+     0,  0,  0,  0,  0, 19,  0,  0,  0,  0,  0,  0,  0,  0, 35,  0,
+     0, 21,  1,  8, 13,  0,  0,  0,  7, 18,  0,  0,  0,  0,  0,  0,
+    22,  0, 20,  0, 16,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0, 23,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 53,  0,  0,
+    15,  0,  0, 48,  0,  0, 49,  0, 62,  0,  0,  0,  0,  0,  0,  0,
+    51,  0,  0, 12,  0,  0, 52,  0, 54,  0,  0, 57,  0,  0,  0,  0,
+    31,  0, 34,  0,  0,  0,  0,  0,  0,  0,  0, 50,  0,  0, 30,  0,
+     0,  0, 26,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 17,  5,  0,
+     2,  0, 61,  0,  0,  0, 60, 63,  0,  0,  0,  0,  0,  0,  0,  0
+};
+
+/* Tokens point into the source, which is never copied or changed */
+struct token {
+    int type;                       /* TOKEN_* */
+    const char *text;
+    size_t length;
+    size_t column;                  /* One-based, in bytes */
+    const struct keyword *keyword;  /* For names and directives that are one */
+};
+
+struct lexer {
+    const char *p;                  /* Next character */
+    const char *end;                /* Of the source */
+    const char *line;               /* Start of the current line */
+};
+
+/* Symbols are interned on first sight, defined or not. Each hash
+ * bucket holds the index of its first symbol plus one, zero when
+ * it is empty, and symbols chain through next the same way. */
+struct symbol {
+    char *name;
+    size_t length;
+    unsigned short value;
+    unsigned short section;
+    int defined;
+    int exported;
+    size_t import;                  /* Index among the object's symbols once imported */
+    size_t line_no, column;         /* Where it was exported */
+    size_t next;
+};
+
+struct symbol_table {
+    struct symbol *symbols;
+    size_t num_symbols, max_symbols;
+    size_t *buckets;
+    size_t num_buckets;
+};
+
+/* Where diagnostics of one call go; column
+ * is only kept for the next diagnostic */
+struct report {
+    struct vcpuas_result *result;
+    size_t line_no;
+    size_t column;
+    size_t object;
+};
+
+/* Everything one vcpuas_assemble_object call works on. Relocations
+ * are kept against labels until the end of the source, when the
+ * labels found by then turn them into section relocations. */
+struct assembler {
+    struct report report;
+    struct lexer lexer;
+    struct vcpuas_object *object;
+    size_t *capacities;             /* Words allocated for each section */
+    size_t section;
+    int full;                       /* A section ran out of memory */
+    struct symbol_table labels;
+    size_t *targets;                /* Label of each relocation */
+    size_t max_relocations;
+};
+
+static void diagnose(struct report *report, int severity, const char *fmt, va_list va)
+{
+    struct vcpuas_result *result = report->result;
+    struct vcpuas_diagnostic *diagnostic;
+
+    result->diagnostics = realloc(result->diagnostics, (result->num_diagnostics + 1) * sizeof(struct vcpuas_diagnostic));
+    assert(("Out of memory!", result->diagnostics));
+
+    diagnostic = result->diagnostics + result->num_diagnostics++;
+    diagnostic->severity = severity;
+    diagnostic->line_no = report->line_no;
+    diagnostic->column = report->column;
+    diagnostic->object = report->object;
+    vsnprintf(diagnostic->message, sizeof(diagnostic->message), fmt, va);
+    report->column = 0;
+
+    if(severity == VCPUAS_ERROR)
+        result->num_errors++;
+}
+
+static void warning(struct report *report, const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    diagnose(report, VCPUAS_WARNING, fmt, va);
+    va_end(va);
+}
+
+/* Always zero, so that a failing step can return error(...) */
+static int error(struct report *report, const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    diagnose(report, VCPUAS_ERROR, fmt, va);
+    va_end(va);
+    return 0;
+}
+
+/* For a diagnostic about token */
+static struct report *at(struct assembler *as, const struct token *token)
+{
+    as->report.column = token->column;
+    return &as->report;
+}
+
+static char *copy_name(const char *name, size_t length)
+{
+    char *copy = malloc(length + 1);
+    assert(("Out of memory!", copy));
+    memcpy(copy, name, length);
+    copy[length] = 0;
+    return copy;
+}
+
+/* FNV-1a */
+static size_t hash_name(const char *name, size_t length)
+{
+    unsigned long hash = 2166136261UL;
+    while(length--) {
+        hash ^= (unsigned char)*name++;
+        hash = (hash * 16777619UL) & 0xFFFFFFFFUL;
+    }
+    return (size_t)hash;
+}
+
+/* Keeps the load factor under 3/4 */
+static void grow_buckets(struct symbol_table *table)
+{
+    size_t i, bucket;
+
+    table->num_buckets = table->num_buckets ? table->num_buckets * 2 : 256;
+    free(table->buckets);
+    table->buckets = calloc(table->num_buckets, sizeof(size_t));
+    assert(("Out of memory!", table->buckets));
+
+    for(i = 0; i < table->num_symbols; i++) {
+        bucket = hash_name(table->symbols[i].name, table->symbols[i].length) & (table->num_buckets - 1);
+        table->symbols[i].next = table->buckets[bucket];
+        table->buckets[bucket] = i + 1;
+    }
+}
+
+static size_t find_symbol(const struct symbol_table *table, const char *name, size_t length)
+{
+    const struct symbol *symbol;
+    size_t i;
+
+    if(table->num_buckets) {
+        for(i = table->buckets[hash_name(name, length) & (table->num_buckets - 1)]; i; i = symbol->next) {
+            symbol = table->symbols + i - 1;
+            if(symbol->length == length && !memcmp(symbol->name, name, length))
+                return i - 1;
+        }
+    }
+
+    return (size_t)-1;
+}
+
+static size_t intern_symbol(struct symbol_table *table, const char *name, size_t length)
+{
+    struct symbol *symbol;
+    size_t index, bucket;
+
+    if((index = find_symbol(table, name, length)) != (size_t)-1)
+        return index;
+
+    if(table->num_symbols >= table->max_symbols) {
+        table->max_symbols = table->max_symbols ? table->max_symbols * 2 : 256;
+        table->symbols = realloc(table->symbols, table->max_symbols * sizeof(struct symbol));
+        assert(("Out of memory!", table->symbols));
+    }
+
+    symbol = table->symbols + table->num_symbols;
+    memset(symbol, 0, sizeof(struct symbol));
+    symbol->name = copy_name(name, length);
+    symbol->length = length;
+    symbol->import = NO_IMPORT;
+    table->num_symbols++;
+
+    if(table->num_symbols * 4 > table->num_buckets * 3) {
+        grow_buckets(table);
+    }
+    else {
+        bucket = hash_name(name, length) & (table->num_buckets - 1);
+        symbol->next = table->buckets[bucket];
+        table->buckets[bucket] = table->num_symbols;
+    }
+
+    return table->num_symbols - 1;
+}
+
+static void free_symbols(struct symbol_table *table)
+{
+    size_t i;
+
+    for(i = 0; i < table->num_symbols; i++)
+        free(table->symbols[i].name);
+    free(table->symbols);
+    free(table->buckets);
+    memset(table, 0, sizeof(struct symbol_table));
+}
+
+/* Switches to the section of that name, making it on first use */
+static int select_section(struct assembler *as, const char *name, size_t length)
+{
+    struct vcpuas_object *object = as->object;
+    struct vcpuas_section *section;
+    size_t i;
+
+    for(i = 0; i < object->num_sections; i++) {
+        if(!strncmp(object->sections[i].name, name, length) && !object->sections[i].name[length]) {
+            as->section = i;
+            return 1;
+        }
+    }
+
+    if(object->num_sections > USHRT_MAX)
+        return error(&as->report, "too many sections");
+
+    object->sections = realloc(object->sections, (object->num_sections + 1) * sizeof(struct vcpuas_section));
+    as->capacities = realloc(as->capacities, (object->num_sections + 1) * sizeof(size_t));
+    assert(("Out of memory!", object->sections && as->capacities));
+
+    section = object->sections + object->num_sections;
+    section->name = copy_name(name, length);
+    section->words = NULL;
+    section->size = 0;
+    as->capacities[object->num_sections] = 0;
+    as->section = object->num_sections++;
+    return 1;
+}
+
+/* Makes room for count more words in the current section */
+static int reserve(struct assembler *as, size_t count)
+{
+    struct vcpuas_section *section = as->object->sections + as->section;
+    size_t *capacity = as->capacities + as->section;
+
+    if(count > VCPU_MEM_SIZE - section->size) {
+        as->full = 1;
+        return error(&as->report, "the program does not fit in memory");
+    }
+
+    if(section->size + count > *capacity) {
+        while(section->size + count > *capacity)
+            *capacity = *capacity ? *capacity * 2 : 256;
+        section->words = realloc(section->words, *capacity * sizeof(unsigned short));
+        assert(("Out of memory!", section->words));
+    }
+
+    return 1;
+}
+
+static int emit(struct assembler *as, unsigned short word)
+{
+    struct vcpuas_section *section = as->object->sections + as->section;
+
+    if(!reserve(as, 1))
+        return 0;
+    section->words[section->size++] = word;
+    return 1;
+}
+
+static int define_label(struct assembler *as, const struct token *name)
+{
+    struct symbol *symbol;
+    size_t index;
+
+    if(name->length > MAX_IDENTIFIER)
+        return error(at(as, name), "%.*s: label too long", (int)name->length, name->text);
+    if(name->keyword)
+        return error(at(as, name), "%.*s: reserved name used as a label", (int)name->length, name->text);
+
+    /* Interning may move the table */
+    index = intern_symbol(&as->labels, name->text, name->length);
+    symbol = as->labels.symbols + index;
+    if(symbol->defined)
+        return error(at(as, name), "%.*s: label redefined", (int)name->length, name->text);
+    symbol->section = (unsigned short)as->section;
+    symbol->value = (unsigned short)as->object->sections[as->section].size;
+    symbol->defined = 1;
+    return 1;
+}
+
+/* Zero for now and a relocation for the word about to be emitted */
+static unsigned short reference_label(struct assembler *as, const struct token *name)
+{
+    struct vcpuas_object *object = as->object;
+    struct vcpuas_relocation *relocation;
+    size_t label = intern_symbol(&as->labels, name->text, name->length);
+
+    if(object->num_relocations >= as->max_relocations) {
+        as->max_relocations = as->max_relocations ? as->max_relocations * 2 : 256;
+        object->relocations = realloc(object->relocations, as->max_relocations * sizeof(struct vcpuas_relocation));
+        as->targets = realloc(as->targets, as->max_relocations * sizeof(size_t));
+        assert(("Out of memory!", object->relocations && as->targets));
+    }
+
+    relocation = object->relocations + object->num_relocations;
+    relocation->section = (unsigned short)as->section;
+    relocation->offset = (unsigned short)object->sections[as->section].size;
+    relocation->kind = VCPUAS_RELOC_SECTION;
+    relocation->target = 0;
+    relocation->line_no = as->report.line_no;
+    relocation->column = name->column;
+    as->targets[object->num_relocations++] = label;
+    return 0;
+}
+
+static void add_symbol(struct vcpuas_object *object, const struct symbol *label, int kind)
+{
+    struct vcpuas_symbol *symbol;
+
+    object->symbols = realloc(object->symbols, (object->num_symbols + 1) * sizeof(struct vcpuas_symbol));
+    assert(("Out of memory!", object->symbols));
+
+    symbol = object->symbols + object->num_symbols++;
+    symbol->name = copy_name(label->name, label->length);
+    symbol->kind = kind;
+    symbol->section = (kind == VCPUAS_SYMBOL_EXPORT) ? label->section : 0;
+    symbol->value = (kind == VCPUAS_SYMBOL_EXPORT) ? label->value : 0;
+}
+
+/* Labels this source defined become offsets into their
+ * section, the ones it did not become imports */
+static void finish_object(struct assembler *as)
+{
+    struct vcpuas_object *object = as->object;
+    struct vcpuas_relocation *relocation;
+    struct symbol *label;
+    size_t i;
+
+    for(i = 0; i < as->labels.num_symbols; i++) {
+        label = as->labels.symbols + i;
+        if(!label->exported)
+            continue;
+        if(!label->defined) {
+            as->report.line_no = label->line_no;
+            as->report.column = label->column;
+            error(&as->report, "%s: exported but never defined", label->name);
+            continue;
+        }
+        add_symbol(object, label, VCPUAS_SYMBOL_EXPORT);
+    }
+
+    for(i = 0; i < object->num_relocations; i++) {
+        relocation = object->relocations + i;
+        label = as->labels.symbols + as->targets[i];
+
+        if(label->defined) {
+            object->sections[relocation->section].words[relocation->offset] += label->value;
+            relocation->kind = VCPUAS_RELOC_SECTION;
+            relocation->target = label->section;
+            continue;
+        }
+
+        if(label->import == NO_IMPORT) {
+            if(object->num_symbols > USHRT_MAX) {
+                as->report.line_no = relocation->line_no;
+                error(&as->report, "too many symbols");
+                return;
+            }
+            label->import = object->num_symbols;
+            add_symbol(object, label, VCPUAS_SYMBOL_IMPORT);
+        }
+        relocation->kind = VCPUAS_RELOC_SYMBOL;
+        relocation->target = (unsigned short)label->import;
+    }
+}
+
+static int is_name_char(int c)
+{
+    return isalnum(c) || c == '_' || c == '.';
+}
+
+static const struct keyword *find_keyword(const char *name, size_t length, unsigned long hash)
+{
+    const struct keyword *keyword;
+    size_t i;
+
+    if(!keyword_slots[KEYWORD_SLOT(hash)])
+        return NULL;
+
+    keyword = keywords + keyword_slots[KEYWORD_SLOT(hash)] - 1;
+    for(i = 0; i < length; i++) {
+        if(tolower((unsigned char)name[i]) != keyword->name[i])
+            return NULL;
+    }
+    return keyword->name[length] ? NULL : keyword;
+}
+
+/* The next token of the current line; at its end, or at a
+ * comment, it keeps returning TOKEN_END. Quotes do not span
+ * lines and have no escapes. */
+static void lex(struct assembler *as, struct token *token)
+{
+    struct lexer *lexer = &as->lexer;
+    const char *p = lexer->p, *end = lexer->end;
+    unsigned long hash;
+    int c;
+
+    while(p < end && *p != '\n' && isspace((unsigned char)*p))
+        p++;
+
+    token->text = p;
+    token->length = 1;
+    token->column = (size_t)(p - lexer->line) + 1;
+    token->keyword = NULL;
+
+    if(p >= end || *p == '\n' || *p == '#') {
+        token->type = TOKEN_END;
+        token->length = 0;
+        lexer->p = p;
+        return;
+    }
+
+    c = (unsigned char)*p;
+    if(isalpha(c) || c == '_' || (c == '.' && p + 1 < end && is_name_char((unsigned char)p[1]))) {
+        token->type = (c == '.') ? TOKEN_DIRECTIVE : TOKEN_NAME;
+        hash = KEYWORD_SEED;
+        do {
+            hash = ((hash ^ ((unsigned char)*p | 0x20)) * 16777619UL) & 0xFFFFFFFFUL;
+            p++;
+        } while(p < end && is_name_char((unsigned char)*p));
+        token->length = (size_t)(p - token->text);
+        token->keyword = find_keyword(token->text, token->length, hash);
+    }
+    else if(isdigit(c) || ((c == '-' || c == '+') && p + 1 < end && isdigit((unsigned char)p[1]))) {
+        token->type = TOKEN_NUMBER;
+        for(p++; p < end && (isalnum((unsigned char)*p) || *p == '_'); p++);
+        token->length = (size_t)(p - token->text);
+    }
+    else if(c == '\'' && end - p >= 3 && p[1] != '\n' && p[2] == '\'') {
+        token->type = TOKEN_CHAR;
+        token->length = 3;
+        p += 3;
+    }
+    else {
+        token->type = TOKEN_OTHER;
+        p++;
+        if(c == '"') {
+            while(p < end && *p != '\n' && *p != '"')
+                p++;
+            if(p < end && *p == '"') {
+                token->type = TOKEN_STRING;
+                token->text++;
+                token->length = (size_t)(p - token->text);
+                p++;
+            }
+            else {
+                p = token->text + 1;
+            }
+        }
+    }
+
+    lexer->p = p;
+}
+
+static int is_char(const struct token *token, char c)
+{
+    return token->type == TOKEN_OTHER && token->text[0] == c;
+}
+
+/* Decimal, 0x hexadecimal or 0b binary, with an optional sign.
+ * Too large a value is clamped, as strtol did before. */
+static int parse_number(const struct token *token, long *value)
+{
+    const char *s = token->text, *end = token->text + token->length;
+    unsigned long n = 0;
+    int base = 10, negative = 0, digit;
+
+    if(*s == '-' || *s == '+')
+        negative = (*s++ == '-');
+    if(end - s > 2 && s[0] == '0' && tolower((unsigned char)s[1]) == 'x') {
+        base = 16;
+        s += 2;
+    }
+    else if(end - s > 2 && s[0] == '0' && tolower((unsigned char)s[1]) == 'b') {
+        base = 2;
+        s += 2;
+    }
+
+    for(; s < end; s++) {
+        if(isdigit((unsigned char)*s))
+            digit = *s - '0';
+        else if(isalpha((unsigned char)*s))
+            digit = tolower((unsigned char)*s) - 'a' + 10;
+        else
+            return 0;
+        if(digit >= base)
+            return 0;
+        n = n * base + digit;
+        if(n > 0x7FFFFFFFUL)
+            n = 0x7FFFFFFFUL;
+    }
+
+    *value = negative ? -(long)n : (long)n;
+    return 1;
+}
+
+/* Checks a $ operand or a .dw value before anything is emitted */
+static int check_value(struct assembler *as, const struct token *token)
+{
+    long value;
+
+    switch(token->type) {
+        case TOKEN_NAME:
+        case TOKEN_CHAR:
+            return 1;
+        case TOKEN_NUMBER:
+            if(!parse_number(token, &value))
+                return error(at(as, token), "%.*s: invalid number", (int)token->length, token->text);
+            return 1;
+        case TOKEN_END:
+            return error(at(as, token), "value expected");
+        default:
+            if(is_char(token, '\''))
+                return error(at(as, token), "invalid character literal");
+            return error(at(as, token), "%.*s: value expected", (int)token->length, token->text);
+    }
+}
+
+/* A checked label, character literal or number, for the word emitted next */
+static unsigned short token_value(struct assembler *as, const struct token *token)
+{
+    long value = 0;
+
+    if(token->type == TOKEN_NAME)
+        return reference_label(as, token);
+    if(token->type == TOKEN_CHAR)
+        return (unsigned char)token->text[1];
+    parse_number(token, &value);
+    return (unsigned short)value;
+}
+
+/* Nothing may follow the last operand */
+static int expect_end(struct assembler *as, const struct token *directive)
+{
+    struct token token;
+
+    lex(as, &token);
+    if(token.type != TOKEN_END)
+        return error(at(as, &token), "too many operands for %.*s", (int)directive->length, directive->text);
+    return 1;
+}
+
+/* The one name a .section or .global line takes */
+static int parse_name(struct assembler *as, const struct token *directive, struct token *name)
+{
+    lex(as, name);
+    if(name->type != TOKEN_NAME && name->type != TOKEN_DIRECTIVE)
+        return error(at(as, name), "name expected after %.*s", (int)directive->length, directive->text);
+    if(name->length > MAX_IDENTIFIER)
+        return error(at(as, name), "%.*s: name too long", (int)name->length, name->text);
+    return expect_end(as, directive);
+}
+
+static int assemble_directive(struct assembler *as, const struct token *directive)
+{
+    struct vcpuas_section *section;
+    struct token token;
+    struct symbol *symbol;
+    size_t index, i;
+    long k;
+
+    if(!directive->keyword) {
+        warning(at(as, directive), "unknown directive: %.*s", (int)directive->length, directive->text);
+        return 1;
+    }
+
+    switch(directive->keyword->value) {
+        case DIRECTIVE_DW:
+            for(lex(as, &token); token.type != TOKEN_END; lex(as, &token)) {
+                if(is_char(&token, ','))
+                    continue;
+                if(!check_value(as, &token) || !emit(as, token_value(as, &token)))
+                    return 0;
+            }
+            return 1;
+
+        case DIRECTIVE_ASCII:
+        case DIRECTIVE_ASCIZ:
+            lex(as, &token);
+            if(token.type != TOKEN_STRING)
+                return error(at(as, &token), "quoted string expected");
+            if(!expect_end(as, directive))
+                return 0;
+            for(i = 0; i < token.length; i++) {
+                if(!emit(as, (unsigned char)token.text[i]))
+                    return 0;
+            }
+            return (directive->keyword->value != DIRECTIVE_ASCIZ) || emit(as, 0);
+
+        case DIRECTIVE_SKIP:
+            k = 0;
+            lex(as, &token);
+            if(token.type != TOKEN_END) {
+                if(token.type != TOKEN_NUMBER || !parse_number(&token, &k))
+                    return error(at(as, &token), "%.*s: invalid number", (int)token.length, token.text);
+                if(!expect_end(as, directive))
+                    return 0;
+            }
+            if(k < 0)
+                return error(at(as, &token), "skipping a negative number of words");
+            if(k == 0)
+                warning(at(as, directive), "skipping zero words");
+            if(k > VCPU_MEM_SIZE) {
+                as->full = 1;
+                return error(&as->report, "the program does not fit in memory");
+            }
+            if(!reserve(as, (size_t)k))
+                return 0;
+            section = as->object->sections + as->section;
+            memset(section->words + section->size, 0, (size_t)k * sizeof(unsigned short));
+            section->size += (size_t)k;
+            return 1;
+
+        case DIRECTIVE_SECTION:
+            if(!parse_name(as, directive, &token))
+                return 0;
+            return select_section(as, token.text, token.length);
+
+        default:
+            if(!parse_name(as, directive, &token))
+                return 0;
+            if(token.type != TOKEN_NAME || token.keyword)
+                return error(at(as, &token), "%.*s: not a label", (int)token.length, token.text);
+            index = intern_symbol(&as->labels, token.text, token.length);
+            symbol = as->labels.symbols + index;
+            if(!symbol->exported) {
+                symbol->exported = 1;
+                symbol->line_no = as->report.line_no;
+                symbol->column = token.column;
+            }
+            return 1;
+    }
+}
+
+/* mnemonic [<prefix><operand>[, <prefix><operand>]], with token the
+ * one after the mnemonic; the immediates follow the instruction word
+ * in operand order */
+static int assemble_instruction(struct assembler *as, const struct token *mnemonic, struct token *token)
+{
+    const struct keyword *keyword = mnemonic->keyword;
+    struct token values[2], prefix;
+    unsigned short word;
+    size_t num_values, i;
+
+    if(!keyword || keyword->kind != KEYWORD_OPCODE)
+        return error(at(as, mnemonic), "unknown mnemonic: %.*s", (int)mnemonic->length, mnemonic->text);
+
+    word = (keyword->value & 0x3F) << 10;
+    num_values = 0;
+
+    for(i = 0; i < 2 && token->type != TOKEN_END; i++) {
+        if(i) {
+            if(!is_char(token, ','))
+                return error(at(as, token), "',' expected before %c", token->text[0]);
+            lex(as, token);
+            if(token->type == TOKEN_END)
+                return error(at(as, token), "operand expected after ','");
+        }
+
+        prefix = *token;
+        lex(as, token);
+        if(token->type == TOKEN_END)
+            return error(at(as, &prefix), "operand expected after %c", prefix.text[0]);
+
+        if(is_char(&prefix, '$')) {
+            if(!check_value(as, token))
+                return 0;
+            word |= i ? (1 << 4) : (1 << 9);
+            values[num_values++] = *token;
+        }
+        else if(is_char(&prefix, '%')) {
+            if(!token->keyword || token->keyword->kind != KEYWORD_REGISTER)
+                return error(at(as, token), "unknown register: %.*s", (int)token->length, token->text);
+            word |= i ? (token->keyword->value & 0x0F) : ((token->keyword->value & 0x0F) << 5);
+        }
+        else {
+            return error(at(as, &prefix), "unknown operand prefix: %c", prefix.text[0]);
+        }
+
+        lex(as, token);
+    }
+
+    if(token->type != TOKEN_END)
+        return error(at(as, token), "too many operands for %.*s", (int)mnemonic->length, mnemonic->text);
+
+    if(!emit(as, word))
+        return 0;
+    for(i = 0; i < num_values; i++) {
+        if(!emit(as, token_value(as, values + i)))
+            return 0;
+    }
+    return 1;
+}
+
+/* Labels, then a directive or an instruction */
+static void assemble_line(struct assembler *as)
+{
+    struct token token, next;
+
+    lex(as, &token);
+    for(;;) {
+        if(token.type == TOKEN_END)
+            return;
+        if(token.type == TOKEN_DIRECTIVE) {
+            assemble_directive(as, &token);
+            return;
+        }
+        if(token.type != TOKEN_NAME) {
+            error(at(as, &token), "unknown mnemonic: %.*s", (int)token.length, token.text);
+            return;
+        }
+
+        lex(as, &next);
+        if(!is_char(&next, ':')) {
+            assemble_instruction(as, &token, &next);
+            return;
+        }
+        if(!define_label(as, &token))
+            return;
+        lex(as, &token);
+    }
+}
+
+/* One pass over the source; labels used before their definition
+ * wait for the end. A line in error is dropped and assembly goes
+ * on with the next one. */
+static void assemble_source(struct assembler *as, const char *source, size_t size)
+{
+    struct lexer *lexer = &as->lexer;
+    const char *newline;
+
+    lexer->p = source;
+    lexer->end = source + size;
+
+    while(lexer->p < lexer->end && !as->full) {
+        lexer->line = lexer->p;
+        as->report.line_no++;
+        assemble_line(as);
+
+        newline = memchr(lexer->p, '\n', (size_t)(lexer->end - lexer->p));
+        lexer->p = newline ? newline + 1 : lexer->end;
+    }
+}
+
+int vcpuas_assemble_object(const char *source, size_t size, struct vcpuas_object *object, struct vcpuas_result *result)
+{
+    struct assembler as;
+
+    memset(result, 0, sizeof(struct vcpuas_result));
+    memset(object, 0, sizeof(struct vcpuas_object));
+    memset(&as, 0, sizeof(as));
+    as.report.result = result;
+    as.object = object;
+
+    select_section(&as, ".text", 5);
+    assemble_source(&as, source, size);
+    if(!as.full)
+        finish_object(&as);
+
+    free_symbols(&as.labels);
+    free(as.capacities);
+    free(as.targets);
+
+    if(result->num_errors) {
+        vcpuas_free_object(object);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Where the symbols of one object end up */
+struct placement {
+    size_t *bases;                  /* Address of each section */
+    size_t *addresses;              /* Address of each symbol */
+    int *resolved;
+};
+
+/* Diagnostics go after the ones already in result */
+static int link_objects(const struct vcpuas_object *objects, size_t num_objects, struct vcpuas_result *result)
+{
+    struct report report;
+    struct symbol_table names, globals;
+    struct placement *placements, *placement;
+    const struct vcpuas_object *object;
+    const struct vcpuas_symbol *symbol;
+    const struct vcpuas_relocation *relocation;
+    struct symbol *global;
+    size_t *sizes, *cursors;
+    unsigned short *image;
+    size_t i, j, k, address;
+
+    memset(&report, 0, sizeof(report));
+    memset(&names, 0, sizeof(names));
+    memset(&globals, 0, sizeof(globals));
+    report.result = result;
+
+    placements = calloc(num_objects ? num_objects : 1, sizeof(struct placement));
+    assert(("Out of memory!", placements));
+
+    /* Section names in the order they first appear; each
+     * section keeps the index of its name in bases for now */
+    for(i = 0; i < num_objects; i++) {
+        object = objects + i;
+        placement = placements + i;
+        placement->bases = malloc((object->num_sections + 1) * sizeof(size_t));
+        placement->addresses = malloc((object->num_symbols + 1) * sizeof(size_t));
+        placement->resolved = calloc(object->num_symbols + 1, sizeof(int));
+        assert(("Out of memory!", placement->bases && placement->addresses && placement->resolved));
+        for(j = 0; j < object->num_sections; j++)
+            placement->bases[j] = intern_symbol(&names, object->sections[j].name, strlen(object->sections[j].name));
+    }
+
+    sizes = calloc(names.num_symbols + 1, sizeof(size_t));
+    cursors = calloc(names.num_symbols + 1, sizeof(size_t));
+    assert(("Out of memory!", sizes && cursors));
+
+    for(i = 0; i < num_objects; i++) {
+        for(j = 0; j < objects[i].num_sections; j++)
+            sizes[placements[i].bases[j]] += objects[i].sections[j].size;
+    }
+
+    address = 0;
+    for(k = 0; k < names.num_symbols; k++) {
+        cursors[k] = address;
+        address += sizes[k];
+    }
+
+    if(address > VCPU_MEM_SIZE) {
+        error(&report, "the program does not fit in memory");
+        goto done;
+    }
+
+    for(i = 0; i < num_objects; i++) {
+        for(j = 0; j < objects[i].num_sections; j++) {
+            k = placements[i].bases[j];
+            placements[i].bases[j] = cursors[k];
+            cursors[k] += objects[i].sections[j].size;
+        }
+    }
+
+    /* Exports first, so that any object may import from any other */
+    for(i = 0; i < num_objects; i++) {
+        object = objects + i;
+        placement = placements + i;
+        report.object = i;
+        for(j = 0; j < object->num_symbols; j++) {
+            symbol = object->symbols + j;
+            if(symbol->kind != VCPUAS_SYMBOL_EXPORT)
+                continue;
+
+            placement->addresses[j] = placement->bases[symbol->section] + symbol->value;
+            placement->resolved[j] = 1;
+
+            k = intern_symbol(&globals, symbol->name, strlen(symbol->name));
+            global = globals.symbols + k;
+            if(global->defined) {
+                error(&report, "%s: label redefined", symbol->name);
+                continue;
+            }
+            global->value = (unsigned short)placement->addresses[j];
+            global->defined = 1;
+        }
+    }
+
+    for(i = 0; i < num_objects; i++) {
+        object = objects + i;
+        placement = placements + i;
+        for(j = 0; j < object->num_symbols; j++) {
+            if(object->symbols[j].kind != VCPUAS_SYMBOL_IMPORT)
+                continue;
+            k = find_symbol(&globals, object->symbols[j].name, strlen(object->symbols[j].name));
+            if(k != (size_t)-1) {
+                placement->addresses[j] = globals.symbols[k].value;
+                placement->resolved[j] = 1;
+            }
+        }
+    }
+
+    image = calloc(VCPU_MEM_SIZE, sizeof(unsigned short));
+    assert(("Out of memory!", image));
+
+    for(i = 0; i < num_objects; i++) {
+        object = objects + i;
+        for(j = 0; j < object->num_sections; j++) {
+            if(object->sections[j].size)
+                memcpy(image + placements[i].bases[j], object->sections[j].words, object->sections[j].size * sizeof(unsigned short));
+        }
+    }
+
+    /* An undefined label is reported at every use, as it was read */
+    for(i = 0; i < num_objects; i++) {
+        object = objects + i;
+        placement = placements + i;
+        report.object = i;
+        for(j = 0; j < object->num_relocations; j++) {
+            relocation = object->relocations + j;
+            address = placement->bases[relocation->section] + relocation->offset;
+            report.line_no = relocation->line_no;
+            report.column = relocation->column;
+
+            if(relocation->kind == VCPUAS_RELOC_SECTION) {
+                image[address] += (unsigned short)placement->bases[relocation->target];
+                continue;
+            }
+
+            if(!placement->resolved[relocation->target]) {
+                error(&report, "unknown label: %s", object->symbols[relocation->target].name);
+                continue;
+            }
+            image[address] += (unsigned short)placement->addresses[relocation->target];
+        }
+    }
+
+    if(result->num_errors) {
+        free(image);
+    }
+    else {
+        result->image = image;
+        result->image_size = 0;
+        for(k = 0; k < names.num_symbols; k++)
+            result->image_size += sizes[k];
+    }
+
+done:
+    for(i = 0; i < num_objects; i++) {
+        free(placements[i].bases);
+        free(placements[i].addresses);
+        free(placements[i].resolved);
+    }
+    free(placements);
+    free(sizes);
+    free(cursors);
+    free_symbols(&names);
+    free_symbols(&globals);
+    return !result->num_errors;
+}
+
+int vcpuas_assemble(const char *source, size_t size, struct vcpuas_result *result)
+{
+    struct vcpuas_object object;
+    int r;
+
+    if(!vcpuas_assemble_object(source, size, &object, result))
+        return 0;
+
+    r = link_objects(&object, 1, result);
+    vcpuas_free_object(&object);
+    return r;
+}
+
+int vcpuas_link(const struct vcpuas_object *objects, size_t num_objects, struct vcpuas_result *result)
+{
+    memset(result, 0, sizeof(struct vcpuas_result));
+    return link_objects(objects, num_objects, result);
+}
+
+/* Object files grow through this one byte at a time */
+struct writer {
+    unsigned char *data;
+    size_t size, max;
+};
+
+static void put_byte(struct writer *w, unsigned int byte)
+{
+    if(w->size >= w->max) {
+        w->max = w->max ? w->max * 2 : 1024;
+        w->data = realloc(w->data, w->max);
+        assert(("Out of memory!", w->data));
+    }
+    w->data[w->size++] = (unsigned char)byte;
+}
+
+static void put_word(struct writer *w, unsigned int word)
+{
+    put_byte(w, (word >> 8) & 0xFF);
+    put_byte(w, word & 0xFF);
+}
+
+static void put_long(struct writer *w, unsigned long value)
+{
+    put_word(w, (unsigned int)((value >> 16) & 0xFFFF));
+    put_word(w, (unsigned int)(value & 0xFFFF));
+}
+
+static void put_string(struct writer *w, const char *s)
+{
+    size_t length = strlen(s);
+
+    put_word(w, (unsigned int)length);
+    while(length--)
+        put_byte(w, (unsigned char)*s++);
+}
+
+void vcpuas_write_object(const struct vcpuas_object *object, unsigned char **data, size_t *size)
+{
+    const struct vcpuas_relocation *relocation;
+    struct writer w;
+    size_t i, j;
+
+    memset(&w, 0, sizeof(w));
+
+    for(i = 0; i < 4; i++)
+        put_byte(&w, (unsigned char)OBJECT_MAGIC[i]);
+    put_word(&w, OBJECT_VERSION);
+
+    put_long(&w, (unsigned long)object->num_sections);
+    for(i = 0; i < object->num_sections; i++) {
+        put_string(&w, object->sections[i].name);
+        put_long(&w, (unsigned long)object->sections[i].size);
+        for(j = 0; j < object->sections[i].size; j++)
+            put_word(&w, object->sections[i].words[j]);
+    }
+
+    put_long(&w, (unsigned long)object->num_symbols);
+    for(i = 0; i < object->num_symbols; i++) {
+        put_string(&w, object->symbols[i].name);
+        put_byte(&w, (unsigned int)object->symbols[i].kind);
+        put_word(&w, object->symbols[i].section);
+        put_word(&w, object->symbols[i].value);
+    }
+
+    put_long(&w, (unsigned long)object->num_relocations);
+    for(i = 0; i < object->num_relocations; i++) {
+        relocation = object->relocations + i;
+        put_word(&w, relocation->section);
+        put_word(&w, relocation->offset);
+        put_byte(&w, (unsigned int)relocation->kind);
+        put_word(&w, relocation->target);
+    }
+
+    *data = w.data;
+    *size = w.size;
+}
+
+/* Reads past the end give zeros and leave bad set */
+struct reader {
+    const unsigned char *data;
+    size_t size, pos;
+    int bad;
+};
+
+static unsigned int get_byte(struct reader *r)
+{
+    if(r->pos >= r->size) {
+        r->bad = 1;
+        return 0;
+    }
+    return r->data[r->pos++];
+}
+
+static unsigned int get_word(struct reader *r)
+{
+    unsigned int hi = get_byte(r);
+    return (hi << 8) | get_byte(r);
+}
+
+static unsigned long get_long(struct reader *r)
+{
+    unsigned long hi = get_word(r);
+    return (hi << 16) | get_word(r);
+}
+
+/* A count of records at least record bytes long each;
+ * zero and bad when there are not that many bytes left */
+static size_t get_count(struct reader *r, size_t record)
+{
+    unsigned long count = get_long(r);
+
+    if(count > (r->size - r->pos) / record) {
+        r->bad = 1;
+        return 0;
+    }
+    return (size_t)count;
+}
+
+static char *get_string(struct reader *r)
+{
+    size_t length = get_word(r);
+    char *s;
+
+    if(r->bad || length > r->size - r->pos || !length) {
+        r->bad = 1;
+        return copy_name("", 0);
+    }
+
+    s = malloc(length + 1);
+    assert(("Out of memory!", s));
+    memcpy(s, r->data + r->pos, length);
+    s[length] = 0;
+    r->pos += length;
+    return s;
+}
+
+/* Anything that points outside of the object makes it invalid */
+int vcpuas_read_object(const unsigned char *data, size_t size, struct vcpuas_object *object)
+{
+    struct vcpuas_section *section;
+    struct vcpuas_symbol *symbol;
+    struct vcpuas_relocation *relocation;
+    struct reader r;
+    size_t i, j;
+
+    memset(object, 0, sizeof(struct vcpuas_object));
+    memset(&r, 0, sizeof(r));
+    r.data = data;
+    r.size = size;
+
+    if(size < 6 || memcmp(data, OBJECT_MAGIC, 4))
+        return 0;
+    r.pos = 4;
+    if(get_word(&r) != OBJECT_VERSION)
+        return 0;
+
+    object->num_sections = get_count(&r, 6);
+    if(object->num_sections > USHRT_MAX + 1UL)
+        r.bad = 1;
+    object->sections = calloc(object->num_sections + 1, sizeof(struct vcpuas_section));
+    assert(("Out of memory!", object->sections));
+    for(i = 0; i < object->num_sections && !r.bad; i++) {
+        section = object->sections + i;
+        section->name = get_string(&r);
+        section->size = get_count(&r, 2);
+        if(section->size > VCPU_MEM_SIZE)
+            r.bad = 1;
+        if(r.bad)
+            break;
+        section->words = malloc((section->size + 1) * sizeof(unsigned short));
+        assert(("Out of memory!", section->words));
+        for(j = 0; j < section->size; j++)
+            section->words[j] = (unsigned short)get_word(&r);
+    }
+
+    object->num_symbols = r.bad ? 0 : get_count(&r, 7);
+    if(object->num_symbols > USHRT_MAX + 1UL)
+        r.bad = 1;
+    object->symbols = calloc(object->num_symbols + 1, sizeof(struct vcpuas_symbol));
+    assert(("Out of memory!", object->symbols));
+    for(i = 0; i < object->num_symbols && !r.bad; i++) {
+        symbol = object->symbols + i;
+        symbol->name = get_string(&r);
+        symbol->kind = (int)get_byte(&r);
+        symbol->section = (unsigned short)get_word(&r);
+        symbol->value = (unsigned short)get_word(&r);
+        if(symbol->kind == VCPUAS_SYMBOL_EXPORT) {
+            if(symbol->section >= object->num_sections || symbol->value > object->sections[symbol->section].size)
+                r.bad = 1;
+        }
+        else if(symbol->kind != VCPUAS_SYMBOL_IMPORT) {
+            r.bad = 1;
+        }
+    }
+
+    object->num_relocations = r.bad ? 0 : get_count(&r, 7);
+    object->relocations = calloc(object->num_relocations + 1, sizeof(struct vcpuas_relocation));
+    assert(("Out of memory!", object->relocations));
+    for(i = 0; i < object->num_relocations && !r.bad; i++) {
+        relocation = object->relocations + i;
+        relocation->section = (unsigned short)get_word(&r);
+        relocation->offset = (unsigned short)get_word(&r);
+        relocation->kind = (int)get_byte(&r);
+        relocation->target = (unsigned short)get_word(&r);
+        relocation->line_no = 0;
+        relocation->column = 0;
+        if(relocation->section >= object->num_sections || relocation->offset >= object->sections[relocation->section].size)
+            r.bad = 1;
+        else if(relocation->kind == VCPUAS_RELOC_SECTION && relocation->target >= object->num_sections)
+            r.bad = 1;
+        else if(relocation->kind == VCPUAS_RELOC_SYMBOL && relocation->target >= object->num_symbols)
+            r.bad = 1;
+        else if(relocation->kind != VCPUAS_RELOC_SECTION && relocation->kind != VCPUAS_RELOC_SYMBOL)
+            r.bad = 1;
+    }
+
+    if(r.bad || r.pos != r.size) {
+        vcpuas_free_object(object);
+        return 0;
+    }
+
+    return 1;
+}
+
+void vcpuas_free_result(struct vcpuas_result *result)
+{
+    free(result->image);
+    free(result->diagnostics);
+    memset(result, 0, sizeof(struct vcpuas_result));
+}
+
+void vcpuas_free_object(struct vcpuas_object *object)
+{
+    size_t i;
+
+    for(i = 0; i < object->num_sections; i++) {
+        free(object->sections[i].name);
+        free(object->sections[i].words);
+    }
+    for(i = 0; i < object->num_symbols; i++)
+        free(object->symbols[i].name);
+    free(object->sections);
+    free(object->symbols);
+    free(object->relocations);
+    memset(object, 0, sizeof(struct vcpuas_object));
+}
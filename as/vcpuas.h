@@ -0,0 +1,91 @@
+#ifndef _VCPUAS_H_
+#define _VCPUAS_H_ 1
+#include <stddef.h>
+
+#define VCPUAS_ERROR        0
+#define VCPUAS_WARNING      1
+
+#define VCPUAS_MESSAGE_SIZE 160
+
+struct vcpuas_diagnostic {
+    int severity;                   /* VCPUAS_ERROR or VCPUAS_WARNING */
+    size_t line_no;                 /* One-based, zero when not about a line */
+    size_t column;                  /* One-based, in bytes, zero when not about a token */
+    size_t object;                  /* Which of the objects given to vcpuas_link */
+    char message[VCPUAS_MESSAGE_SIZE];
+};
+
+struct vcpuas_result {
+    unsigned short *image;          /* Host byte order, loaded at 0x0000; NULL after errors */
+    size_t image_size;              /* In words */
+    struct vcpuas_diagnostic *diagnostics;
+    size_t num_diagnostics;
+    size_t num_errors;
+};
+
+/* Relocatable objects. Code goes to the section named by the last
+ * .section directive, ".text" before the first one. Labels are
+ * offsets into their section and every $label immediate gets a
+ * relocation; labels named by .global are exported, labels used
+ * but never defined are imported. */
+#define VCPUAS_SYMBOL_EXPORT    0 /* Defined in section at value */
+#define VCPUAS_SYMBOL_IMPORT    1 /* Defined by another object */
+
+#define VCPUAS_RELOC_SECTION    0 /* Add the address of section target of this object */
+#define VCPUAS_RELOC_SYMBOL     1 /* Add the address of symbol target */
+
+struct vcpuas_section {
+    char *name;
+    unsigned short *words;          /* Host byte order */
+    size_t size;                    /* In words, at most VCPU_MEM_SIZE */
+};
+
+struct vcpuas_symbol {
+    char *name;
+    int kind;                       /* VCPUAS_SYMBOL_* */
+    unsigned short section;
+    unsigned short value;
+};
+
+struct vcpuas_relocation {
+    unsigned short section;         /* The word at offset in section */
+    unsigned short offset;
+    int kind;                       /* VCPUAS_RELOC_* */
+    unsigned short target;
+    size_t line_no, column;         /* Where it came from; not stored in files */
+};
+
+struct vcpuas_object {
+    struct vcpuas_section *sections;
+    size_t num_sections;
+    struct vcpuas_symbol *symbols;
+    size_t num_symbols;
+    struct vcpuas_relocation *relocations;
+    size_t num_relocations;
+};
+
+/* Assembles size bytes of source text into result. Diagnostics come
+ * in source order, followed by the labels that were never defined.
+ * Nothing is read or written outside of the arguments, so any number
+ * of threads may assemble at once. Returns nonzero without errors. */
+int vcpuas_assemble(const char *source, size_t size, struct vcpuas_result *result);
+
+/* Assembles into a relocatable object; result only gets diagnostics */
+int vcpuas_assemble_object(const char *source, size_t size, struct vcpuas_object *object, struct vcpuas_result *result);
+
+/* Lays out the sections of every object into one image: sections of
+ * the same name go together, names in the order they first appear,
+ * objects in the order given. Then fills in every relocation. */
+int vcpuas_link(const struct vcpuas_object *objects, size_t num_objects, struct vcpuas_result *result);
+
+/* Object files are "VCPO", a version word and then the sections, the
+ * symbols and the relocations, all in big endian. Writing allocates
+ * *data; reading returns zero when the data is not a valid object. */
+void vcpuas_write_object(const struct vcpuas_object *object, unsigned char **data, size_t *size);
+int vcpuas_read_object(const unsigned char *data, size_t size, struct vcpuas_object *object);
+
+/* Release what the functions above allocated */
+void vcpuas_free_result(struct vcpuas_result *result);
+void vcpuas_free_object(struct vcpuas_object *object);
+
+#endif
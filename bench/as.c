@@ -0,0 +1,201 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vcpuas.h>
+
+static char print_buffer[4096] = { 0 };
+static const char *argv_0 = NULL;
+
+#define _ansi_reset     "\033[0m"
+#define _ansi_error     "\033[1;31m"
+
+static void lprintf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, ap);
+    fprintf(stderr, "%s\n", print_buffer);
+    va_end(ap);
+}
+
+static void error(const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, va);
+    fprintf(stderr, "%s: %sfatal: %s%s\n", argv_0, _ansi_error, _ansi_reset, print_buffer);
+    va_end(va);
+    exit(1);
+}
+
+static double bench_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static char *read_source(const char *path, size_t *size)
+{
+    FILE *infile;
+    char *source = NULL;
+    size_t max_size = 0, n;
+
+    infile = fopen(path, "rb");
+    if(!infile)
+        error("%s: %s", path, strerror(errno));
+
+    *size = 0;
+    do {
+        if(*size == max_size) {
+            max_size = max_size ? max_size * 2 : 0x10000;
+            source = realloc(source, max_size);
+            if(!source)
+                error("Out of memory!");
+        }
+        n = fread(source + *size, 1, max_size - *size, infile);
+        *size += n;
+    } while(n);
+
+    fclose(infile);
+    return source;
+}
+
+/* A source of the given number of lines with a bit of everything the
+ * assembler reads: labels used before and after their definition,
+ * both operand kinds, data directives and comments. Every line makes
+ * two words at most, so up to 32768 lines fit in memory. */
+static char *generate_source(unsigned long num_lines, size_t *size)
+{
+    char *source;
+    size_t max_size = num_lines * 64 + 1;
+    unsigned long i, target;
+    int n;
+
+    source = malloc(max_size);
+    if(!source)
+        error("Out of memory!");
+
+    *size = 0;
+    for(i = 0; i < num_lines; i++) {
+        target = (i * 7919UL) % num_lines;
+        switch(i % 6) {
+            case 0:
+                n = sprintf(source + *size, "l%lu: mov $l%lu, %%r%lu\n", i, target, i % 10);
+                break;
+            case 1:
+                n = sprintf(source + *size, "l%lu:\n    add %%r%lu, %%r%lu  # comment\n", i, i % 10, (i + 1) % 10);
+                break;
+            case 2:
+                n = sprintf(source + *size, "l%lu: ige $0x%04lX, %%R%lu\n", i, target, i % 10);
+                break;
+            case 3:
+                n = sprintf(source + *size, "l%lu: .dw l%lu, 'A'\n", i, target);
+                break;
+            case 4:
+                n = sprintf(source + *size, "l%lu: .asciz \"#\"\n", i);
+                break;
+            default:
+                n = sprintf(source + *size, "l%lu: CAL $l%lu\n", i, target);
+                break;
+        }
+        *size += (size_t)n;
+    }
+
+    return source;
+}
+
+static size_t count_lines(const char *source, size_t size)
+{
+    size_t i, num_lines = 0;
+
+    for(i = 0; i < size; i++)
+        num_lines += (source[i] == '\n');
+    return num_lines + (size && source[size - 1] != '\n');
+}
+
+/* Assembles the source repeats times and writes the fastest run */
+static void bench_source(const char *name, const char *source, size_t size, unsigned int repeats)
+{
+    struct vcpuas_result result;
+    double start, seconds, best = 0.0;
+    size_t num_lines = count_lines(source, size);
+    unsigned int i;
+
+    for(i = 0; i < repeats; i++) {
+        start = bench_clock();
+        if(!vcpuas_assemble(source, size, &result))
+            error("%s: does not assemble", name);
+        seconds = bench_clock() - start;
+        vcpuas_free_result(&result);
+
+        if(!i || seconds < best)
+            best = seconds;
+    }
+
+    printf("{\"source\":\"%s\",\"lines\":%lu,\"bytes\":%lu,\"seconds\":%.6f,\"lines_per_second\":%.0f,\"mb_per_second\":%.3f}\n",
+        name, (unsigned long)num_lines, (unsigned long)size, best,
+        best > 0.0 ? (double)num_lines / best : 0.0,
+        best > 0.0 ? (double)size / best * 1e-6 : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int repeats = 20;
+    unsigned long num_lines = 0;
+    char name[64];
+    char *source;
+    size_t size;
+    int r;
+
+    argv_0 = argv[0];
+
+    while((r = getopt(argc, argv, "r:g:vh")) != EOF) {
+        switch(r) {
+            case 'r':
+                repeats = (unsigned int)strtoul(optarg, NULL, 10);
+                if(!repeats)
+                    error("%s: invalid repeat count", optarg);
+                break;
+            case 'g':
+                num_lines = strtoul(optarg, NULL, 10);
+                if(!num_lines)
+                    error("%s: invalid line count", optarg);
+                break;
+            case 'v':
+                lprintf("%s (VCPU AS BENCH) version 0.0.x", argv_0);
+                return 0;
+            default:
+                lprintf("Usage: %s [-r <count>] [-g <lines>] [-h] [<infile>...]", argv[0]);
+                lprintf("Options:");
+                lprintf("   -r <count>      : Runs per source, the fastest counts (default: 20).");
+                lprintf("   -g <lines>      : Also assemble a generated source of that many lines.");
+                lprintf("   -v              : Print version and exit");
+                lprintf("   -h              : Write this message and exit.");
+                lprintf("   <infile>        : Assembly source, written as one JSON line each.");
+                return (r == 'h');
+        }
+    }
+
+    if(optind >= argc && !num_lines)
+        error("no input files");
+
+    if(num_lines) {
+        source = generate_source(num_lines, &size);
+        snprintf(name, sizeof(name), "generated-%lu", num_lines);
+        bench_source(name, source, size, repeats);
+        free(source);
+    }
+
+    for(; optind < argc; optind++) {
+        source = read_source(argv[optind], &size);
+        bench_source(argv[optind], source, size, repeats);
+        free(source);
+    }
+
+    return 0;
+}
@@ -0,0 +1,313 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <vcpu16.h>
+
+/* The framebuffer every workload may draw to, as on the XV-1 */
+#define BENCH_FB_BEGIN  0x8000
+#define BENCH_FB_SIZE   (80 * 25)
+
+/* What a workload reports back to the parent */
+struct bench_result {
+    int reason;
+    unsigned long instret;
+    double seconds;
+    unsigned long dirty;
+};
+
+static char print_buffer[4096] = { 0 };
+static const char *argv_0 = NULL;
+
+static unsigned short image[VCPU_MEM_SIZE];
+static size_t image_size = 0;
+static unsigned char fb_dirty[BENCH_FB_SIZE];
+static unsigned long fb_num_dirty = 0;
+
+#define _ansi_reset     "\033[0m"
+#define _ansi_warning   "\033[1;35m"
+#define _ansi_error     "\033[1;31m"
+
+static void lprintf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, ap);
+    fprintf(stderr, "%s\n", print_buffer);
+    va_end(ap);
+}
+
+static void warning(const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, va);
+    fprintf(stderr, "%s: %swarning: %s%s\n", argv_0, _ansi_warning, _ansi_reset, print_buffer);
+    va_end(va);
+}
+
+static void error(const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, va);
+    fprintf(stderr, "%s: %sfatal: %s%s\n", argv_0, _ansi_error, _ansi_reset, print_buffer);
+    va_end(va);
+    exit(1);
+}
+
+static double bench_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+/* Stands in for the LPM20 write observer, which
+ * queues every cell the guest changes */
+static void bench_fb_write(void *context, struct vcpu *cpu, unsigned short addr, unsigned short value)
+{
+    unsigned short cell = (unsigned short)(addr - BENCH_FB_BEGIN);
+
+    (void)context;
+    (void)cpu;
+    (void)value;
+
+    if(cell < BENCH_FB_SIZE && !fb_dirty[cell]) {
+        fb_dirty[cell] = 1;
+        fb_num_dirty++;
+    }
+}
+
+static void load_image(const char *path)
+{
+    FILE *infile;
+    size_t i;
+
+    infile = fopen(path, "rb");
+    if(!infile)
+        error("%s: %s", path, strerror(errno));
+    image_size = fread(image, sizeof(unsigned short), VCPU_MEM_SIZE, infile);
+    fclose(infile);
+
+    for(i = 0; i < image_size; i++)
+        image[i] = vcpu_be16_to_host(image[i]);
+}
+
+/* Runs the image loaded last for budget instructions, repeats times
+ * from power-on, and keeps the fastest run. Workloads loop forever;
+ * one that halts ends its run early. */
+static void bench_workload(struct bench_result *result, unsigned long budget, unsigned int repeats, int jit)
+{
+    struct vcpu cpu;
+    unsigned long instret;
+    unsigned int i;
+    double start, seconds;
+    int r;
+
+    init_vcpu(&cpu, NULL);
+    if(jit && !vcpu_jit_enable(&cpu))
+        warning("the core was built without the JIT");
+    vcpu_map(&cpu, BENCH_FB_BEGIN, BENCH_FB_SIZE, NULL, &bench_fb_write, NULL);
+
+    memset(result, 0, sizeof(struct bench_result));
+
+    for(i = 0; i < repeats; i++) {
+        reset_vcpu(&cpu);
+        memset(*cpu.memory, 0, sizeof(vcpu_memory_t));
+        memcpy(*cpu.memory, image, image_size * sizeof(unsigned short));
+        memset(fb_dirty, 0, sizeof(fb_dirty));
+        fb_num_dirty = 0;
+
+        start = bench_clock();
+        do {
+            instret = cpu.instret;
+            r = vcpu_run(&cpu, budget - cpu.instret);
+        } while(r == VCPU_RUN_BUDGET && cpu.instret < budget && cpu.instret != instret);
+        seconds = bench_clock() - start;
+
+        if(!i || seconds < result->seconds) {
+            result->reason = r;
+            result->instret = cpu.instret;
+            result->seconds = seconds;
+            result->dirty = fb_num_dirty;
+        }
+    }
+
+    shutdown_vcpu(&cpu);
+}
+
+/* Every workload runs in a child of its own, so the peak
+ * resident set wait4 reports belongs to that workload alone */
+static void bench_spawn(struct bench_result *result, long *peak_rss, unsigned long budget, unsigned int repeats, int jit)
+{
+    struct rusage usage;
+    int fds[2], status;
+    pid_t pid;
+
+    if(pipe(fds) < 0)
+        error("pipe: %s", strerror(errno));
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if(pid < 0)
+        error("fork: %s", strerror(errno));
+
+    if(!pid) {
+        close(fds[0]);
+        bench_workload(result, budget, repeats, jit);
+        if(write(fds[1], result, sizeof(struct bench_result)) != (ssize_t)sizeof(struct bench_result))
+            _exit(1);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    if(read(fds[0], result, sizeof(struct bench_result)) != (ssize_t)sizeof(struct bench_result))
+        error("a workload died");
+    close(fds[0]);
+
+    if(wait4(pid, &status, 0, &usage) < 0)
+        error("wait4: %s", strerror(errno));
+    *peak_rss = usage.ru_maxrss;
+#if defined(__APPLE__)
+    /* In bytes rather than kilobytes */
+    *peak_rss /= 1024;
+#endif
+}
+
+/* The workload name is the file name without directories or extension */
+static void workload_name(char *name, size_t size, const char *path)
+{
+    const char *s = strrchr(path, '/');
+    char *dot;
+
+    snprintf(name, size, "%s", s ? s + 1 : path);
+    if((dot = strrchr(name, '.')) != NULL && dot != name)
+        *dot = 0;
+}
+
+/* Finds the MIPS of a workload in an earlier vcpu-bench output */
+static int baseline_mips(const char *path, const char *name, double *mips)
+{
+    FILE *infile;
+    char *line = NULL, *s;
+    char key[512];
+    size_t line_size = 0;
+    int found = 0;
+
+    infile = fopen(path, "r");
+    if(!infile)
+        error("%s: %s", path, strerror(errno));
+
+    snprintf(key, sizeof(key), "\"workload\":\"%s\"", name);
+    while(!found && getline(&line, &line_size, infile) != -1) {
+        if(strstr(line, key) && (s = strstr(line, "\"mips\":")) != NULL) {
+            *mips = strtod(s + 7, NULL);
+            found = 1;
+        }
+    }
+
+    free(line);
+    fclose(infile);
+    return found;
+}
+
+static const char *get_reason(int reason)
+{
+    switch(reason) {
+        case VCPU_RUN_BUDGET:
+            return "budget";
+        case VCPU_RUN_HALT:
+            return "halt";
+        case VCPU_RUN_FATAL:
+            return "fatal";
+        default:
+            return "yield";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int r, jit = 0, regressed = 0;
+    unsigned long budget = 50000000;
+    unsigned int repeats = 3;
+    const char *baseline = NULL;
+    double threshold = 5.0;
+    struct bench_result result;
+    char name[256];
+    long peak_rss;
+    double mips, old_mips;
+
+    argv_0 = argv[0];
+
+    while((r = getopt(argc, argv, "n:r:b:t:Jvh")) != EOF) {
+        switch(r) {
+            case 'n':
+                budget = strtoul(optarg, NULL, 10);
+                if(!budget)
+                    error("%s: invalid instruction count", optarg);
+                break;
+            case 'r':
+                repeats = (unsigned int)strtoul(optarg, NULL, 10);
+                if(!repeats)
+                    error("%s: invalid repeat count", optarg);
+                break;
+            case 'b':
+                baseline = optarg;
+                break;
+            case 't':
+                threshold = strtod(optarg, NULL);
+                break;
+            case 'J':
+                jit = 1;
+                break;
+            case 'v':
+                lprintf("%s (VCPU BENCH) version 0.0.x", argv_0);
+                return 0;
+            default:
+                lprintf("Usage: %s [-n <count>] [-r <count>] [-b <baseline>] [-t <percent>] [-J] [-h] <infile>...", argv[0]);
+                lprintf("Options:");
+                lprintf("   -n <count>      : Instructions per run (default: 50000000).");
+                lprintf("   -r <count>      : Runs per workload, the fastest counts (default: 3).");
+                lprintf("   -b <baseline>   : Compare with an earlier output, fail on a regression.");
+                lprintf("   -t <percent>    : MIPS a workload may lose against the baseline (default: 5).");
+                lprintf("   -J              : Use the JIT when the core has one.");
+                lprintf("   -v              : Print version and exit");
+                lprintf("   -h              : Write this message and exit.");
+                lprintf("   <infile>        : Workload binary (ROM), written as one JSON line each.");
+                return (r == 'h');
+        }
+    }
+
+    if(optind >= argc)
+        error("no input files");
+
+    for(; optind < argc; optind++) {
+        load_image(argv[optind]);
+        workload_name(name, sizeof(name), argv[optind]);
+        bench_spawn(&result, &peak_rss, budget, repeats, jit);
+
+        mips = result.seconds > 0.0 ? (double)result.instret / result.seconds * 1e-6 : 0.0;
+        printf("{\"workload\":\"%s\",\"reason\":\"%s\",\"instret\":%lu,\"seconds\":%.6f,\"mips\":%.3f,\"ns_per_insn\":%.3f,\"fb_cells\":%lu,\"peak_rss_kb\":%ld}\n",
+            name, get_reason(result.reason), result.instret, result.seconds, mips,
+            result.instret ? result.seconds * 1e9 / (double)result.instret : 0.0,
+            result.dirty, peak_rss);
+
+        if(baseline && baseline_mips(baseline, name, &old_mips) && mips < old_mips * (1.0 - threshold / 100.0)) {
+            lprintf("%s: %.3f MIPS against %.3f in %s (%+.1f%%)", name, mips, old_mips, baseline, (mips / old_mips - 1.0) * 100.0);
+            regressed = 1;
+        }
+    }
+
+    return regressed;
+}
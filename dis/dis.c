@@ -6,6 +6,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <vcpu16.h>
+#if defined(VCPU_DIS_POOL)
+#include <pool.h>
+#endif
+
+/* Entry points -s may add */
+#define DIS_MAX_ENTRIES 64
 
 static const char *get_mnemonic(unsigned int id)
 {
@@ -25,6 +31,8 @@ static const char *get_mnemonic(unsigned int id)
     _mnemonic_x(STI);
     _mnemonic_x(INT);
     _mnemonic_x(RFI);
+    _mnemonic_x(XCH);
+    _mnemonic_x(IPI);
     _mnemonic_x(CPI);
     _mnemonic_x(IEQ);
     _mnemonic_x(INE);
@@ -128,90 +136,820 @@ static void error(const char *fmt, ...)
     exit(1);
 }
 
-int main(int argc, char **argv)
+/* What the recursive descent learns about every word of a ROM */
+#define DIS_CODE        0x01    /* First word of an instruction */
+#define DIS_OPERAND     0x02    /* Immediate of an instruction */
+#define DIS_LEADER      0x04    /* Starts a basic block */
+#define DIS_FUNCTION    0x08    /* Called, or an entry point */
+#define DIS_INTERRUPT   0x10    /* Assigned to %IA */
+#define DIS_QUEUED      0x20    /* Decoded or waiting to be */
+
+#define DIS_NONE ((size_t)-1)
+
+/* Where control can go after one instruction */
+struct dis_flow {
+    size_t length;
+    size_t next[2];                 /* Within the function */
+    int num_next;
+    size_t call;                    /* CAL target */
+    size_t interrupt;               /* Handler assigned to %IA */
+    size_t resume;                  /* After a HLT, once an interrupt comes */
+    int indirect;                   /* Goes where only a run would tell */
+};
+
+struct dis_call {
+    size_t caller, callee;
+};
+
+struct dis_rom {
+    const char *path;
+    unsigned short *memory;         /* Host byte order */
+    size_t size;                    /* In words */
+    unsigned char *flags;
+    size_t *stack;
+    size_t num_stack;
+    size_t *halts;                  /* HLTs waiting for an interrupt handler to turn up */
+    size_t num_halts;
+    struct dis_call *calls;
+    size_t num_calls, max_calls;
+    unsigned long code_words, num_blocks, num_functions, num_interrupts;
+    unsigned long num_indirect, num_overlaps, num_outside;
+    char failure[256];              /* Empty unless the ROM could not be read or written */
+};
+
+/* Settings shared by every ROM of a run */
+struct dis_config {
+    int recursive, offsets, words;
+    size_t begin, end;
+    const size_t *entries;
+    size_t num_entries;
+    const char *outdir;
+};
+
+static size_t dis_length(unsigned short word)
+{
+    return 1 + ((word >> 9) & 0x01) + ((word >> 4) & 0x01);
+}
+
+static void dis_decode(unsigned short word, struct vcpu_instruction *instruction)
+{
+    instruction->opcode = (word >> 10) & 0x3F;
+    instruction->a.imm = (word >> 9) & 0x01;
+    instruction->a.reg = (word >> 5) & 0x0F;
+    instruction->b.imm = (word >> 4) & 0x01;
+    instruction->b.reg = word & 0x0F;
+}
+
+/* The word the assembler makes of an instruction */
+static unsigned short dis_encode(const struct vcpu_instruction *instruction)
+{
+    unsigned short word = (unsigned short)(instruction->opcode << 10);
+
+    word |= instruction->a.imm ? 0x0200 : (instruction->a.reg << 5);
+    word |= instruction->b.imm ? 0x0010 : instruction->b.reg;
+    return word;
+}
+
+/* The immediates of the instruction at addr, which fits in the ROM */
+static void dis_imms(const struct dis_rom *rom, size_t addr, const struct vcpu_instruction *instruction, unsigned short *imms)
+{
+    size_t i = addr + 1;
+
+    imms[0] = instruction->a.imm ? rom->memory[i++] : 0;
+    imms[1] = instruction->b.imm ? rom->memory[i] : 0;
+}
+
+/* 1 when an opcode writes its first operand, 2 for the second, 0 for neither */
+static int dis_destination(unsigned char opcode)
+{
+    switch(opcode) {
+        case VCPU_OPCODE_PFS:
+        case VCPU_OPCODE_XCH:
+        case VCPU_OPCODE_NOT:
+        case VCPU_OPCODE_INC:
+        case VCPU_OPCODE_DEC:
+            return 1;
+        case VCPU_OPCODE_IOR:
+        case VCPU_OPCODE_MRD:
+            return 2;
+        default:
+            return (opcode >= VCPU_OPCODE_MOV && opcode <= VCPU_OPCODE_XOR) ? 2 : 0;
+    }
+}
+
+/* How many operands an opcode is written with */
+static int dis_num_operands(unsigned char opcode)
+{
+    switch(opcode) {
+        case VCPU_OPCODE_NOP:
+        case VCPU_OPCODE_HLT:
+        case VCPU_OPCODE_RET:
+        case VCPU_OPCODE_CLI:
+        case VCPU_OPCODE_STI:
+        case VCPU_OPCODE_RFI:
+            return 0;
+        case VCPU_OPCODE_PTS:
+        case VCPU_OPCODE_PFS:
+        case VCPU_OPCODE_CAL:
+        case VCPU_OPCODE_INT:
+        case VCPU_OPCODE_CPI:
+        case VCPU_OPCODE_NOT:
+        case VCPU_OPCODE_INC:
+        case VCPU_OPCODE_DEC:
+            return 1;
+        default:
+            return 2;
+    }
+}
+
+/* Follows the core: a skip runs or steps over the next instruction,
+ * %PC reads as the address after the instruction, and a HLT goes on
+ * once an interrupt has been handled */
+static void dis_flow(const struct dis_rom *rom, size_t addr, struct dis_flow *flow)
+{
+    struct vcpu_instruction instruction;
+    unsigned short imms[2];
+    size_t next;
+    int destination;
+
+    dis_decode(rom->memory[addr], &instruction);
+    dis_imms(rom, addr, &instruction, imms);
+
+    flow->length = dis_length(rom->memory[addr]);
+    flow->num_next = 0;
+    flow->call = flow->interrupt = flow->resume = DIS_NONE;
+    flow->indirect = 0;
+    next = addr + flow->length;
+
+    switch(instruction.opcode) {
+        case VCPU_OPCODE_RET:
+        case VCPU_OPCODE_RFI:
+            return;
+        case VCPU_OPCODE_HLT:
+            flow->resume = next;
+            return;
+        case VCPU_OPCODE_CAL:
+            if(instruction.a.imm)
+                flow->call = imms[0];
+            else
+                flow->indirect = 1;
+            break;
+        case VCPU_OPCODE_IEQ:
+        case VCPU_OPCODE_INE:
+        case VCPU_OPCODE_IGT:
+        case VCPU_OPCODE_IGE:
+        case VCPU_OPCODE_ILT:
+        case VCPU_OPCODE_ILE:
+            flow->next[flow->num_next++] = next;
+            if(next < rom->size)
+                flow->next[flow->num_next++] = next + dis_length(rom->memory[next]);
+            return;
+    }
+
+    destination = dis_destination(instruction.opcode);
+    if(destination == 2 && !instruction.b.imm && instruction.b.reg == VCPU_REGISTER_PC) {
+        if(instruction.opcode == VCPU_OPCODE_MOV && instruction.a.imm)
+            flow->next[flow->num_next++] = imms[0];
+        else if(instruction.opcode == VCPU_OPCODE_ADD && instruction.a.imm)
+            flow->next[flow->num_next++] = (unsigned short)(next + imms[0]);
+        else if(instruction.opcode == VCPU_OPCODE_SUB && instruction.a.imm)
+            flow->next[flow->num_next++] = (unsigned short)(next - imms[0]);
+        else
+            flow->indirect = 1;
+        return;
+    }
+    if(destination == 1 && !instruction.a.imm && instruction.a.reg == VCPU_REGISTER_PC) {
+        flow->indirect = 1;
+        return;
+    }
+
+    if(instruction.opcode == VCPU_OPCODE_MOV && instruction.a.imm && !instruction.b.imm && instruction.b.reg == VCPU_REGISTER_IA)
+        flow->interrupt = imms[0];
+    flow->next[flow->num_next++] = next;
+}
+
+/* Zero when addr is outside of the ROM */
+static int dis_push(struct dis_rom *rom, size_t addr, unsigned char flags)
+{
+    if(addr >= rom->size) {
+        rom->num_outside++;
+        return 0;
+    }
+
+    rom->flags[addr] |= flags;
+    if(!(rom->flags[addr] & DIS_QUEUED)) {
+        rom->flags[addr] |= DIS_QUEUED;
+        rom->stack[rom->num_stack++] = addr;
+    }
+    return 1;
+}
+
+/* Decodes from addr on for as long as control falls through */
+static void dis_trace(struct dis_rom *rom, size_t addr)
+{
+    struct dis_flow flow;
+    size_t i;
+    int k;
+
+    for(;;) {
+        if(addr >= rom->size) {
+            rom->num_outside++;
+            return;
+        }
+        if(rom->flags[addr] & DIS_CODE)
+            return;
+
+        /* Instructions that share words cannot both be written out;
+         * the one decoded first wins */
+        flow.length = dis_length(rom->memory[addr]);
+        if(addr + flow.length > rom->size) {
+            rom->num_outside++;
+            return;
+        }
+        for(i = 0; i < flow.length; i++) {
+            if(rom->flags[addr + i] & (DIS_CODE | DIS_OPERAND)) {
+                rom->num_overlaps++;
+                return;
+            }
+        }
+
+        rom->flags[addr] |= DIS_CODE | DIS_QUEUED;
+        for(i = 1; i < flow.length; i++)
+            rom->flags[addr + i] |= DIS_OPERAND;
+        rom->code_words += flow.length;
+
+        dis_flow(rom, addr, &flow);
+        rom->num_indirect += flow.indirect;
+
+        if(flow.call != DIS_NONE)
+            dis_push(rom, flow.call, DIS_LEADER | DIS_FUNCTION);
+        if(flow.interrupt != DIS_NONE && flow.interrupt < rom->size && !(rom->flags[flow.interrupt] & DIS_INTERRUPT))
+            rom->num_interrupts++;
+        if(flow.interrupt != DIS_NONE)
+            dis_push(rom, flow.interrupt, DIS_LEADER | DIS_INTERRUPT);
+        if(flow.resume != DIS_NONE) {
+            if(rom->num_interrupts)
+                dis_push(rom, flow.resume, DIS_LEADER);
+            else
+                rom->halts[rom->num_halts++] = flow.resume;
+        }
+
+        if(flow.num_next == 1 && flow.next[0] == addr + flow.length) {
+            addr = flow.next[0];
+            continue;
+        }
+        for(k = 0; k < flow.num_next; k++)
+            dis_push(rom, flow.next[k], DIS_LEADER);
+        return;
+    }
+}
+
+static int dis_compare_calls(const void *a, const void *b)
+{
+    const struct dis_call *x = a, *y = b;
+
+    if(x->caller != y->caller)
+        return (x->caller < y->caller) ? -1 : 1;
+    if(x->callee != y->callee)
+        return (x->callee < y->callee) ? -1 : 1;
+    return 0;
+}
+
+static void dis_add_call(struct dis_rom *rom, size_t caller, size_t callee)
+{
+    if(rom->num_calls >= rom->max_calls) {
+        rom->max_calls = rom->max_calls ? rom->max_calls * 2 : 64;
+        rom->calls = realloc(rom->calls, rom->max_calls * sizeof(struct dis_call));
+        assert(("Out of memory!", rom->calls));
+    }
+    rom->calls[rom->num_calls].caller = caller;
+    rom->calls[rom->num_calls].callee = callee;
+    rom->num_calls++;
+}
+
+/* A function is everything its entry reaches without following
+ * calls; every CAL in there is an edge. Code two functions share
+ * counts for both. */
+static void dis_call_graph(struct dis_rom *rom)
+{
+    struct dis_flow flow;
+    unsigned int *seen, stamp = 0;
+    size_t *stack, num_stack, entry, addr, i, j;
+    int k;
+
+    seen = calloc(rom->size + 1, sizeof(unsigned int));
+    stack = malloc((rom->size * 2 + 2) * sizeof(size_t));
+    assert(("Out of memory!", seen && stack));
+
+    for(entry = 0; entry < rom->size; entry++) {
+        if((rom->flags[entry] & DIS_CODE) != DIS_CODE || !(rom->flags[entry] & (DIS_FUNCTION | DIS_INTERRUPT)))
+            continue;
+
+        stamp++;
+        num_stack = 0;
+        stack[num_stack++] = entry;
+        while(num_stack) {
+            addr = stack[--num_stack];
+            if(addr >= rom->size || !(rom->flags[addr] & DIS_CODE) || seen[addr] == stamp)
+                continue;
+            seen[addr] = stamp;
+
+            dis_flow(rom, addr, &flow);
+            if(flow.call != DIS_NONE && flow.call < rom->size && (rom->flags[flow.call] & DIS_CODE))
+                dis_add_call(rom, entry, flow.call);
+            for(k = 0; k < flow.num_next; k++)
+                stack[num_stack++] = flow.next[k];
+            if(flow.resume != DIS_NONE && rom->num_interrupts)
+                stack[num_stack++] = flow.resume;
+        }
+    }
+
+    if(rom->num_calls) {
+        qsort(rom->calls, rom->num_calls, sizeof(struct dis_call), dis_compare_calls);
+        for(i = 1, j = 1; i < rom->num_calls; i++) {
+            if(dis_compare_calls(rom->calls + i, rom->calls + j - 1))
+                rom->calls[j++] = rom->calls[i];
+        }
+        rom->num_calls = j;
+    }
+
+    free(seen);
+    free(stack);
+}
+
+/* Starts at the reset vector and at every extra entry point. Until an
+ * interrupt handler is found a HLT ends its block, so that data after
+ * a program's final HLT is not taken for code. */
+static void dis_analyze(struct dis_rom *rom, const struct dis_config *config)
+{
+    size_t i;
+
+    rom->flags = calloc(rom->size + 1, 1);
+    rom->stack = malloc((rom->size + 1) * sizeof(size_t));
+    rom->halts = malloc((rom->size + 1) * sizeof(size_t));
+    assert(("Out of memory!", rom->flags && rom->stack && rom->halts));
+
+    dis_push(rom, 0x0000, DIS_LEADER | DIS_FUNCTION);
+    for(i = 0; i < config->num_entries; i++)
+        dis_push(rom, config->entries[i], DIS_LEADER | DIS_FUNCTION);
+
+    for(;;) {
+        while(rom->num_stack)
+            dis_trace(rom, rom->stack[--rom->num_stack]);
+        if(!rom->num_interrupts || !rom->num_halts)
+            break;
+        while(rom->num_halts)
+            dis_push(rom, rom->halts[--rom->num_halts], DIS_LEADER);
+    }
+
+    for(i = 0; i < rom->size; i++) {
+        if(!(rom->flags[i] & DIS_CODE))
+            continue;
+        rom->num_blocks += !!(rom->flags[i] & DIS_LEADER);
+        rom->num_functions += !!(rom->flags[i] & DIS_FUNCTION);
+    }
+
+    dis_call_graph(rom);
+}
+
+static int dis_has_label(const struct dis_rom *rom, size_t addr)
+{
+    return addr < rom->size && (rom->flags[addr] & (DIS_CODE | DIS_LEADER)) == (DIS_CODE | DIS_LEADER);
+}
+
+static void dis_label(const struct dis_rom *rom, size_t addr, char *name, size_t size)
+{
+    const char *prefix = "loc";
+
+    if(rom->flags[addr] & DIS_INTERRUPT)
+        prefix = "int";
+    else if(rom->flags[addr] & DIS_FUNCTION)
+        prefix = "sub";
+    snprintf(name, size, "%s_%04X", prefix, (unsigned short)addr);
+}
+
+/* Returns the number of characters written */
+static int dis_write_operand(FILE *fp, const struct dis_rom *rom, int imm, unsigned char reg, unsigned short value, int address)
+{
+    char name[16];
+
+    if(imm && address && dis_has_label(rom, value)) {
+        dis_label(rom, value, name, sizeof(name));
+        return fprintf(fp, "$%s", name);
+    }
+    if(imm)
+        return fprintf(fp, "$0x%04X", value);
+    return fprintf(fp, "%%%s", get_register(reg));
+}
+
+/* Writes the instruction at addr as the assembler reads it. Operands
+ * an opcode does not use are left out when they encode as zero, and
+ * the immediates that are code addresses become labels. */
+static void dis_write_instruction(FILE *fp, const struct dis_rom *rom, const struct dis_config *config, size_t addr)
 {
-    int r;
-    FILE *infile = NULL;
-    size_t begin = 0x0000, end = VCPU_MEM_SIZE;
-    int offsets = 0, words = 0;
-    vcpu_memory_t memory;
-    size_t size, i;
-    unsigned short addr, word;
+    struct vcpu_instruction instruction;
     unsigned short imms[2];
+    size_t length = dis_length(rom->memory[addr]), i;
+    int num_operands, address, column;
+
+    dis_decode(rom->memory[addr], &instruction);
+    dis_imms(rom, addr, &instruction, imms);
+
+    num_operands = dis_num_operands(instruction.opcode);
+    if(instruction.b.imm || instruction.b.reg)
+        num_operands = 2;
+    else if((instruction.a.imm || instruction.a.reg) && num_operands < 1)
+        num_operands = 1;
+
+    if(!strcmp(get_mnemonic(instruction.opcode), "???") || dis_encode(&instruction) != rom->memory[addr]) {
+        /* Unassigned opcodes run as NOP but have no mnemonic, and
+         * register bits under an immediate are lost on the way back */
+        column = fprintf(fp, "    .dw 0x%04X", rom->memory[addr]);
+        for(i = 1; i < length; i++)
+            column += fprintf(fp, ", 0x%04X", rom->memory[addr + i]);
+    }
+    else {
+        column = fprintf(fp, "    %s", get_mnemonic(instruction.opcode));
+        address = (instruction.opcode == VCPU_OPCODE_CAL) ||
+                  (instruction.opcode == VCPU_OPCODE_MOV && !instruction.b.imm &&
+                   (instruction.b.reg == VCPU_REGISTER_PC || instruction.b.reg == VCPU_REGISTER_IA));
+        if(num_operands >= 1) {
+            column += fprintf(fp, " ");
+            column += dis_write_operand(fp, rom, instruction.a.imm, instruction.a.reg, imms[0], address);
+        }
+        if(num_operands >= 2) {
+            column += fprintf(fp, ", ");
+            column += dis_write_operand(fp, rom, instruction.b.imm, instruction.b.reg, imms[1], 0);
+        }
+    }
+
+    if(config->offsets || config->words) {
+        fprintf(fp, "%*s#", (column < 36) ? 36 - column : 1, "");
+        if(config->offsets)
+            fprintf(fp, " %04lX", (unsigned long)addr);
+        if(config->words) {
+            for(i = 0; i < length; i++)
+                fprintf(fp, " %04X", rom->memory[addr + i]);
+        }
+    }
+    fprintf(fp, "\n");
+}
+
+/* Characters a .ascii line can hold; there are no escapes */
+static int dis_printable(unsigned short word)
+{
+    return word >= 0x20 && word < 0x7F && word != '"';
+}
+
+static size_t dis_text_length(const struct dis_rom *rom, size_t addr, size_t end)
+{
+    size_t length = 0;
+
+    while(addr + length < end && dis_printable(rom->memory[addr + length]))
+        length++;
+    return length;
+}
+
+/* Words no instruction was decoded from: text of four characters
+ * or more as .ascii, anything else as .dw */
+static void dis_write_data(FILE *fp, const struct dis_rom *rom, const struct dis_config *config, size_t addr, size_t end)
+{
+    size_t length, i;
+
+    while(addr < end) {
+        length = dis_text_length(rom, addr, end);
+        if(length >= 4) {
+            if(length > 64)
+                length = 64;
+            fprintf(fp, "    .ascii \"");
+            for(i = 0; i < length; i++)
+                fputc(rom->memory[addr + i], fp);
+            fprintf(fp, "\"");
+        }
+        else {
+            for(length = 0; length < 8 && addr + length < end; length++) {
+                if(length && dis_text_length(rom, addr + length, end) >= 4)
+                    break;
+                fprintf(fp, length ? ", 0x%04X" : "    .dw 0x%04X", rom->memory[addr + length]);
+            }
+        }
+        if(config->offsets)
+            fprintf(fp, "  # %04lX", (unsigned long)addr);
+        fprintf(fp, "\n");
+        addr += length;
+    }
+}
+
+static void dis_write_calls(FILE *fp, const struct dis_rom *rom, size_t addr)
+{
+    char name[16];
+    size_t i;
+    int n;
+
+    for(i = 0, n = 0; i < rom->num_calls; i++) {
+        if(rom->calls[i].callee != addr)
+            continue;
+        dis_label(rom, rom->calls[i].caller, name, sizeof(name));
+        fprintf(fp, n++ ? ", %s" : "# called by %s", name);
+    }
+    if(n)
+        fprintf(fp, "\n");
+
+    for(i = 0, n = 0; i < rom->num_calls; i++) {
+        if(rom->calls[i].caller != addr)
+            continue;
+        dis_label(rom, rom->calls[i].callee, name, sizeof(name));
+        fprintf(fp, n++ ? ", %s" : "# calls %s", name);
+    }
+    if(n)
+        fprintf(fp, "\n");
+}
+
+/* Source that vcpu-as turns back into the same ROM; every basic
+ * block starts with a label, every function with its callers and
+ * callees */
+static void dis_write_source(FILE *fp, const struct dis_rom *rom, const struct dis_config *config)
+{
+    char name[16];
+    size_t addr, end;
+
+    fprintf(fp, "# %s: %lu words, %lu of code in %lu blocks, %lu functions, %lu interrupt handlers\n",
+        rom->path, (unsigned long)rom->size, rom->code_words, rom->num_blocks, rom->num_functions, rom->num_interrupts);
+
+    for(addr = 0; addr < rom->size;) {
+        if(!(rom->flags[addr] & DIS_CODE)) {
+            for(end = addr; end < rom->size && !(rom->flags[end] & DIS_CODE); end++);
+            fprintf(fp, "\n");
+            dis_write_data(fp, rom, config, addr, end);
+            addr = end;
+            continue;
+        }
+
+        if(rom->flags[addr] & DIS_LEADER) {
+            fprintf(fp, "\n");
+            if(rom->flags[addr] & (DIS_FUNCTION | DIS_INTERRUPT))
+                dis_write_calls(fp, rom, addr);
+            dis_label(rom, addr, name, sizeof(name));
+            fprintf(fp, "%s:\n", name);
+        }
+        dis_write_instruction(fp, rom, config, addr);
+        addr += dis_length(rom->memory[addr]);
+    }
+}
+
+/* The linear sweep from begin to end. An instruction
+ * cut short by end is written as data. */
+static void dis_sweep(FILE *fp, const struct dis_rom *rom, const struct dis_config *config)
+{
     struct vcpu_instruction instruction;
+    unsigned short imms[2];
+    size_t end = (config->end < rom->size) ? config->end : rom->size;
+    size_t i, length;
+
+    for(i = config->begin; i < end; i += length) {
+        length = dis_length(rom->memory[i]);
+        if(i + length > end) {
+            for(; i < end; i++) {
+                if(config->offsets)
+                    fprintf(fp, "%04lX  ", (unsigned long)i);
+                if(config->words)
+                    fprintf(fp, "%04X **** ****  ", rom->memory[i]);
+                fprintf(fp, ".dw 0x%04X\n", rom->memory[i]);
+            }
+            break;
+        }
+
+        dis_decode(rom->memory[i], &instruction);
+        dis_imms(rom, i, &instruction, imms);
+        dis_print(fp, config->offsets, config->words, (unsigned short)i, rom->memory[i], &instruction, imms);
+    }
+}
+
+/* Only the words the file has are read and swapped */
+static int dis_load(struct dis_rom *rom)
+{
+    FILE *infile;
+    long bytes;
+    size_t i;
+
+    infile = fopen(rom->path, "rb");
+    if(!infile) {
+        snprintf(rom->failure, sizeof(rom->failure), "%s", strerror(errno));
+        return 0;
+    }
+
+    fseek(infile, 0, SEEK_END);
+    bytes = ftell(infile);
+    fseek(infile, 0, SEEK_SET);
+
+    rom->size = (bytes > 0) ? (size_t)bytes / sizeof(unsigned short) : 0;
+    if(rom->size > VCPU_MEM_SIZE)
+        rom->size = VCPU_MEM_SIZE;
+
+    rom->memory = malloc((rom->size + 1) * sizeof(unsigned short));
+    assert(("Out of memory!", rom->memory));
+    rom->size = fread(rom->memory, sizeof(unsigned short), rom->size, infile);
+    fclose(infile);
+
+    for(i = 0; i < rom->size; i++)
+        rom->memory[i] = vcpu_be16_to_host(rom->memory[i]);
+    return 1;
+}
+
+static void dis_unload(struct dis_rom *rom)
+{
+    free(rom->memory);
+    free(rom->flags);
+    free(rom->stack);
+    free(rom->halts);
+    free(rom->calls);
+    rom->memory = NULL;
+    rom->flags = NULL;
+    rom->stack = rom->halts = NULL;
+    rom->calls = NULL;
+    rom->max_calls = 0;
+}
+
+static void dis_write(FILE *fp, const struct dis_rom *rom, const struct dis_config *config)
+{
+    if(config->recursive)
+        dis_write_source(fp, rom, config);
+    else
+        dis_sweep(fp, rom, config);
+}
+
+/* <outdir>/<name of the ROM without its extension>.S */
+static void dis_outfile_name(char *path, size_t size, const char *outdir, const char *rom)
+{
+    const char *name = strrchr(rom, '/');
+    const char *dot;
+    int length;
+
+    name = name ? name + 1 : rom;
+    dot = strrchr(name, '.');
+    length = (dot && dot != name) ? (int)(dot - name) : (int)strlen(name);
+    snprintf(path, size, "%s/%.*s.S", outdir, length, name);
+}
+
+struct dis_batch {
+    const struct dis_config *config;
+    struct dis_rom *roms;
+};
+
+/* One ROM of a batch; each writes its own listing and keeps
+ * nothing but the counts once done */
+static void dis_task(void *ctx, size_t task, unsigned int worker)
+{
+    const struct dis_config *config = ((struct dis_batch *)ctx)->config;
+    struct dis_rom *rom = ((struct dis_batch *)ctx)->roms + task;
+    char path[4096];
+    FILE *outfile;
+
+    (void)worker;
+
+    if(!dis_load(rom))
+        return;
+    if(config->recursive)
+        dis_analyze(rom, config);
+
+    if(config->outdir) {
+        dis_outfile_name(path, sizeof(path), config->outdir, rom->path);
+        outfile = fopen(path, "w");
+        if(!outfile)
+            snprintf(rom->failure, sizeof(rom->failure), "%.*s: %s", (int)sizeof(rom->failure) - 64, path, strerror(errno));
+        else {
+            dis_write(outfile, rom, config);
+            fclose(outfile);
+        }
+    }
+
+    dis_unload(rom);
+}
+
+static void dis_summary(FILE *fp, const struct dis_rom *rom)
+{
+    fprintf(fp, "{\"rom\":\"%s\",\"words\":%lu,\"code_words\":%lu,\"blocks\":%lu,\"functions\":%lu,\"interrupts\":%lu,"
+        "\"calls\":%lu,\"indirect\":%lu,\"overlaps\":%lu,\"outside\":%lu}\n",
+        rom->path, (unsigned long)rom->size, rom->code_words, rom->num_blocks, rom->num_functions, rom->num_interrupts,
+        (unsigned long)rom->num_calls, rom->num_indirect, rom->num_overlaps, rom->num_outside);
+}
+
+int main(int argc, char **argv)
+{
+    int r, failed = 0;
+    struct dis_config config;
+    struct dis_batch batch;
+    struct dis_rom rom, *roms;
+    size_t entries[DIS_MAX_ENTRIES];
+    size_t num_roms, i;
+    unsigned int num_workers = 0;
 
     argv_0 = argv[0];
 
-    while((r = getopt(argc, argv, "b:e:OWvh")) != EOF) {
+    memset(&config, 0, sizeof(config));
+    config.end = VCPU_MEM_SIZE;
+    config.entries = entries;
+
+    while((r = getopt(argc, argv, "b:e:Rs:j:o:OWvh")) != EOF) {
         switch(r) {
             case 'b':
-                begin = (unsigned short)strtol(optarg, NULL, 16);
+                config.begin = (unsigned short)strtol(optarg, NULL, 16);
                 break;
             case 'e':
-                end = (unsigned short)strtol(optarg, NULL, 16);
+                config.end = (unsigned short)strtol(optarg, NULL, 16);
+                break;
+            case 'R':
+                config.recursive = 1;
+                break;
+            case 's':
+                if(config.num_entries >= DIS_MAX_ENTRIES)
+                    error("more than %d entry points", DIS_MAX_ENTRIES);
+                entries[config.num_entries++] = (unsigned short)strtol(optarg, NULL, 16);
+                break;
+            case 'j':
+                num_workers = (unsigned int)strtoul(optarg, NULL, 10);
+                if(!num_workers)
+                    error("%s: invalid worker count", optarg);
+                break;
+            case 'o':
+                config.outdir = optarg;
                 break;
             case 'O':
-                offsets = 1;
+                config.offsets = 1;
                 break;
             case 'W':
-                words = 1;
+                config.words = 1;
                 break;
             case 'v':
                 lprintf("%s (VCPU DIS) version 0.0.x", argv_0);
                 return 0;
             default:
-                lprintf("Usage: %s [-b <hexaddr>] [-e <hexaddr>] [-O] [-W] [-h] <infile>", argv[0]);
+                lprintf("Usage: %s [-b <hexaddr>] [-e <hexaddr>] [-R] [-s <hexaddr>] [-j <count>] [-o <outdir>] [-O] [-W] [-h] <infile>...", argv[0]);
                 lprintf("Options:");
                 lprintf("   -b <hexaddr>    : Set the begining offset.");
                 lprintf("   -e <hexaddr>    : Set the ending offset.");
+                lprintf("   -R              : Follow control flow from the entry points, write source with labels.");
+                lprintf("   -s <hexaddr>    : Add an entry point besides 0x0000 (with -R).");
+                lprintf("   -j <count>      : ROMs to work on at once (default: one per CPU).");
+                lprintf("   -o <outdir>     : Write every listing to <outdir>/<name>.S.");
                 lprintf("   -O              : Write offsets.");
                 lprintf("   -W              : Write instruction words.");
                 lprintf("   -v              : Print version and exit");
                 lprintf("   -h              : Write this message and exit.");
-                lprintf("   <infile>        : Input binary (ROM).");
+                lprintf("   <infile>        : Input binary (ROM). With -R, several ROMs or -o get");
+                lprintf("                     one JSON line of counts each.");
                 return (r == 'h');
         }
     }
-    
+
     if(optind >= argc)
         error("no input files");
+    num_roms = (size_t)(argc - optind);
 
-    infile_name = argv[optind];
-    infile = fopen(infile_name, "rb");
-    if(!infile)
-        error("%s", strerror(errno));
-
-    fseek(infile, 0, SEEK_END);
-    size = ftell(infile) / sizeof(unsigned short);
-    fseek(infile, 0, SEEK_SET);
+    /* One ROM goes to the standard output */
+    if(num_roms == 1 && !config.outdir) {
+        memset(&rom, 0, sizeof(rom));
+        rom.path = infile_name = argv[optind];
+        if(!dis_load(&rom))
+            error("%s", rom.failure);
+        if(config.recursive)
+            dis_analyze(&rom, &config);
+        dis_write(stdout, &rom, &config);
+        dis_unload(&rom);
+        return 0;
+    }
 
-    if(size > VCPU_MEM_SIZE)
-        size = VCPU_MEM_SIZE;
+    if(!config.outdir && !config.recursive)
+        error("several ROMs need -R or -o <outdir>");
 
-    if(end > size)
-        end = size;
+    roms = calloc(num_roms, sizeof(struct dis_rom));
+    assert(("Out of memory!", roms));
+    for(i = 0; i < num_roms; i++)
+        roms[i].path = argv[optind + i];
 
-    fread(memory, sizeof(unsigned short), size, infile);
-    fclose(infile);
+    batch.config = &config;
+    batch.roms = roms;
+#if defined(VCPU_DIS_POOL)
+    if(!num_workers)
+        num_workers = pool_default_workers();
+    pool_run(num_workers, num_roms, &dis_task, &batch);
+#else
+    (void)num_workers;
+    for(i = 0; i < num_roms; i++)
+        dis_task(&batch, i, 0);
+#endif
 
-    // Patch endianness
-    for(i = 0; i < VCPU_MEM_SIZE; i++)
-        memory[i] = vcpu_be16_to_host(memory[i]);
-
-    for(i = begin; i < end; i++) {
-        addr = (unsigned short)i;
-        word = memory[addr];
-        instruction.opcode = (word >> 10) & 0x3F;
-        instruction.a.imm = (word >> 9) & 0x01;
-        instruction.a.reg = (word >> 5) & 0x0F;
-        instruction.b.imm = (word >> 4) & 0x01;
-        instruction.b.reg = word & 0x0F;
-        if(instruction.a.imm && ++i < end)
-            imms[0] = memory[i];
-        if(instruction.b.imm && ++i < end)
-            imms[1] = memory[i];
-        dis_print(stdout, offsets, words, addr, word, &instruction, imms);
+    /* In the order given, whichever finished first */
+    for(i = 0; i < num_roms; i++) {
+        if(roms[i].failure[0]) {
+            fprintf(stderr, "%s: %serror: %s%s\n", roms[i].path, _ansi_error, _ansi_reset, roms[i].failure);
+            failed = 1;
+        }
+        else if(config.recursive) {
+            dis_summary(stdout, roms + i);
+        }
     }
 
-    return 0;
+    free(roms);
+    return failed;
 }
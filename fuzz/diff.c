@@ -0,0 +1,319 @@
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vcpu16.h>
+
+/* Interrupts the host posts into every program */
+#define DIFF_INTERRUPTS 4
+
+/* One program, run once per mode on a fresh core */
+struct diff_target {
+    struct vcpu cpu;                /* First, so handlers can cast back */
+    unsigned long ioreads;
+    unsigned long io_hash;
+};
+
+struct diff_interrupt {
+    unsigned long at;               /* Posted once instret reaches it */
+    unsigned short message;
+};
+
+struct diff_program {
+    unsigned short *words;
+    size_t size;
+    struct diff_interrupt interrupts[DIFF_INTERRUPTS];
+};
+
+struct diff_result {
+    int reason;
+    unsigned long instret;
+    unsigned long hash;
+};
+
+static char print_buffer[4096] = { 0 };
+static const char *argv_0 = NULL;
+static unsigned long long rng_state = 0x9E3779B97F4A7C15ULL;
+
+#define _ansi_reset     "\033[0m"
+#define _ansi_warning   "\033[1;35m"
+#define _ansi_error     "\033[1;31m"
+
+static void lprintf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, ap);
+    fprintf(stderr, "%s\n", print_buffer);
+    va_end(ap);
+}
+
+static void warning(const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, va);
+    fprintf(stderr, "%s: %swarning: %s%s\n", argv_0, _ansi_warning, _ansi_reset, print_buffer);
+    va_end(va);
+}
+
+static void error(const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, va);
+    fprintf(stderr, "%s: %sfatal: %s%s\n", argv_0, _ansi_error, _ansi_reset, print_buffer);
+    va_end(va);
+    exit(1);
+}
+
+/* xorshift64* */
+static unsigned long rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned long)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+/* FNV-1a over 16-bit words */
+static unsigned long diff_hash(unsigned long hash, unsigned short word)
+{
+    hash = ((hash ^ (word & 0xFF)) * 16777619UL) & 0xFFFFFFFFUL;
+    return ((hash ^ (word >> 8)) * 16777619UL) & 0xFFFFFFFFUL;
+}
+
+static void diff_ioread(struct vcpu *cpu, unsigned short port, unsigned short *value)
+{
+    struct diff_target *target = (struct diff_target *)cpu;
+    *value = (unsigned short)(port * 31 + target->ioreads++);
+}
+
+static void diff_iowrite(struct vcpu *cpu, unsigned short port, unsigned short value)
+{
+    struct diff_target *target = (struct diff_target *)cpu;
+    target->io_hash = diff_hash(diff_hash(target->io_hash, port), value);
+}
+
+static const unsigned char opcodes[] = {
+    VCPU_OPCODE_NOP, VCPU_OPCODE_HLT, VCPU_OPCODE_PTS, VCPU_OPCODE_PFS,
+    VCPU_OPCODE_CAL, VCPU_OPCODE_RET, VCPU_OPCODE_IOR, VCPU_OPCODE_IOW,
+    VCPU_OPCODE_MRD, VCPU_OPCODE_MWR, VCPU_OPCODE_CLI, VCPU_OPCODE_STI,
+    VCPU_OPCODE_INT, VCPU_OPCODE_RFI, VCPU_OPCODE_XCH, VCPU_OPCODE_CPI,
+    VCPU_OPCODE_IEQ, VCPU_OPCODE_INE, VCPU_OPCODE_IGT, VCPU_OPCODE_IGE,
+    VCPU_OPCODE_ILT, VCPU_OPCODE_ILE, VCPU_OPCODE_MOV, VCPU_OPCODE_ADD,
+    VCPU_OPCODE_SUB, VCPU_OPCODE_MUL, VCPU_OPCODE_DIV, VCPU_OPCODE_MOD,
+    VCPU_OPCODE_SHL, VCPU_OPCODE_SHR, VCPU_OPCODE_AND, VCPU_OPCODE_BOR,
+    VCPU_OPCODE_XOR, VCPU_OPCODE_NOT, VCPU_OPCODE_INC, VCPU_OPCODE_DEC
+};
+
+/* Immediates tend to land in the program, so that jumps,
+ * calls and stores into code stay in there */
+static void diff_emit(struct diff_program *program, size_t *i, unsigned short word)
+{
+    int k;
+
+    program->words[(*i)++] = word;
+    for(k = 0; k < !!(word & 0x0200) + !!(word & 0x0010) && *i < program->size; k++)
+        program->words[(*i)++] = (unsigned short)((rng() % 2) ? rng() % program->size : rng());
+}
+
+/* Mostly assigned opcodes, now and then a whole random word with
+ * unassigned opcodes included. Half of the skips and MRDs are
+ * followed by the instruction that makes them a fused pair, so that
+ * the fused handlers run as often as the plain ones. */
+static void diff_generate(struct diff_program *program, unsigned long budget)
+{
+    unsigned short word;
+    unsigned char opcode;
+    size_t i;
+    int k;
+
+    for(i = 0; i < program->size;) {
+        if(!(rng() % 16)) {
+            program->words[i++] = (unsigned short)rng();
+            continue;
+        }
+
+        opcode = opcodes[rng() % sizeof(opcodes)];
+        word = (unsigned short)(opcode << 10);
+        word |= (rng() % 3) ? (unsigned short)((rng() % 16) << 5) : 0x0200;
+        word |= (rng() % 3) ? (unsigned short)(rng() % 16) : 0x0010;
+        diff_emit(program, &i, word);
+
+        if(i >= program->size || rng() % 2)
+            continue;
+        if(opcode >= VCPU_OPCODE_IEQ && opcode <= VCPU_OPCODE_ILE)
+            diff_emit(program, &i, (unsigned short)(VCPU_OPCODE_MOV << 10 | 0x0200 | VCPU_REGISTER_PC));
+        else if(opcode == VCPU_OPCODE_MRD && !(word & 0x0010))
+            diff_emit(program, &i, (unsigned short)(VCPU_OPCODE_AND << 10 | 0x0200 | (word & 0x000F)));
+    }
+
+    for(k = 0; k < DIFF_INTERRUPTS; k++) {
+        program->interrupts[k].at = (k ? program->interrupts[k - 1].at : 0) + rng() % (budget / DIFF_INTERRUPTS + 1);
+        program->interrupts[k].message = (unsigned short)rng();
+    }
+}
+
+/* Like fuzz_run: a halted guest skips ahead to the next interrupt.
+ * With step set every vcpu_run is one instruction, the way the
+ * core used to be driven through vcpu_step; no pair is fused and
+ * interrupts are polled after every instruction. */
+static void diff_run(const struct diff_program *program, unsigned long budget, int step, int jit, struct diff_result *result)
+{
+    struct diff_target target;
+    struct vcpu *cpu = &target.cpu;
+    unsigned long limit, instret;
+    unsigned long hash = 2166136261UL;
+    size_t next = 0, i;
+    int r = VCPU_RUN_BUDGET;
+
+    memset(&target, 0, sizeof(target));
+    init_vcpu(cpu, NULL);
+    cpu->on_ioread = &diff_ioread;
+    cpu->on_iowrite = &diff_iowrite;
+    if(jit && !vcpu_jit_enable(cpu))
+        warning("the core was built without the JIT");
+    memcpy(*cpu->memory, program->words, program->size * sizeof(unsigned short));
+
+    while(cpu->instret < budget) {
+        while(next < DIFF_INTERRUPTS && program->interrupts[next].at <= cpu->instret)
+            vcpu_interrupt(cpu, program->interrupts[next++].message);
+
+        limit = step ? 1 : budget - cpu->instret;
+        if(next < DIFF_INTERRUPTS && program->interrupts[next].at - cpu->instret < limit)
+            limit = program->interrupts[next].at - cpu->instret;
+
+        instret = cpu->instret;
+        r = vcpu_run(cpu, limit);
+
+        if(r == VCPU_RUN_HALT) {
+            if(next >= DIFF_INTERRUPTS)
+                break;
+            vcpu_interrupt(cpu, program->interrupts[next++].message);
+        }
+        else if(r == VCPU_RUN_FATAL || (r == VCPU_RUN_BUDGET && cpu->instret == instret)) {
+            break;
+        }
+    }
+
+    for(i = 0; i < sizeof(cpu->regs) / sizeof(cpu->regs[0]); i++)
+        hash = diff_hash(hash, cpu->regs[i]);
+    for(i = 0; i < VCPU_MEM_SIZE; i++)
+        hash = diff_hash(hash, (*cpu->memory)[i]);
+    hash = diff_hash(hash, (unsigned short)(cpu->interrupts.enabled | cpu->interrupts.busy << 1));
+    hash = diff_hash(hash, (unsigned short)(target.io_hash & 0xFFFF));
+    hash = diff_hash(hash, (unsigned short)(target.io_hash >> 16));
+
+    result->reason = r;
+    result->instret = cpu->instret;
+    result->hash = hash;
+
+    shutdown_vcpu(cpu);
+}
+
+static const char *get_reason(int reason)
+{
+    switch(reason) {
+        case VCPU_RUN_BUDGET:
+            return "budget";
+        case VCPU_RUN_HALT:
+            return "halt";
+        case VCPU_RUN_FATAL:
+            return "fatal";
+        default:
+            return "yield";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int r, jit = 0, failed = 0;
+    unsigned long num_programs = 1000, budget = 10000, seed = 1, i;
+    struct diff_program program;
+    struct diff_result stepped, batched;
+    const char *outfile_name = NULL;
+    FILE *outfile = stdout;
+
+    argv_0 = argv[0];
+    program.size = 256;
+
+    while((r = getopt(argc, argv, "n:l:b:S:o:Jvh")) != EOF) {
+        switch(r) {
+            case 'n':
+                num_programs = strtoul(optarg, NULL, 10);
+                break;
+            case 'l':
+                program.size = strtoul(optarg, NULL, 10);
+                if(!program.size || program.size > VCPU_MEM_SIZE)
+                    error("%s: invalid program length", optarg);
+                break;
+            case 'b':
+                budget = strtoul(optarg, NULL, 10);
+                if(!budget)
+                    error("%s: invalid instruction count", optarg);
+                break;
+            case 'S':
+                seed = strtoul(optarg, NULL, 10);
+                break;
+            case 'o':
+                outfile_name = optarg;
+                break;
+            case 'J':
+                jit = 1;
+                break;
+            case 'v':
+                lprintf("%s (VCPU DIFF) version 0.0.x", argv_0);
+                return 0;
+            default:
+                lprintf("Usage: %s [-n <count>] [-l <words>] [-b <count>] [-S <seed>] [-o <outfile>] [-J] [-h]", argv[0]);
+                lprintf("Options:");
+                lprintf("   -n <count>      : Random programs to run (default: 1000).");
+                lprintf("   -l <words>      : Length of every program (default: 256).");
+                lprintf("   -b <count>      : Instruction budget per program (default: 10000).");
+                lprintf("   -S <seed>       : Seed for the programs (default: 1).");
+                lprintf("   -o <outfile>    : Write the results there instead of the standard output.");
+                lprintf("   -J              : Use the JIT for the batched runs when the core has one.");
+                lprintf("   -v              : Print version and exit");
+                lprintf("   -h              : Write this message and exit.");
+                lprintf("Every program is run one instruction at a time and in batches;");
+                lprintf("a difference between the two fails. The results, one line per");
+                lprintf("program, are the same for every correct build of the core, so");
+                lprintf("the outputs of two dispatch backends can be compared directly.");
+                return (r == 'h');
+        }
+    }
+
+    rng_state ^= (unsigned long long)seed * 0xD1B54A32D192ED03ULL;
+    program.words = malloc(program.size * sizeof(unsigned short));
+    assert(("Out of memory!", program.words));
+
+    if(outfile_name) {
+        outfile = fopen(outfile_name, "w");
+        if(!outfile)
+            error("%s: %s", outfile_name, strerror(errno));
+    }
+
+    for(i = 0; i < num_programs; i++) {
+        diff_generate(&program, budget);
+        diff_run(&program, budget, 1, 0, &stepped);
+        diff_run(&program, budget, 0, jit, &batched);
+
+        fprintf(outfile, "%lu %s %lu %08lX\n", i, get_reason(stepped.reason), stepped.instret, stepped.hash);
+
+        if(stepped.reason != batched.reason || stepped.instret != batched.instret || stepped.hash != batched.hash) {
+            lprintf("program %lu (seed %lu): stepped %s after %lu, %08lX; batched %s after %lu, %08lX",
+                i, seed, get_reason(stepped.reason), stepped.instret, stepped.hash,
+                get_reason(batched.reason), batched.instret, batched.hash);
+            failed = 1;
+        }
+    }
+
+    if(outfile != stdout)
+        fclose(outfile);
+    free(program.words);
+    return failed;
+}
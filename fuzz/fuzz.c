@@ -0,0 +1,147 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fuzz.h"
+
+static void fuzz_ioread(struct vcpu *cpu, unsigned short port, unsigned short *value)
+{
+    struct fuzz_target *target = (struct fuzz_target *)cpu;
+    (void)port;
+    if(target->next_ioread < target->num_ioreads)
+        *value = target->ioreads[target->next_ioread++];
+}
+
+static void fuzz_iowrite(struct vcpu *cpu, unsigned short port, unsigned short value)
+{
+    struct fuzz_target *target = (struct fuzz_target *)cpu;
+    (void)value;
+    if(target->config->assert_port >= 0 && port == target->config->assert_port) {
+        target->crashed = 1;
+        vcpu_yield(cpu);
+    }
+}
+
+static unsigned short fuzz_word(const unsigned char *data)
+{
+    return (unsigned short)((data[0] << 8) | data[1]);
+}
+
+/* Memory records go straight into guest memory; reporting them
+ * marks the pages dirty, so the next restore takes them back */
+static void fuzz_parse(struct fuzz_target *target, const unsigned char *data, size_t size)
+{
+    const struct fuzz_config *config = target->config;
+    const unsigned char *end = data + size;
+    unsigned short addr, word;
+    unsigned long at = 0;
+    size_t i, count;
+
+    target->num_ioreads = 0;
+    target->next_ioread = 0;
+    target->num_interrupts = 0;
+
+    while(data < end) {
+        switch(*data++ % 4) {
+            case 0:
+                if(end - data < 3)
+                    return;
+                addr = fuzz_word(data);
+                count = data[2];
+                data += 3;
+                if((size_t)(end - data) < count * 2)
+                    return;
+                if(config->window_size) {
+                    for(i = 0; i < count; i++) {
+                        word = (unsigned short)(config->window + (addr + i) % config->window_size);
+                        (*target->cpu.memory)[word] = fuzz_word(data + i * 2);
+                        vcpu_invalidate(&target->cpu, word, 1);
+                    }
+                }
+                data += count * 2;
+                break;
+            case 1:
+                if(end - data < 2)
+                    return;
+                if(target->num_ioreads < FUZZ_MAX_IOREADS)
+                    target->ioreads[target->num_ioreads++] = fuzz_word(data);
+                data += 2;
+                break;
+            case 2:
+                if(end - data < 4)
+                    return;
+                at += fuzz_word(data);
+                if(target->num_interrupts < FUZZ_MAX_INTERRUPTS) {
+                    target->interrupts[target->num_interrupts].at = at;
+                    target->interrupts[target->num_interrupts].message = fuzz_word(data + 2);
+                    target->num_interrupts++;
+                }
+                data += 4;
+                break;
+        }
+    }
+}
+
+void init_fuzz_target(struct fuzz_target *target, const struct fuzz_config *config, const unsigned short *image, size_t image_size, unsigned char *coverage, size_t coverage_size)
+{
+    memset(target, 0, sizeof(struct fuzz_target));
+    target->config = config;
+
+    init_vcpu(&target->cpu, NULL);
+    target->cpu.on_ioread = &fuzz_ioread;
+    target->cpu.on_iowrite = &fuzz_iowrite;
+    vcpu_coverage_enable(&target->cpu, coverage, coverage_size);
+
+    if(image_size > VCPU_MEM_SIZE)
+        image_size = VCPU_MEM_SIZE;
+    memcpy(*target->cpu.memory, image, image_size * sizeof(unsigned short));
+
+    target->snapshot = malloc(sizeof(struct vcpu_snapshot));
+    assert(("Out of memory!", target->snapshot));
+    vcpu_snapshot(&target->cpu, target->snapshot);
+}
+
+void shutdown_fuzz_target(struct fuzz_target *target)
+{
+    shutdown_vcpu(&target->cpu);
+    free(target->snapshot);
+}
+
+/* Runs up to the next scheduled interrupt at a time. A halted
+ * guest skips ahead to it, since nothing else can wake it up. */
+int fuzz_run(struct fuzz_target *target, const unsigned char *data, size_t size)
+{
+    struct vcpu *cpu = &target->cpu;
+    unsigned long budget = target->config->budget;
+    unsigned long limit;
+    size_t next = 0;
+    int r;
+
+    vcpu_restore(cpu, target->snapshot);
+    cpu->coverage_prev = 0;
+    target->crashed = 0;
+    fuzz_parse(target, data, size);
+
+    while(cpu->instret < budget) {
+        while(next < target->num_interrupts && target->interrupts[next].at <= cpu->instret)
+            vcpu_interrupt(cpu, target->interrupts[next++].message);
+
+        limit = budget - cpu->instret;
+        if(next < target->num_interrupts && target->interrupts[next].at - cpu->instret < limit)
+            limit = target->interrupts[next].at - cpu->instret;
+
+        r = vcpu_run(cpu, limit);
+        if(target->crashed)
+            return FUZZ_CRASH;
+
+        if(r == VCPU_RUN_HALT) {
+            if(next >= target->num_interrupts)
+                return FUZZ_OK;
+            vcpu_interrupt(cpu, target->interrupts[next++].message);
+        }
+        else if(r == VCPU_RUN_FATAL) {
+            return target->config->fatal_crash ? FUZZ_CRASH : FUZZ_OK;
+        }
+    }
+
+    return FUZZ_HANG;
+}
@@ -0,0 +1,58 @@
+#ifndef _FUZZ_H_
+#define _FUZZ_H_ 1
+#include <stddef.h>
+#include <vcpu16.h>
+
+#define FUZZ_MAX_IOREADS    0x1000
+#define FUZZ_MAX_INTERRUPTS 0x100
+
+/* fuzz_run results */
+#define FUZZ_OK     0 /* The guest halted */
+#define FUZZ_CRASH  1 /* The guest wrote to the assertion port */
+#define FUZZ_HANG   2 /* The budget ran out */
+
+/* Input records, selected by the tag byte modulo 4; multi-byte
+ * fields are big endian and a record cut short by the end of the
+ * input is dropped:
+ *  0 <addr:16> <count:8> <word:16>... - stored into the memory window
+ *                                       at addr modulo its size
+ *  1 <word:16>                        - the value of the next IOR
+ *  2 <delay:16> <message:16>          - an interrupt raised delay
+ *                                       instructions after the last one
+ *  3                                  - padding
+ * IOR leaves its operand untouched once the values run out. */
+
+struct fuzz_config {
+    unsigned long budget;           /* Instructions per run */
+    unsigned short window;          /* First word memory records land in */
+    size_t window_size;             /* In words, zero disables memory records */
+    int assert_port;                /* IOW to it is a crash; negative for none */
+    int fatal_crash;                /* HLT with interrupts disabled is a crash */
+};
+
+struct fuzz_interrupt {
+    unsigned long at;
+    unsigned short message;
+};
+
+struct fuzz_target {
+    struct vcpu cpu;                /* First: the I/O handlers get the target back from it */
+    struct vcpu_snapshot *snapshot;
+    const struct fuzz_config *config;
+    int crashed;
+    size_t num_ioreads, next_ioread;
+    size_t num_interrupts;
+    unsigned short ioreads[FUZZ_MAX_IOREADS];
+    struct fuzz_interrupt interrupts[FUZZ_MAX_INTERRUPTS];
+};
+
+/* Loads the image (host byte order) at 0x0000 and keeps a snapshot
+ * of the machine to clone for every run. Edge coverage is counted
+ * into coverage (see vcpu_coverage_enable), the caller clears it. */
+void init_fuzz_target(struct fuzz_target *target, const struct fuzz_config *config, const unsigned short *image, size_t image_size, unsigned char *coverage, size_t coverage_size);
+void shutdown_fuzz_target(struct fuzz_target *target);
+
+/* Restores the snapshot, applies the input and runs it */
+int fuzz_run(struct fuzz_target *target, const unsigned char *data, size_t size);
+
+#endif
@@ -0,0 +1,495 @@
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/shm.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <vcpu16.h>
+#include "fuzz.h"
+
+#define MAX_INPUT_SIZE  0x1000
+#define MAX_STACKING    8
+
+struct input {
+    unsigned char *data;
+    size_t size;
+};
+
+static char print_buffer[4096] = { 0 };
+static const char *argv_0 = NULL;
+
+static struct input *corpus = NULL;
+static size_t num_corpus = 0;
+static volatile sig_atomic_t stopped = 0;
+static unsigned long long rng_state = 0x9E3779B97F4A7C15ULL;
+
+#define _ansi_reset     "\033[0m"
+#define _ansi_warning   "\033[1;35m"
+#define _ansi_error     "\033[1;31m"
+
+static void lprintf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, ap);
+    fprintf(stderr, "%s\n", print_buffer);
+    va_end(ap);
+}
+
+static void error(const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, va);
+    fprintf(stderr, "%s: %sfatal: %s%s\n", argv_0, _ansi_error, _ansi_reset, print_buffer);
+    va_end(va);
+    exit(1);
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stopped = 1;
+}
+
+/* xorshift64* */
+static unsigned long rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (unsigned long)((rng_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static unsigned char *read_file(const char *path, size_t *size, size_t max_size)
+{
+    FILE *infile;
+    unsigned char *data;
+
+    infile = fopen(path, "rb");
+    if(!infile)
+        error("%s: %s", path, strerror(errno));
+
+    data = malloc(max_size + 1);
+    assert(("Out of memory!", data));
+    *size = fread(data, 1, max_size, infile);
+    fclose(infile);
+    return data;
+}
+
+static void write_file(const char *path, const unsigned char *data, size_t size)
+{
+    FILE *outfile = fopen(path, "wb");
+    if(!outfile)
+        error("%s: %s", path, strerror(errno));
+    fwrite(data, 1, size, outfile);
+    fclose(outfile);
+}
+
+static void add_input(const unsigned char *data, size_t size)
+{
+    corpus = realloc(corpus, (num_corpus + 1) * sizeof(struct input));
+    assert(("Out of memory!", corpus));
+    corpus[num_corpus].data = malloc(size + 1);
+    assert(("Out of memory!", corpus[num_corpus].data));
+    memcpy(corpus[num_corpus].data, data, size);
+    corpus[num_corpus].size = size;
+    num_corpus++;
+}
+
+static void load_corpus(const char *path)
+{
+    DIR *dir;
+    struct dirent *entry;
+    char name[4096];
+    unsigned char *data;
+    size_t size;
+
+    dir = opendir(path);
+    if(!dir)
+        error("%s: %s", path, strerror(errno));
+
+    while((entry = readdir(dir)) != NULL) {
+        if(entry->d_name[0] == '.')
+            continue;
+        snprintf(name, sizeof(name), "%s/%s", path, entry->d_name);
+        data = read_file(name, &size, MAX_INPUT_SIZE);
+        add_input(data, size);
+        free(data);
+    }
+
+    closedir(dir);
+}
+
+/* AFL's hit count buckets: 1, 2, 3, 4-7, 8-15, 16-31, 32-127, 128+ */
+static unsigned char bucket[256];
+
+static void init_buckets(void)
+{
+    int i;
+    for(i = 0; i < 256; i++) {
+        if(i >= 128) bucket[i] = 0x80;
+        else if(i >= 32) bucket[i] = 0x40;
+        else if(i >= 16) bucket[i] = 0x20;
+        else if(i >= 8) bucket[i] = 0x10;
+        else if(i >= 4) bucket[i] = 0x08;
+        else if(i == 3) bucket[i] = 0x04;
+        else if(i == 2) bucket[i] = 0x02;
+        else bucket[i] = (unsigned char)i;
+    }
+}
+
+/* Folds the run's counters into buckets and takes whatever nobody
+ * has seen out of virgin. Returns nonzero for new behaviour. Most
+ * of the map is zero, so it is skipped a cache line at a time. */
+#define MERGE_CHUNK 64
+
+static int merge_coverage(unsigned char *coverage, unsigned char *virgin, size_t map_size)
+{
+    const unsigned long *words;
+    unsigned long any;
+    size_t i, j;
+    int found = 0;
+
+    for(i = 0; i < map_size; i += MERGE_CHUNK) {
+        words = (const unsigned long *)(coverage + i);
+        for(any = 0, j = 0; j < MERGE_CHUNK / sizeof(unsigned long); j++)
+            any |= words[j];
+        if(!any)
+            continue;
+
+        for(j = i; j < i + MERGE_CHUNK; j++) {
+            coverage[j] = bucket[coverage[j]];
+            if(coverage[j] & virgin[j]) {
+                virgin[j] &= ~coverage[j];
+                found = 1;
+            }
+        }
+    }
+
+    return found;
+}
+
+static size_t count_edges(const unsigned char *virgin, size_t map_size)
+{
+    size_t i, edges = 0;
+    for(i = 0; i < map_size; i++) {
+        if(virgin[i] != 0xFF)
+            edges++;
+    }
+    return edges;
+}
+
+static size_t mutate(unsigned char *data, size_t size)
+{
+    static const unsigned char interesting[] = { 0x00, 0x01, 0x7F, 0x80, 0xFF };
+    static const unsigned short interesting_words[] = { 0x0000, 0x0001, 0x0002, 0x0003, 0x0004, 0x0007, 0x0008, 0x0010, 0x0020, 0x0040, 0x007F, 0x0080, 0x00FF, 0x0100, 0x7FFF, 0x8000, 0xFFFF };
+    unsigned char record[5];
+    unsigned short word;
+    size_t i, pos, len, stacking = 1 + rng() % MAX_STACKING;
+    const struct input *other;
+
+    for(i = 0; i < stacking; i++) {
+        switch(rng() % 9) {
+            case 0:
+                if(size)
+                    data[rng() % size] ^= (unsigned char)(1 << (rng() % 8));
+                break;
+            case 1:
+                if(size)
+                    data[rng() % size] = (unsigned char)rng();
+                break;
+            case 2:
+                if(size)
+                    data[rng() % size] += (unsigned char)(rng() % 35) - 17;
+                break;
+            case 3:
+                if(size)
+                    data[rng() % size] = interesting[rng() % sizeof(interesting)];
+                break;
+            case 4:
+                /* Insert a few random bytes */
+                len = 1 + rng() % 8;
+                if(size + len > MAX_INPUT_SIZE)
+                    break;
+                pos = rng() % (size + 1);
+                memmove(data + pos + len, data + pos, size - pos);
+                for(size += len; len; len--)
+                    data[pos + len - 1] = (unsigned char)rng();
+                break;
+            case 5:
+                if(size < 2)
+                    break;
+                pos = rng() % size;
+                len = 1 + rng() % (size - pos);
+                memmove(data + pos, data + pos + len, size - pos - len);
+                size -= len;
+                break;
+            case 6:
+                /* Splice the tail of another input in */
+                other = corpus + rng() % num_corpus;
+                if(!other->size)
+                    break;
+                pos = size ? rng() % size : 0;
+                len = rng() % other->size;
+                if(pos + (other->size - len) > MAX_INPUT_SIZE)
+                    break;
+                memcpy(data + pos, other->data + len, other->size - len);
+                size = pos + (other->size - len);
+                break;
+            case 7:
+                if(size < 2)
+                    break;
+                pos = rng() % (size - 1);
+                word = interesting_words[rng() % (sizeof(interesting_words) / sizeof(interesting_words[0]))];
+                data[pos] = word >> 8;
+                data[pos + 1] = word & 0xFF;
+                break;
+            case 8:
+                /* Insert a whole I/O read or interrupt record */
+                word = interesting_words[rng() % (sizeof(interesting_words) / sizeof(interesting_words[0]))];
+                record[0] = (unsigned char)(1 + rng() % 2);
+                record[1] = word >> 8;
+                record[2] = word & 0xFF;
+                record[3] = (unsigned char)rng();
+                record[4] = (unsigned char)rng();
+                len = (record[0] == 1) ? 3 : 5;
+                if(size + len > MAX_INPUT_SIZE)
+                    break;
+                pos = rng() % (size + 1);
+                memmove(data + pos + len, data + pos, size - pos);
+                memcpy(data + pos, record, len);
+                size += len;
+                break;
+        }
+    }
+
+    return size;
+}
+
+static const char *get_result(int result)
+{
+    switch(result) {
+        case FUZZ_CRASH:
+            return "crash";
+        case FUZZ_HANG:
+            return "hang";
+        default:
+            return "ok";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int r, result, crashed = 0;
+    struct fuzz_config config;
+    struct fuzz_target *target;
+    unsigned char *coverage = NULL, *virgin, *virgin_crash;
+    unsigned short *image;
+    unsigned char *data;
+    const char *corpus_dir = NULL, *output_dir = NULL, *shm_id;
+    unsigned long execs = 0, max_execs = 0, saved = 0, crashes = 0, last_execs = 0;
+    unsigned long begin, end;
+    time_t start, now, last;
+    char name[4096];
+    size_t size, i, map_size = 0;
+    char *s;
+
+    argv_0 = argv[0];
+
+    memset(&config, 0, sizeof(config));
+    config.budget = 100000;
+    config.assert_port = -1;
+
+    while((r = getopt(argc, argv, "n:w:p:Fm:i:o:x:S:vh")) != EOF) {
+        switch(r) {
+            case 'n':
+                config.budget = strtoul(optarg, NULL, 10);
+                break;
+            case 'w':
+                begin = strtoul(optarg, &s, 16);
+                end = (*s == ':') ? strtoul(s + 1, NULL, 16) : VCPU_MEM_SIZE;
+                if(begin >= VCPU_MEM_SIZE || end <= begin || end > VCPU_MEM_SIZE)
+                    error("%s: invalid memory window", optarg);
+                config.window = (unsigned short)begin;
+                config.window_size = end - begin;
+                break;
+            case 'p':
+                config.assert_port = (int)(strtoul(optarg, NULL, 16) & 0xFFFF);
+                break;
+            case 'F':
+                config.fatal_crash = 1;
+                break;
+            case 'm':
+                map_size = strtoul(optarg, NULL, 16);
+                if(map_size < MERGE_CHUNK || map_size > VCPU_COVERAGE_SIZE || (map_size & (map_size - 1)))
+                    error("%s: invalid coverage map size", optarg);
+                break;
+            case 'i':
+                corpus_dir = optarg;
+                break;
+            case 'o':
+                output_dir = optarg;
+                break;
+            case 'x':
+                max_execs = strtoul(optarg, NULL, 10);
+                break;
+            case 'S':
+                rng_state ^= strtoul(optarg, NULL, 10) * 0xBF58476D1CE4E5B9ULL;
+                break;
+            case 'v':
+                lprintf("%s (VCPU FUZZ) version 0.0.x", argv_0);
+                return 0;
+            default:
+                lprintf("Usage: %s [-n <count>] [-w <begin:end>] [-p <port>] [-F] [-m <size>] [-i <dir>] [-o <dir>] [-x <count>] [-S <seed>] [-h] <rom> [<input>...]", argv_0);
+                lprintf("Options:");
+                lprintf("   -n <count>      : Instruction budget per run (default: 100000).");
+                lprintf("   -w <begin:end>  : Memory window [begin, end) input records may write (default: none).");
+                lprintf("   -p <port>       : I/O port the guest writes to on a failed assertion.");
+                lprintf("   -F              : Count HLT with interrupts disabled as a crash.");
+                lprintf("   -m <size>       : Coverage map size, a power of two (default: fits the ROM).");
+                lprintf("   -i <dir>        : Seed corpus.");
+                lprintf("   -o <dir>        : Fuzz, saving new inputs to <dir>/queue and crashes to <dir>/crashes.");
+                lprintf("   -x <count>      : Stop fuzzing after <count> runs (default: never).");
+                lprintf("   -S <seed>       : Seed for the mutator.");
+                lprintf("   -v              : Print version and exit");
+                lprintf("   -h              : Write this message and exit.");
+                lprintf("   <rom>           : Guest firmware.");
+                lprintf("   <input>         : Run these inputs once each and exit.");
+                lprintf("Under afl-fuzz (__AFL_SHM_ID set) the input is read from stdin");
+                lprintf("or the first <input> and coverage goes to AFL's shared map.");
+                return (r == 'h');
+        }
+    }
+
+    if(optind >= argc)
+        error("no input files");
+
+    image = (unsigned short *)read_file(argv[optind], &size, sizeof(vcpu_memory_t));
+    size /= sizeof(unsigned short);
+    for(i = 0; i < size; i++)
+        image[i] = vcpu_be16_to_host(image[i]);
+    optind++;
+
+    /* Code within the ROM hashes its edges below the ROM's size
+     * rounded up, so that is all the map the fuzzer has to scan */
+    if(!map_size) {
+        for(map_size = MERGE_CHUNK; map_size < size; map_size *= 2);
+    }
+
+    if((shm_id = getenv("__AFL_SHM_ID")) != NULL) {
+        map_size = VCPU_COVERAGE_SIZE;
+        coverage = shmat(atoi(shm_id), NULL, 0);
+        if(coverage == (void *)-1)
+            error("shmat: %s", strerror(errno));
+    }
+    else {
+        coverage = calloc(1, map_size);
+        assert(("Out of memory!", coverage));
+    }
+
+    target = malloc(sizeof(struct fuzz_target));
+    assert(("Out of memory!", target));
+    init_fuzz_target(target, &config, image, size, coverage, map_size);
+    if(!vcpu_coverage_enable(&target->cpu, coverage, map_size))
+        error("the core was built without coverage support");
+
+    /* One input per process, the way afl-fuzz drives us */
+    if(shm_id) {
+        if(optind < argc) {
+            data = read_file(argv[optind], &size, MAX_INPUT_SIZE);
+        }
+        else {
+            data = malloc(MAX_INPUT_SIZE);
+            assert(("Out of memory!", data));
+            size = fread(data, 1, MAX_INPUT_SIZE, stdin);
+        }
+        if(fuzz_run(target, data, size) == FUZZ_CRASH)
+            abort();
+        return 0;
+    }
+
+    /* Replay */
+    if(!output_dir) {
+        for(; optind < argc; optind++) {
+            data = read_file(argv[optind], &size, MAX_INPUT_SIZE);
+            result = fuzz_run(target, data, size);
+            printf("%s: %s, %lu instructions\n", argv[optind], get_result(result), target->cpu.instret);
+            crashed |= (result == FUZZ_CRASH);
+            free(data);
+        }
+        return crashed;
+    }
+
+    if(corpus_dir)
+        load_corpus(corpus_dir);
+    if(!num_corpus)
+        add_input((const unsigned char *)"", 0);
+
+    snprintf(name, sizeof(name), "%s/queue", output_dir);
+    mkdir(output_dir, 0755);
+    mkdir(name, 0755);
+    snprintf(name, sizeof(name), "%s/crashes", output_dir);
+    mkdir(name, 0755);
+
+    virgin = malloc(map_size);
+    virgin_crash = malloc(map_size);
+    data = malloc(MAX_INPUT_SIZE + 1);
+    assert(("Out of memory!", virgin && virgin_crash && data));
+    memset(virgin, 0xFF, map_size);
+    memset(virgin_crash, 0xFF, map_size);
+
+    init_buckets();
+    signal(SIGINT, &on_signal);
+    start = last = time(NULL);
+
+    /* The seeds go first so their coverage counts as known */
+    for(i = 0; i < num_corpus; i++) {
+        memset(coverage, 0, map_size);
+        fuzz_run(target, corpus[i].data, corpus[i].size);
+        merge_coverage(coverage, virgin, map_size);
+        execs++;
+    }
+
+    while(!stopped && (!max_execs || execs < max_execs)) {
+        i = rng() % num_corpus;
+        memcpy(data, corpus[i].data, corpus[i].size);
+        size = mutate(data, corpus[i].size);
+
+        memset(coverage, 0, map_size);
+        result = fuzz_run(target, data, size);
+        execs++;
+
+        if(result == FUZZ_CRASH) {
+            if(merge_coverage(coverage, virgin_crash, map_size)) {
+                snprintf(name, sizeof(name), "%s/crashes/id_%06lu", output_dir, crashes++);
+                write_file(name, data, size);
+            }
+        }
+        else if(merge_coverage(coverage, virgin, map_size)) {
+            snprintf(name, sizeof(name), "%s/queue/id_%06lu", output_dir, saved++);
+            write_file(name, data, size);
+            add_input(data, size);
+        }
+
+        if((execs & 0x3FF) == 0 && (now = time(NULL)) != last) {
+            fprintf(stderr, "\r%lu runs, %lu/s, %lu in corpus, %lu crashes, %lu edges   ", execs, (execs - last_execs) / (unsigned long)(now - last),
+                (unsigned long)num_corpus, crashes, (unsigned long)count_edges(virgin, map_size));
+            last_execs = execs;
+            last = now;
+        }
+    }
+
+    now = time(NULL);
+    fprintf(stderr, "\r%lu runs in %lus, %lu in corpus, %lu crashes, %lu edges   \n", execs, (unsigned long)(now - start),
+        (unsigned long)num_corpus, crashes, (unsigned long)count_edges(virgin, map_size));
+
+    shutdown_fuzz_target(target);
+    return 0;
+}
@@ -0,0 +1,144 @@
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vcpu16.h>
+#include <vcpuas.h>
+
+static char print_buffer[4096] = { 0 };
+static const char *argv_0 = NULL;
+
+#define _ansi_reset     "\033[0m"
+#define _ansi_warning   "\033[1;35m"
+#define _ansi_error     "\033[1;31m"
+
+static void lprintf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, ap);
+    fprintf(stderr, "%s\n", print_buffer);
+    va_end(ap);
+}
+
+static void error(const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, va);
+    fprintf(stderr, "%s: " _ansi_error "fatal: " _ansi_reset "%s\n", argv_0, print_buffer);
+    va_end(va);
+    exit(1);
+}
+
+static unsigned char *read_file(const char *path, size_t *size)
+{
+    FILE *infile;
+    unsigned char *data = NULL;
+    size_t max_size = 0, n;
+
+    infile = fopen(path, "rb");
+    if(!infile)
+        error("%s: %s", path, strerror(errno));
+
+    *size = 0;
+    do {
+        if(*size == max_size) {
+            max_size = max_size ? max_size * 2 : 0x10000;
+            data = realloc(data, max_size);
+            if(!data)
+                error("Out of memory!");
+        }
+        n = fread(data + *size, 1, max_size - *size, infile);
+        *size += n;
+    } while(n);
+
+    if(ferror(infile))
+        error("%s: %s", path, strerror(errno));
+    fclose(infile);
+    return data;
+}
+
+/* Objects carry no line numbers, so diagnostics name the object alone */
+static void print_diagnostics(char **paths, const struct vcpuas_result *result)
+{
+    const struct vcpuas_diagnostic *diagnostic;
+    size_t i;
+
+    for(i = 0; i < result->num_diagnostics; i++) {
+        diagnostic = result->diagnostics + i;
+        if(diagnostic->severity == VCPUAS_ERROR)
+            fprintf(stderr, "%s: " _ansi_error "error: " _ansi_reset "%s\n", paths[diagnostic->object], diagnostic->message);
+        else
+            fprintf(stderr, "%s: " _ansi_warning "warning: " _ansi_reset "%s\n", paths[diagnostic->object], diagnostic->message);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    FILE *outfile;
+    const char *outfile_name = "a.out";
+    struct vcpuas_object *objects;
+    struct vcpuas_result result;
+    unsigned char *data;
+    size_t num_objects, size, i;
+    int r;
+
+    argv_0 = argv[0];
+
+    while((r = getopt(argc, argv, "o:vh")) != -1) {
+        switch(r) {
+            case 'o':
+                outfile_name = optarg;
+                break;
+            case 'v':
+                lprintf("%s (VCPU-16 LD) version 0.0.x", argv_0);
+                return 0;
+            default:
+                lprintf("Usage: %s [-o <outfile>] [-h] <object>...", argv_0);
+                lprintf("Options:");
+                lprintf("   -o <outfile>    : Set the output file");
+                lprintf("   -v              : Print version and exit");
+                lprintf("   -h              : Print this message and exit");
+                lprintf("   <object>        : Object written by vcpu-as -c, placed in the order given");
+                return (r == 'h') ? 0 : 1;
+        }
+    }
+
+    if(optind >= argc)
+        error("no input files");
+
+    num_objects = (size_t)(argc - optind);
+    objects = calloc(num_objects, sizeof(struct vcpuas_object));
+    if(!objects)
+        error("Out of memory!");
+
+    for(i = 0; i < num_objects; i++) {
+        data = read_file(argv[optind + i], &size);
+        if(!vcpuas_read_object(data, size, objects + i))
+            error("%s: not a VCPU-16 object", argv[optind + i]);
+        free(data);
+    }
+
+    r = vcpuas_link(objects, num_objects, &result);
+    print_diagnostics(argv + optind, &result);
+    for(i = 0; i < num_objects; i++)
+        vcpuas_free_object(objects + i);
+    free(objects);
+    if(!r)
+        return 1;
+
+    if(!(outfile = fopen(outfile_name, "wb")))
+        error("unable to open %s for writing", outfile_name);
+
+    for(i = 0; i < result.image_size; i++)
+        result.image[i] = vcpu_host_to_be16(result.image[i]);
+    if(fwrite(result.image, sizeof(unsigned short), result.image_size, outfile) != result.image_size)
+        error("%s: %s", outfile_name, strerror(errno));
+
+    fclose(outfile);
+    vcpuas_free_result(&result);
+    return 0;
+}
@@ -0,0 +1,439 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "batch.h"
+#include "pool.h"
+
+/* The lane keeps a snapshot of the image it loaded last,
+ * the next job of the same image restores it instead */
+struct batch_lane {
+    struct vcpu cpu;
+    vcpu_memory_t *memory;
+    struct vcpu_snapshot *snapshot;
+    const unsigned short *image;
+    int ready;
+};
+
+struct batch_worker {
+    struct batch_lane lanes[VCPU_LOCKSTEP_LANES];
+    struct vcpu_profile *profile;
+    struct vcpu_perf *perf;         /* Opened by the worker's own thread */
+};
+
+/* A task runs order[first, first + count), all on the same image
+ * when the batch runs in lockstep and a single job otherwise */
+struct batch_group {
+    size_t first;
+    size_t count;
+};
+
+/* How many instructions an SMP core runs between
+ * taking interrupts and looking at code other cores wrote */
+#define BATCH_SMP_SLICE 4096
+
+/* Core states of an SMP job */
+#define BATCH_CORE_RUNNING  0
+#define BATCH_CORE_HALTED   1 /* Waiting for an IPI */
+#define BATCH_CORE_DONE     2 /* Out of budget or halted for good */
+
+struct batch_machine {
+    const struct batch_config *config;
+    struct vcpu_smp smp;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int *states;
+    int *reasons;
+    int done;
+};
+
+struct batch {
+    const struct batch_config *config;
+    const struct batch_job *jobs;
+    struct batch_result *results;
+    struct batch_worker *workers;
+    struct batch_group *groups;
+    size_t *order;
+};
+
+static void batch_load(vcpu_memory_t *memory, const struct batch_job *job)
+{
+    size_t size = job->image_size;
+
+    if(size > VCPU_MEM_SIZE)
+        size = VCPU_MEM_SIZE;
+    memcpy(*memory, job->image, size * sizeof(unsigned short));
+    memset(*memory + size, 0, (VCPU_MEM_SIZE - size) * sizeof(unsigned short));
+}
+
+/* Reported to the core so that the next restore undoes them */
+static void batch_patch(struct vcpu *cpu, const struct batch_job *job)
+{
+    const struct batch_patch *patch;
+    size_t i, count;
+
+    for(i = 0; i < job->num_patches; i++) {
+        patch = job->patches + i;
+        count = patch->size;
+        if(patch->addr + count > VCPU_MEM_SIZE)
+            count = VCPU_MEM_SIZE - patch->addr;
+        memcpy(*cpu->memory + patch->addr, patch->words, count * sizeof(unsigned short));
+        vcpu_invalidate(cpu, patch->addr, count);
+    }
+}
+
+static void batch_collect(const struct batch_config *config, const struct vcpu *cpu, struct batch_result *result, int reason)
+{
+    unsigned short *dump;
+    size_t i;
+
+    result->reason = reason;
+    result->instret = cpu->instret;
+    memcpy(result->regs, cpu->regs, sizeof(result->regs));
+
+    if(result->dump) {
+        dump = result->dump;
+        for(i = 0; i < config->num_ranges; i++) {
+            const struct batch_range *range = config->ranges + i;
+            if(range->begin + range->size > VCPU_MEM_SIZE) {
+                size_t head = VCPU_MEM_SIZE - range->begin;
+                memcpy(dump, *cpu->memory + range->begin, head * sizeof(unsigned short));
+                memcpy(dump + head, *cpu->memory, (range->size - head) * sizeof(unsigned short));
+            }
+            else {
+                memcpy(dump, *cpu->memory + range->begin, range->size * sizeof(unsigned short));
+            }
+            dump += range->size;
+        }
+    }
+}
+
+static void batch_task(void *ctx, size_t task, unsigned int id)
+{
+    struct batch *batch = ctx;
+    struct batch_worker *worker = batch->workers + id;
+    const struct batch_group *group = batch->groups + task;
+    const struct batch_config *config = batch->config;
+    unsigned long budget = config->budget;
+    struct vcpu *cpus[VCPU_LOCKSTEP_LANES];
+    int reasons[VCPU_LOCKSTEP_LANES];
+    const struct batch_job *job;
+    struct batch_lane *lane;
+    size_t i;
+    int r;
+
+    for(i = 0; i < group->count; i++) {
+        lane = worker->lanes + i;
+        job = batch->jobs + batch->order[group->first + i];
+
+        /* Instances are set up by the worker that first needs them
+         * and then reused for every job that lands on it */
+        if(!lane->ready) {
+            lane->memory = malloc(sizeof(vcpu_memory_t));
+            lane->snapshot = malloc(sizeof(struct vcpu_snapshot));
+            assert(("Out of memory!", lane->memory && lane->snapshot));
+            init_vcpu(&lane->cpu, lane->memory);
+            if(config->jit)
+                vcpu_jit_enable(&lane->cpu);
+            lane->ready = 1;
+        }
+
+        if(lane->image == job->image) {
+            vcpu_restore(&lane->cpu, lane->snapshot);
+        }
+        else {
+            reset_vcpu(&lane->cpu);
+            batch_load(lane->memory, job);
+            vcpu_snapshot(&lane->cpu, lane->snapshot);
+            lane->image = job->image;
+        }
+
+        batch_patch(&lane->cpu, job);
+        cpus[i] = &lane->cpu;
+    }
+
+    if(group->count > 1) {
+        vcpu_run_lockstep(cpus, group->count, budget, reasons);
+    }
+    else {
+        /* Every job starts at the root of the worker's profile */
+        if(config->profile) {
+            if(!worker->profile) {
+                worker->profile = malloc(sizeof(struct vcpu_profile));
+                assert(("Out of memory!", worker->profile));
+                init_vcpu_profile(worker->profile);
+            }
+            vcpu_profile_enable(cpus[0], worker->profile);
+        }
+        if(config->perf) {
+            if(!worker->perf) {
+                worker->perf = malloc(sizeof(struct vcpu_perf));
+                assert(("Out of memory!", worker->perf));
+                init_vcpu_perf(worker->perf, config->perf->by_class);
+            }
+            vcpu_perf_enable(cpus[0], worker->perf);
+        }
+
+        /* There is nothing to wake a halted machine up,
+         * so HLT ends the job no matter the interrupt flag */
+        do {
+            r = vcpu_run(cpus[0], budget - cpus[0]->instret);
+        } while(r == VCPU_RUN_YIELD && cpus[0]->instret < budget);
+        reasons[0] = r;
+
+        vcpu_profile_enable(cpus[0], NULL);
+        vcpu_perf_enable(cpus[0], NULL);
+    }
+
+    for(i = 0; i < group->count; i++)
+        batch_collect(config, &worker->lanes[i].cpu, batch->results + batch->order[group->first + i], reasons[i]);
+}
+
+struct batch_key {
+    const unsigned short *image;
+    size_t job;
+};
+
+static int batch_compare(const void *a, const void *b)
+{
+    const struct batch_key *ka = a, *kb = b;
+
+    if(ka->image != kb->image)
+        return ((const char *)ka->image < (const char *)kb->image) ? -1 : 1;
+    return (ka->job < kb->job) ? -1 : (ka->job > kb->job);
+}
+
+/* Returns the number of groups */
+static size_t batch_group(struct batch *batch, size_t num_jobs)
+{
+    const struct batch_job *jobs = batch->jobs;
+    struct batch_key *keys;
+    size_t i, num_groups = 0;
+
+    for(i = 0; i < num_jobs; i++)
+        batch->order[i] = i;
+
+    /* Profiled and counted jobs would leave lockstep at once anyway */
+    if(!batch->config->lockstep || batch->config->profile || batch->config->perf) {
+        for(i = 0; i < num_jobs; i++) {
+            batch->groups[i].first = i;
+            batch->groups[i].count = 1;
+        }
+        return num_jobs;
+    }
+
+    keys = malloc((num_jobs + 1) * sizeof(struct batch_key));
+    assert(("Out of memory!", keys));
+    for(i = 0; i < num_jobs; i++) {
+        keys[i].image = jobs[i].image;
+        keys[i].job = i;
+    }
+
+    qsort(keys, num_jobs, sizeof(struct batch_key), batch_compare);
+    for(i = 0; i < num_jobs; i++)
+        batch->order[i] = keys[i].job;
+    free(keys);
+
+    for(i = 0; i < num_jobs; i++) {
+        struct batch_group *group = batch->groups + num_groups - 1;
+        if(!num_groups || group->count >= VCPU_LOCKSTEP_LANES || jobs[batch->order[group->first]].image != jobs[batch->order[i]].image) {
+            group = batch->groups + num_groups++;
+            group->first = i;
+            group->count = 0;
+        }
+        group->count++;
+    }
+
+    return num_groups;
+}
+
+/* Called by the sender right after it posted the IPI, so
+ * a sleeping core either sees the message or gets woken up */
+static void batch_smp_ipi(struct vcpu_smp *smp, unsigned int core)
+{
+    struct batch_machine *machine = smp->user;
+    (void)core;
+    pthread_mutex_lock(&machine->lock);
+    pthread_cond_broadcast(&machine->wake);
+    pthread_mutex_unlock(&machine->lock);
+}
+
+/* With the lock held. Every core that is still running could send
+ * an IPI, and every sender finishes batch_smp_ipi before it can halt,
+ * so once no core runs the undelivered messages are all in sight. */
+static int batch_smp_stuck(struct batch_machine *machine)
+{
+    unsigned int i;
+
+    for(i = 0; i < machine->smp.num_cores; i++) {
+        if(machine->states[i] == BATCH_CORE_RUNNING)
+            return 0;
+        if(machine->states[i] == BATCH_CORE_HALTED && vcpu_interrupt_pending(machine->smp.cores + i))
+            return 0;
+    }
+
+    return 1;
+}
+
+static void batch_smp_stop(struct batch_machine *machine, unsigned int id, int state)
+{
+    pthread_mutex_lock(&machine->lock);
+    machine->states[id] = state;
+    if(batch_smp_stuck(machine)) {
+        machine->done = 1;
+        pthread_cond_broadcast(&machine->wake);
+    }
+    pthread_mutex_unlock(&machine->lock);
+}
+
+static void *batch_smp_core(void *arg)
+{
+    struct vcpu *cpu = arg;
+    struct batch_machine *machine = cpu->smp->user;
+    unsigned long budget = machine->config->budget;
+    unsigned long slice;
+    unsigned int id = cpu->cpi.core_id;
+    int r = VCPU_RUN_BUDGET;
+
+    while(cpu->instret < budget) {
+        vcpu_smp_sync(cpu);
+
+        slice = budget - cpu->instret;
+        if(slice > BATCH_SMP_SLICE)
+            slice = BATCH_SMP_SLICE;
+        r = vcpu_run(cpu, slice);
+
+        if(r == VCPU_RUN_HALT) {
+            batch_smp_stop(machine, id, BATCH_CORE_HALTED);
+            pthread_mutex_lock(&machine->lock);
+            while(!machine->done && !vcpu_interrupt_pending(cpu))
+                pthread_cond_wait(&machine->wake, &machine->lock);
+            if(!machine->done)
+                machine->states[id] = BATCH_CORE_RUNNING;
+            pthread_mutex_unlock(&machine->lock);
+            if(machine->done)
+                break;
+        }
+        else if(r == VCPU_RUN_FATAL) {
+            break;
+        }
+    }
+
+    machine->reasons[id] = r;
+    batch_smp_stop(machine, id, BATCH_CORE_DONE);
+    return NULL;
+}
+
+static void batch_run_smp(const struct batch_config *config, const struct batch_job *jobs, struct batch_result *results, size_t num_jobs)
+{
+    struct batch_machine machine;
+    pthread_t *threads;
+    unsigned long instret;
+    unsigned int i, num_cores = config->num_cores;
+    size_t job;
+
+    memset(&machine, 0, sizeof(machine));
+    machine.config = config;
+    init_vcpu_smp(&machine.smp, num_cores);
+    machine.smp.on_ipi = &batch_smp_ipi;
+    machine.smp.user = &machine;
+    machine.states = malloc(num_cores * sizeof(int));
+    machine.reasons = malloc(num_cores * sizeof(int));
+    threads = malloc(num_cores * sizeof(pthread_t));
+    assert(("Out of memory!", machine.states && machine.reasons && threads));
+    pthread_mutex_init(&machine.lock, NULL);
+    pthread_cond_init(&machine.wake, NULL);
+
+    for(i = 0; i < num_cores; i++) {
+        if(config->jit)
+            vcpu_jit_enable(machine.smp.cores + i);
+    }
+
+    for(job = 0; job < num_jobs; job++) {
+        reset_vcpu_smp(&machine.smp);
+        batch_load(machine.smp.memory, jobs + job);
+        batch_patch(machine.smp.cores, jobs + job);
+        machine.done = 0;
+        for(i = 0; i < num_cores; i++)
+            machine.states[i] = BATCH_CORE_RUNNING;
+
+        for(i = 0; i < num_cores; i++)
+            pthread_create(threads + i, NULL, &batch_smp_core, machine.smp.cores + i);
+        for(i = 0, instret = 0; i < num_cores; i++) {
+            pthread_join(threads[i], NULL);
+            instret += machine.smp.cores[i].instret;
+        }
+
+        batch_collect(config, machine.smp.cores, results + job, machine.reasons[0]);
+        results[job].instret = instret;
+    }
+
+    pthread_cond_destroy(&machine.wake);
+    pthread_mutex_destroy(&machine.lock);
+    free(threads);
+    free(machine.reasons);
+    free(machine.states);
+    shutdown_vcpu_smp(&machine.smp);
+}
+
+size_t batch_dump_size(const struct batch_config *config)
+{
+    size_t i, size = 0;
+    for(i = 0; i < config->num_ranges; i++)
+        size += config->ranges[i].size;
+    return size;
+}
+
+void batch_run(const struct batch_config *config, const struct batch_job *jobs, struct batch_result *results, size_t num_jobs)
+{
+    struct batch batch;
+    unsigned int i, j, num_workers;
+    size_t num_groups;
+
+    if(config->num_cores > 1) {
+        batch_run_smp(config, jobs, results, num_jobs);
+        return;
+    }
+
+    batch.config = config;
+    batch.jobs = jobs;
+    batch.results = results;
+    batch.order = malloc((num_jobs + 1) * sizeof(size_t));
+    batch.groups = malloc((num_jobs + 1) * sizeof(struct batch_group));
+    assert(("Out of memory!", batch.order && batch.groups));
+
+    num_groups = batch_group(&batch, num_jobs);
+
+    num_workers = config->num_workers ? config->num_workers : pool_default_workers();
+    if(num_workers > num_groups)
+        num_workers = num_groups ? (unsigned int)num_groups : 1;
+
+    batch.workers = calloc(num_workers, sizeof(struct batch_worker));
+    assert(("Out of memory!", batch.workers));
+
+    pool_run(num_workers, num_groups, batch_task, &batch);
+
+    for(i = 0; i < num_workers; i++) {
+        if(batch.workers[i].profile) {
+            vcpu_profile_merge(config->profile, batch.workers[i].profile);
+            free(batch.workers[i].profile);
+        }
+        if(batch.workers[i].perf) {
+            vcpu_perf_merge(config->perf, batch.workers[i].perf);
+            shutdown_vcpu_perf(batch.workers[i].perf);
+            free(batch.workers[i].perf);
+        }
+        for(j = 0; j < VCPU_LOCKSTEP_LANES; j++) {
+            struct batch_lane *lane = batch.workers[i].lanes + j;
+            if(lane->ready) {
+                shutdown_vcpu(&lane->cpu);
+                free(lane->snapshot);
+                free(lane->memory);
+            }
+        }
+    }
+
+    free(batch.workers);
+    free(batch.groups);
+    free(batch.order);
+}
@@ -0,0 +1,64 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_ 1
+#include <stddef.h>
+#include <vcpu16.h>
+
+/* Words stored over the image before a job starts */
+struct batch_patch {
+    unsigned short addr;
+    size_t size;
+    const unsigned short *words;
+};
+
+struct batch_job {
+    const unsigned short *image;    /* Host byte order, loaded at 0x0000 */
+    size_t image_size;              /* In words */
+    const struct batch_patch *patches;
+    size_t num_patches;
+};
+
+/* A memory range copied into every result, wrapping
+ * around the end of memory; size is at most VCPU_MEM_SIZE */
+struct batch_range {
+    unsigned short begin;
+    size_t size;
+};
+
+struct batch_config {
+    unsigned int num_workers;       /* Zero runs one worker per CPU */
+    unsigned long budget;           /* Instructions per job */
+    const struct batch_range *ranges;
+    size_t num_ranges;
+    int jit;                        /* Use vcpu_jit_enable if available */
+    int lockstep;                   /* Run jobs sharing an image with vcpu_run_lockstep */
+    unsigned int num_cores;         /* More than one runs every job as an SMP machine */
+    struct vcpu_profile *profile;   /* When set, every job is profiled into it; not for SMP */
+    struct vcpu_perf *perf;         /* When set, host counters of every job are added to it; not for SMP */
+};
+
+/* SMP jobs report the reason and registers of core 0
+ * and the instructions retired by all cores together */
+struct batch_result {
+    int reason;                     /* VCPU_RUN_* */
+    unsigned long instret;
+    unsigned short regs[16];
+    unsigned short *dump;           /* Set by the caller: batch_dump_size words or NULL */
+};
+
+/* Words needed to hold every configured range of one job */
+size_t batch_dump_size(const struct batch_config *config);
+
+/* Runs every job to a halt or to the budget and fills results[i]
+ * for jobs[i]. Each worker keeps its vcpus and memory blocks for
+ * all jobs it runs; a vcpu that ran the same image before is brought
+ * back with vcpu_restore, which only copies the pages it wrote.
+ * In lockstep mode jobs are grouped by image pointer, so jobs of
+ * one ROM should share the same image. The machines have no I/O
+ * devices attached: IOR leaves its operand untouched and IOW is
+ * ignored. SMP jobs run one after another, each on a host thread
+ * per core; every core gets the whole budget. A core halted with
+ * interrupts enabled sleeps until an IPI arrives, the job ends
+ * once no core is left that could send one. */
+void batch_run(const struct batch_config *config, const struct batch_job *jobs, struct batch_result *results, size_t num_jobs);
+
+#endif
@@ -0,0 +1,414 @@
+#include <assert.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vcpu16.h>
+#include "batch.h"
+#if defined(VCPU_RUN_AS)
+#include <vcpuas.h>
+#endif
+
+#define MAX_RANGES 64
+
+struct rom {
+    char *path;
+    unsigned short *image;
+    size_t size;
+};
+
+static char print_buffer[4096] = { 0 };
+static const char *argv_0 = NULL;
+static const char *infile_name = NULL;
+static unsigned long infile_line = 0;
+
+static struct rom *roms = NULL;
+static size_t num_roms = 0;
+static struct batch_job *jobs = NULL;
+static size_t *job_roms = NULL;
+static size_t num_jobs = 0, max_jobs = 0;
+
+#define _ansi_reset     "\033[0m"
+#define _ansi_warning   "\033[1;35m"
+#define _ansi_error     "\033[1;31m"
+
+static void lprintf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, ap);
+    fprintf(stderr, "%s\n", print_buffer);
+    va_end(ap);
+}
+
+static void error(const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    vsnprintf(print_buffer, sizeof(print_buffer), fmt, va);
+    if(infile_name)
+        fprintf(stderr, "%s:%lu: %serror: %s%s\n", infile_name, infile_line, _ansi_error, _ansi_reset, print_buffer);
+    else
+        fprintf(stderr, "%s: %sfatal: %s%s\n", argv_0, _ansi_error, _ansi_reset, print_buffer);
+    va_end(va);
+    exit(1);
+}
+
+#if defined(VCPU_RUN_AS)
+static int is_source(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    return ext && (!strcmp(ext, ".S") || !strcmp(ext, ".s"));
+}
+
+/* Sources are assembled in memory, no vcpu-as run or ROM file needed */
+static void assemble_rom(struct rom *rom, FILE *infile)
+{
+    struct vcpuas_result result;
+    const struct vcpuas_diagnostic *diagnostic;
+    char *source = NULL;
+    size_t size = 0, n;
+    size_t i;
+
+    do {
+        source = realloc(source, size + 0x10000);
+        assert(("Out of memory!", source));
+        n = fread(source + size, 1, 0x10000, infile);
+        size += n;
+    } while(n);
+    fclose(infile);
+
+    vcpuas_assemble(source, size, &result);
+    free(source);
+
+    infile_name = rom->path;
+    for(i = 0; i < result.num_diagnostics; i++) {
+        diagnostic = result.diagnostics + i;
+        infile_line = diagnostic->line_no;
+        if(diagnostic->severity == VCPUAS_ERROR)
+            error("%s", diagnostic->message);
+    }
+    infile_name = NULL;
+
+    rom->size = result.image_size;
+    memcpy(rom->image, result.image, result.image_size * sizeof(unsigned short));
+    vcpuas_free_result(&result);
+}
+#endif
+
+static size_t load_rom(const char *path)
+{
+    FILE *infile;
+    struct rom *rom;
+    size_t i;
+
+    /* Input vectors tend to share a handful of ROMs */
+    for(i = 0; i < num_roms; i++) {
+        if(!strcmp(roms[i].path, path))
+            return i;
+    }
+
+    infile = fopen(path, "rb");
+    if(!infile)
+        error("%s: %s", path, strerror(errno));
+
+    roms = realloc(roms, (num_roms + 1) * sizeof(struct rom));
+    assert(("Out of memory!", roms));
+    rom = roms + num_roms;
+
+    rom->path = malloc(strlen(path) + 1);
+    rom->image = malloc(sizeof(vcpu_memory_t));
+    assert(("Out of memory!", rom->path && rom->image));
+    strcpy(rom->path, path);
+
+#if defined(VCPU_RUN_AS)
+    if(is_source(path)) {
+        assemble_rom(rom, infile);
+        return num_roms++;
+    }
+#endif
+
+    rom->size = fread(rom->image, sizeof(unsigned short), VCPU_MEM_SIZE, infile);
+    fclose(infile);
+
+    for(i = 0; i < rom->size; i++)
+        rom->image[i] = vcpu_be16_to_host(rom->image[i]);
+
+    return num_roms++;
+}
+
+static struct batch_job *add_job(const char *path)
+{
+    struct batch_job *job;
+    size_t rom = load_rom(path);
+
+    if(num_jobs >= max_jobs) {
+        max_jobs = max_jobs ? max_jobs * 2 : 64;
+        jobs = realloc(jobs, max_jobs * sizeof(struct batch_job));
+        job_roms = realloc(job_roms, max_jobs * sizeof(size_t));
+        assert(("Out of memory!", jobs && job_roms));
+    }
+
+    job = jobs + num_jobs;
+    job_roms[num_jobs++] = rom;
+    job->image = roms[rom].image;
+    job->image_size = roms[rom].size;
+    job->patches = NULL;
+    job->num_patches = 0;
+    return job;
+}
+
+/* <hexaddr>=<hexword>[,<hexword>...] */
+static void parse_patch(struct batch_job *job, char *token)
+{
+    struct batch_patch *patches = (struct batch_patch *)job->patches;
+    unsigned short *words;
+    unsigned long value;
+    size_t size;
+    char *s;
+
+    value = strtoul(token, &s, 16);
+    if(s == token || *s != '=' || value >= VCPU_MEM_SIZE)
+        error("%s: invalid input vector", token);
+
+    for(size = 1, s++; *s; s++) {
+        if(*s == ',')
+            size++;
+    }
+
+    patches = realloc(patches, (job->num_patches + 1) * sizeof(struct batch_patch));
+    words = malloc(size * sizeof(unsigned short));
+    assert(("Out of memory!", patches && words));
+
+    patches[job->num_patches].addr = (unsigned short)value;
+    patches[job->num_patches].size = size;
+    patches[job->num_patches].words = words;
+    job->patches = patches;
+    job->num_patches++;
+
+    s = strchr(token, '=') + 1;
+    for(;;) {
+        char *end;
+        value = strtoul(s, &end, 16);
+        if(end == s || value > 0xFFFF)
+            error("%s: invalid input vector", token);
+        *words++ = (unsigned short)value;
+        if(*end != ',')
+            break;
+        s = end + 1;
+    }
+}
+
+/* Every line is <rom> followed by input vectors */
+static void load_jobs(const char *path)
+{
+    FILE *infile;
+    char *line = NULL, *token;
+    size_t line_size = 0;
+    struct batch_job *job;
+
+    infile = fopen(path, "r");
+    if(!infile)
+        error("%s: %s", path, strerror(errno));
+
+    infile_name = path;
+    infile_line = 0;
+
+    while(getline(&line, &line_size, infile) != -1) {
+        infile_line++;
+        if((token = strchr(line, '#')) != NULL)
+            *token = 0;
+        if(!(token = strtok(line, " \t\r\n")))
+            continue;
+        job = add_job(token);
+        while((token = strtok(NULL, " \t\r\n")) != NULL)
+            parse_patch(job, token);
+    }
+
+    infile_name = NULL;
+    free(line);
+    fclose(infile);
+}
+
+static const char *get_reason(int reason)
+{
+    switch(reason) {
+        case VCPU_RUN_BUDGET:
+            return "budget";
+        case VCPU_RUN_HALT:
+            return "halt";
+        case VCPU_RUN_FATAL:
+            return "fatal";
+        default:
+            return "yield";
+    }
+}
+
+/* One JSON object per line, in job order */
+static void print_result(FILE *fp, size_t id, const struct batch_config *config, const struct batch_result *result)
+{
+    const unsigned short *dump = result->dump;
+    size_t i, j;
+
+    fprintf(fp, "{\"job\":%lu,\"rom\":\"", (unsigned long)id);
+    for(i = 0; roms[job_roms[id]].path[i]; i++) {
+        char c = roms[job_roms[id]].path[i];
+        if(c == '"' || c == '\\')
+            fputc('\\', fp);
+        fputc(c, fp);
+    }
+    fprintf(fp, "\",\"reason\":\"%s\",\"instret\":%lu,\"regs\":[", get_reason(result->reason), result->instret);
+    for(i = 0; i < 16; i++)
+        fprintf(fp, i ? ",%u" : "%u", result->regs[i]);
+    fprintf(fp, "],\"mem\":{");
+    for(i = 0; i < config->num_ranges; i++) {
+        fprintf(fp, i ? ",\"%04X\":[" : "\"%04X\":[", config->ranges[i].begin);
+        for(j = 0; j < config->ranges[i].size; j++)
+            fprintf(fp, j ? ",%u" : "%u", *dump++);
+        fprintf(fp, "]");
+    }
+    fprintf(fp, "}}\n");
+}
+
+int main(int argc, char **argv)
+{
+    int r;
+    struct batch_config config;
+    struct batch_range ranges[MAX_RANGES];
+    struct batch_result *results;
+    unsigned short *dumps;
+    unsigned long begin, end;
+    size_t dump_size, i;
+    const char *profile_name = NULL;
+    struct vcpu_perf perf;
+    int count_events = 0;
+    FILE *profile_file;
+    char *s;
+
+    argv_0 = argv[0];
+
+    memset(&config, 0, sizeof(config));
+    config.budget = 100000000;
+    config.ranges = ranges;
+
+    while((r = getopt(argc, argv, "j:n:d:f:S:P:cJLvh")) != EOF) {
+        switch(r) {
+            case 'j':
+                config.num_workers = (unsigned int)strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                config.budget = strtoul(optarg, NULL, 10);
+                break;
+            case 'd':
+                if(config.num_ranges >= MAX_RANGES)
+                    error("too many memory ranges");
+                begin = strtoul(optarg, &s, 16);
+                end = (*s == ':') ? strtoul(s + 1, NULL, 16) : begin + 1;
+                if(begin >= VCPU_MEM_SIZE || end <= begin || end > VCPU_MEM_SIZE)
+                    error("%s: invalid memory range", optarg);
+                ranges[config.num_ranges].begin = (unsigned short)begin;
+                ranges[config.num_ranges].size = end - begin;
+                config.num_ranges++;
+                break;
+            case 'f':
+                load_jobs(optarg);
+                break;
+            case 'S':
+                config.num_cores = (unsigned int)strtoul(optarg, NULL, 10);
+                if(config.num_cores < 1 || config.num_cores > 0xFFFF)
+                    error("%s: invalid number of cores", optarg);
+                break;
+            case 'P':
+                profile_name = optarg;
+                break;
+            case 'c':
+                count_events++;
+                break;
+            case 'J':
+                config.jit = 1;
+                break;
+            case 'L':
+                config.lockstep = 1;
+                break;
+            case 'v':
+                lprintf("%s (VCPU RUN) version 0.0.x", argv_0);
+                return 0;
+            default:
+                lprintf("Usage: %s [-j <count>] [-n <count>] [-d <hexaddr>[:<hexaddr>]] [-f <jobfile>] [-S <count>] [-P <outfile>] [-c[c]] [-J] [-L] [-h] <infile>...", argv[0]);
+                lprintf("Options:");
+                lprintf("   -j <count>      : Number of worker threads (default: one per CPU).");
+                lprintf("   -n <count>      : Instruction budget per job (default: 100000000).");
+                lprintf("   -d <begin:end>  : Dump memory [begin, end) of every job, repeatable.");
+                lprintf("   -f <jobfile>    : Read jobs from a file, one per line:");
+                lprintf("                     <infile> [<hexaddr>=<hexword>[,<hexword>...]]...");
+                lprintf("   -S <count>      : Run every job as an SMP machine, a thread per core.");
+                lprintf("   -P <outfile>    : Profile all jobs, write folded call stacks on exit.");
+                lprintf("   -c              : Count host CPU events per guest instruction, print them to stderr;");
+                lprintf("                     twice breaks them down by opcode class.");
+                lprintf("   -J              : Use the JIT when the core has one.");
+                lprintf("   -L              : Run jobs of the same ROM in SIMD lockstep.");
+                lprintf("   -v              : Print version and exit");
+                lprintf("   -h              : Write this message and exit.");
+                lprintf("   <infile>        : Input binary (ROM), one job each.");
+#if defined(VCPU_RUN_AS)
+                lprintf("                     Sources (.S) are assembled on the fly.");
+#endif
+                return (r == 'h');
+        }
+    }
+
+    for(; optind < argc; optind++)
+        add_job(argv[optind]);
+
+    if(!num_jobs)
+        error("no input files");
+    if(config.lockstep && config.num_cores > 1)
+        error("lockstep and SMP are mutually exclusive");
+    if(profile_name && config.num_cores > 1)
+        error("SMP jobs cannot be profiled");
+    if(count_events && config.num_cores > 1)
+        error("SMP jobs cannot be counted");
+
+    if(profile_name) {
+        config.profile = malloc(sizeof(struct vcpu_profile));
+        assert(("Out of memory!", config.profile));
+        init_vcpu_profile(config.profile);
+    }
+
+    /* Only tells whether the host counts anything; the
+     * workers open counters of their own */
+    if(count_events) {
+        if(!init_vcpu_perf(&perf, count_events > 1))
+            error("host performance counters are not available");
+        shutdown_vcpu_perf(&perf);
+        config.perf = &perf;
+    }
+
+    dump_size = batch_dump_size(&config);
+    results = malloc(num_jobs * sizeof(struct batch_result));
+    dumps = malloc((num_jobs * dump_size + 1) * sizeof(unsigned short));
+    assert(("Out of memory!", results && dumps));
+
+    for(i = 0; i < num_jobs; i++)
+        results[i].dump = dumps + i * dump_size;
+
+    batch_run(&config, jobs, results, num_jobs);
+
+    for(i = 0; i < num_jobs; i++)
+        print_result(stdout, i, &config, results + i);
+
+    if(count_events)
+        vcpu_perf_write(&perf, stderr);
+
+    if(profile_name) {
+        profile_file = fopen(profile_name, "w");
+        if(!profile_file)
+            error("%s: %s", profile_name, strerror(errno));
+        vcpu_profile_write(config.profile, profile_file);
+        fclose(profile_file);
+    }
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "pool.h"
+
+/* Every worker owns a deque of task indexes. The owner pops from
+ * the bottom, thieves take from the top. Tasks never spawn tasks,
+ * so once every deque is empty the work is done. */
+struct pool_deque {
+    pthread_mutex_t lock;
+    size_t *tasks;
+    size_t top, bottom;
+};
+
+struct pool {
+    struct pool_deque *deques;
+    unsigned int num_workers;
+    pool_task_t task;
+    void *ctx;
+};
+
+struct pool_worker {
+    struct pool *pool;
+    unsigned int id;
+};
+
+static int pool_pop(struct pool_deque *deque, size_t *task)
+{
+    int r = 0;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom > deque->top) {
+        *task = deque->tasks[--deque->bottom];
+        r = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return r;
+}
+
+static int pool_steal(struct pool_deque *deque, size_t *task)
+{
+    int r = 0;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom > deque->top) {
+        *task = deque->tasks[deque->top++];
+        r = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return r;
+}
+
+static void *pool_worker_main(void *arg)
+{
+    struct pool_worker *worker = arg;
+    struct pool *pool = worker->pool;
+    unsigned int i;
+    size_t task;
+
+    for(;;) {
+        if(!pool_pop(pool->deques + worker->id, &task)) {
+            for(i = 1; i < pool->num_workers; i++) {
+                if(pool_steal(pool->deques + (worker->id + i) % pool->num_workers, &task))
+                    break;
+            }
+            if(i >= pool->num_workers)
+                return NULL;
+        }
+        pool->task(pool->ctx, task, worker->id);
+    }
+}
+
+unsigned int pool_default_workers(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return (n > 0) ? (unsigned int)n : 1;
+}
+
+void pool_run(unsigned int num_workers, size_t num_tasks, pool_task_t task, void *ctx)
+{
+    struct pool pool;
+    struct pool_worker *workers;
+    pthread_t *threads;
+    unsigned int i;
+    size_t j;
+
+    if(num_workers < 1)
+        num_workers = 1;
+    if(num_workers > num_tasks)
+        num_workers = num_tasks ? (unsigned int)num_tasks : 1;
+
+    pool.num_workers = num_workers;
+    pool.task = task;
+    pool.ctx = ctx;
+    pool.deques = calloc(num_workers, sizeof(struct pool_deque));
+    assert(("Out of memory!", pool.deques));
+
+    for(i = 0; i < num_workers; i++) {
+        pool.deques[i].tasks = malloc((num_tasks / num_workers + 1) * sizeof(size_t));
+        assert(("Out of memory!", pool.deques[i].tasks));
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    }
+
+    /* Lowest indexes end up at the top of each deque,
+     * the owner starts from the highest ones */
+    for(j = 0; j < num_tasks; j++) {
+        struct pool_deque *deque = pool.deques + j % num_workers;
+        deque->tasks[deque->bottom++] = j;
+    }
+
+    workers = malloc(num_workers * sizeof(struct pool_worker));
+    threads = malloc(num_workers * sizeof(pthread_t));
+    assert(("Out of memory!", workers && threads));
+
+    /* The calling thread doubles as worker zero */
+    for(i = 0; i < num_workers; i++) {
+        workers[i].pool = &pool;
+        workers[i].id = i;
+        if(i > 0 && pthread_create(threads + i, NULL, pool_worker_main, workers + i) != 0) {
+            /* Whatever could not start is stolen by the rest */
+            workers[i].pool = NULL;
+        }
+    }
+
+    pool_worker_main(workers);
+
+    for(i = 1; i < num_workers; i++) {
+        if(workers[i].pool)
+            pthread_join(threads[i], NULL);
+    }
+
+    for(i = 0; i < num_workers; i++) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+
+    free(threads);
+    free(workers);
+    free(pool.deques);
+}
@@ -0,0 +1,17 @@
+#ifndef _POOL_H_
+#define _POOL_H_ 1
+#include <stddef.h>
+
+/* Runs one task; worker is in [0, num_workers) and is never shared
+ * by two tasks at the same time, so it can index per-worker state. */
+typedef void(*pool_task_t)(void *ctx, size_t task, unsigned int worker);
+
+/* Number of CPUs available to the process, at least one */
+unsigned int pool_default_workers(void);
+
+/* Runs tasks [0, num_tasks) on num_workers threads and returns
+ * when all of them are done. Tasks are dealt out round-robin;
+ * a worker that runs dry steals from the others. */
+void pool_run(unsigned int num_workers, size_t num_tasks, pool_task_t task, void *ctx);
+
+#endif
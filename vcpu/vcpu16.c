@@ -2,54 +2,230 @@
 #include <stdlib.h>
 #include <string.h>
 #include "vcpu16.h"
+#include "vcpu16_internal.h"
 
-#define RUNTIME_FLAG_HALT           (1 << 0)
-#define RUNTIME_FLAG_SHARED_MEMORY  (1 << 1)
+/* The threaded interpreter expands the operand fetch into every
+ * handler, which is past the point where compilers inline on their own */
+#if defined(__GNUC__)
+#define VCPU_INLINE __inline__ __attribute__((always_inline))
+#else
+#define VCPU_INLINE
+#endif
 
 struct instruction_internal {
-    struct vcpu_instruction instruction;
     struct {
         unsigned short value;
         unsigned short *ref;
     } a, b;
 };
 
-static void vcpu_parse(struct vcpu *cpu, struct instruction_internal *instruction)
+/* Common idioms are fused into one record at decode time and
+ * dispatched past the 64 guest opcodes:
+ *  UOP_IEQ_JUMP..UOP_ILE_JUMP - a skip followed by mov $imm, %pc
+ *  UOP_MRD_AND                - mrd X, %r followed by and $imm, %r */
+#define UOP_IEQ_JUMP    0x40
+#define UOP_INE_JUMP    0x41
+#define UOP_IGT_JUMP    0x42
+#define UOP_IGE_JUMP    0x43
+#define UOP_ILT_JUMP    0x44
+#define UOP_ILE_JUMP    0x45
+#define UOP_MRD_AND     0x46
+#define UOP_COUNT       0x47
+
+/* The longest fused pair (a skip with two immediates and a jump)
+ * spans five words, so a write can hit records up to four words
+ * behind it. */
+#define DECODED_MAX_SPAN 5
+
+static void vcpu_decode_word(const struct vcpu *cpu, unsigned short pc, struct vcpu_decoded *decoded)
 {
-    unsigned short word = (*cpu->memory)[cpu->regs[VCPU_REGISTER_PC]++];
+    unsigned short word = (*cpu->memory)[pc];
 
-    instruction->instruction.opcode = (word >> 10) & 0x3F;
-    instruction->instruction.a.imm = (word >> 9) & 0x01;
-    instruction->instruction.a.reg = (word >> 5) & 0x0F;
-    instruction->instruction.b.imm = (word >> 4) & 0x01;
-    instruction->instruction.b.reg = word & 0x0F;
+    decoded->instruction.opcode = (word >> 10) & 0x3F;
+    decoded->instruction.a.imm = (word >> 9) & 0x01;
+    decoded->instruction.a.reg = (word >> 5) & 0x0F;
+    decoded->instruction.b.imm = (word >> 4) & 0x01;
+    decoded->instruction.b.reg = word & 0x0F;
+    decoded->length = 1;
+    decoded->imms[0] = decoded->imms[1] = 0;
 
-    /* Parse A */
-    if(instruction->instruction.a.imm) {
-        instruction->a.ref = NULL;
-        instruction->a.value = (*cpu->memory)[cpu->regs[VCPU_REGISTER_PC]++];
-    }
-    else {
-        instruction->a.ref = cpu->regs + instruction->instruction.a.reg;
-        instruction->a.value = *instruction->a.ref;
-    }
+    if(decoded->instruction.a.imm)
+        decoded->imms[0] = (*cpu->memory)[(pc + decoded->length++) & 0xFFFF];
+    if(decoded->instruction.b.imm)
+        decoded->imms[1] = (*cpu->memory)[(pc + decoded->length++) & 0xFFFF];
+
+    decoded->uop = decoded->instruction.opcode;
+    decoded->fused_length = 0;
+}
+
+static void vcpu_fuse(const struct vcpu *cpu, unsigned short pc, struct vcpu_decoded *decoded)
+{
+    struct vcpu_decoded next;
+    const struct vcpu_instruction *first = &decoded->instruction;
 
-    /* Parse B */
-    if(instruction->instruction.b.imm) {
-        instruction->b.ref = NULL;
-        instruction->b.value = (*cpu->memory)[cpu->regs[VCPU_REGISTER_PC]++];
+    vcpu_decode_word(cpu, pc + decoded->length, &next);
+
+    if(first->opcode >= VCPU_OPCODE_IEQ && first->opcode <= VCPU_OPCODE_ILE) {
+        if(next.instruction.opcode == VCPU_OPCODE_MOV && next.instruction.a.imm && !next.instruction.b.imm && next.instruction.b.reg == VCPU_REGISTER_PC) {
+            decoded->uop = UOP_IEQ_JUMP + (first->opcode - VCPU_OPCODE_IEQ);
+            decoded->fused_length = next.length;
+            decoded->fused_imm = next.imms[0];
+        }
+        return;
     }
-    else {
-        instruction->b.ref = cpu->regs + instruction->instruction.b.reg;
-        instruction->b.value = *instruction->b.ref;
+
+    /* %PC and %OF as the destination would interleave with the
+     * pair's own updates of them, leave those unfused */
+    if(first->opcode == VCPU_OPCODE_MRD && !first->b.imm && first->b.reg != VCPU_REGISTER_PC && first->b.reg != VCPU_REGISTER_OF) {
+        if(next.instruction.opcode == VCPU_OPCODE_AND && next.instruction.a.imm && !next.instruction.b.imm && next.instruction.b.reg == first->b.reg) {
+            decoded->uop = UOP_MRD_AND;
+            decoded->fused_length = next.length;
+            decoded->fused_imm = next.imms[0];
+        }
     }
 }
 
-static void vcpu_set_value(struct vcpu *cpu, unsigned int value, unsigned short *destination)
+/* With SMP every core takes the invalidating path on writes
+ * to a page any of them has decoded, so the flag goes to all */
+static void vcpu_mark_code(struct vcpu *cpu, unsigned int page)
+{
+    if(cpu->pages[page] & VCPU_PAGE_CODE)
+        return;
+    if(cpu->smp)
+        vcpu_smp_code(cpu->smp, page);
+    else
+        cpu->pages[page] |= VCPU_PAGE_CODE;
+}
+
+const struct vcpu_decoded *vcpu_decode(struct vcpu *cpu, unsigned short pc)
+{
+    struct vcpu_decoded *decoded = cpu->decoded + pc;
+    unsigned short last;
+
+    if(decoded->length)
+        return decoded;
+
+    vcpu_decode_word(cpu, pc, decoded);
+    vcpu_fuse(cpu, pc, decoded);
+
+    last = pc + decoded->length + decoded->fused_length - 1;
+    vcpu_mark_code(cpu, pc / VCPU_PAGE_SIZE);
+    vcpu_mark_code(cpu, last / VCPU_PAGE_SIZE);
+    return decoded;
+}
+
+/* Immediates are staged in two scratch slots past the register file
+ * so that either kind of operand is read and written through a ref:
+ * a result stored to an immediate simply lands in the scratch slot. */
+#define OPERAND_IMM_A   16
+#define OPERAND_IMM_B   17
+#define OPERAND_SLOTS   18
+
+static VCPU_INLINE void vcpu_parse(unsigned short *regs, const struct vcpu_decoded *decoded, struct instruction_internal *instruction)
+{
+    unsigned short pc = regs[VCPU_REGISTER_PC];
+
+    regs[OPERAND_IMM_A] = decoded->imms[0];
+    regs[OPERAND_IMM_B] = decoded->imms[1];
+    instruction->a.ref = regs + (decoded->instruction.a.imm ? OPERAND_IMM_A : decoded->instruction.a.reg);
+    instruction->b.ref = regs + (decoded->instruction.b.imm ? OPERAND_IMM_B : decoded->instruction.b.reg);
+
+    /* Register operands observe %PC as it was advanced so far */
+    regs[VCPU_REGISTER_PC] = pc + 1;
+    instruction->a.value = *instruction->a.ref;
+    regs[VCPU_REGISTER_PC] = pc + decoded->length;
+    instruction->b.value = *instruction->b.ref;
+}
+
+static void vcpu_skip(struct vcpu *cpu, unsigned short *regs)
+{
+    regs[VCPU_REGISTER_PC] += vcpu_decode(cpu, regs[VCPU_REGISTER_PC])->length;
+}
+
+/* Plain RAM costs one page flag test on either path; hooked
+ * and code pages take the call out of line */
+static unsigned short vcpu_read(struct vcpu *cpu, unsigned short addr)
+{
+    unsigned short value = vcpu_atomic_load(*cpu->memory + addr);
+    if(cpu->pages[addr / VCPU_PAGE_SIZE] & VCPU_PAGE_READ)
+        cpu->hooks[addr / VCPU_PAGE_SIZE].on_read(cpu->hooks[addr / VCPU_PAGE_SIZE].context, cpu, addr, &value);
+    return value;
+}
+
+static void vcpu_write(struct vcpu *cpu, unsigned short addr, unsigned short value)
+{
+    vcpu_atomic_store(*cpu->memory + addr, value);
+    vcpu_mark_dirty(cpu, addr);
+    if(cpu->pages[addr / VCPU_PAGE_SIZE] & (VCPU_PAGE_CODE | VCPU_PAGE_WRITE))
+        vcpu_written(cpu, addr, value);
+}
+
+static unsigned short vcpu_exchange(struct vcpu *cpu, unsigned short addr, unsigned short value)
 {
-    if(destination)
-        *destination = value & 0xFFFF;
-    cpu->regs[VCPU_REGISTER_OF] = (value >> 16) & 0xFFFF;
+    unsigned short old = vcpu_atomic_exchange(*cpu->memory + addr, value);
+    vcpu_mark_dirty(cpu, addr);
+    if(cpu->pages[addr / VCPU_PAGE_SIZE] & VCPU_PAGE_READ)
+        cpu->hooks[addr / VCPU_PAGE_SIZE].on_read(cpu->hooks[addr / VCPU_PAGE_SIZE].context, cpu, addr, &old);
+    if(cpu->pages[addr / VCPU_PAGE_SIZE] & (VCPU_PAGE_CODE | VCPU_PAGE_WRITE))
+        vcpu_written(cpu, addr, value);
+    return old;
+}
+
+void vcpu_written(struct vcpu *cpu, unsigned short addr, unsigned short value)
+{
+    unsigned char flags = cpu->pages[addr / VCPU_PAGE_SIZE];
+
+    if(flags & VCPU_PAGE_CODE)
+        vcpu_invalidate(cpu, addr, 1);
+    if(flags & VCPU_PAGE_WRITE)
+        cpu->hooks[addr / VCPU_PAGE_SIZE].on_write(cpu->hooks[addr / VCPU_PAGE_SIZE].context, cpu, addr, value);
+}
+
+static void vcpu_set_value(unsigned short *regs, unsigned int value, unsigned short *destination)
+{
+    *destination = value & 0xFFFF;
+    regs[VCPU_REGISTER_OF] = (value >> 16) & 0xFFFF;
+}
+
+static int vcpu_interrupt_ready(const struct vcpu_interrupt_queue *interrupts)
+{
+    const struct vcpu_interrupt_slot *slot = interrupts->queue + (interrupts->head & (VCPU_MAX_INTERRUPTS - 1));
+    return vcpu_atomic_load(&slot->sequence) == interrupts->head + 1;
+}
+
+static void vcpu_clear_interrupts(struct vcpu_interrupt_queue *interrupts)
+{
+    unsigned int i;
+
+    interrupts->busy = 0;
+    interrupts->enabled = 0;
+    interrupts->overflowed = 0;
+    interrupts->head = 0;
+    interrupts->tail = 0;
+    interrupts->dropped = 0;
+    interrupts->masked = 0;
+    for(i = 0; i < VCPU_MAX_INTERRUPTS; i++)
+        interrupts->queue[i].sequence = i;
+}
+
+/* Only the thread running the vcpu takes messages out, so the head
+ * is private to it; handing the slot back to the producers is the
+ * one store they have to see. */
+static void vcpu_enter_interrupt(struct vcpu *cpu, unsigned short *regs)
+{
+    struct vcpu_interrupt_queue *interrupts = &cpu->interrupts;
+    struct vcpu_interrupt_slot *slot;
+
+    if(interrupts->enabled && !interrupts->busy && vcpu_interrupt_ready(interrupts)) {
+        slot = interrupts->queue + (interrupts->head & (VCPU_MAX_INTERRUPTS - 1));
+        interrupts->busy = 1;
+        vcpu_write(cpu, regs[VCPU_REGISTER_SP]--, regs[VCPU_REGISTER_PC]);
+        vcpu_write(cpu, regs[VCPU_REGISTER_SP]--, regs[VCPU_REGISTER_R0]);
+        regs[VCPU_REGISTER_PC] = regs[VCPU_REGISTER_IA];
+        regs[VCPU_REGISTER_R0] = slot->message;
+        vcpu_atomic_store(&slot->sequence, interrupts->head + VCPU_MAX_INTERRUPTS);
+        interrupts->head++;
+    }
 }
 
 void init_vcpu(struct vcpu *cpu, vcpu_memory_t *shared_memory)
@@ -66,176 +242,524 @@ void init_vcpu(struct vcpu *cpu, vcpu_memory_t *shared_memory)
         memset(*cpu->memory, 0, sizeof(vcpu_memory_t));
     }
 
+    cpu->decoded = calloc(VCPU_MEM_SIZE, sizeof(struct vcpu_decoded));
+    assert(("Out of memory!", cpu->decoded));
+
+    vcpu_clear_interrupts(&cpu->interrupts);
+    cpu->interrupts.overflow = VCPU_INTERRUPT_DROP;
+
     cpu->regs[VCPU_REGISTER_IA] = 0x0000;
     cpu->regs[VCPU_REGISTER_OF] = 0x0000;
     cpu->regs[VCPU_REGISTER_SP] = 0xFFFF;
     cpu->regs[VCPU_REGISTER_PC] = 0x0000;
 
     cpu->on_ioread = NULL;
-    cpu->on_iowrite;
+    cpu->on_iowrite = NULL;
 
     cpu->cpi.vendor_id = VCPU_CPI_DEF_VENDOR_ID;
     cpu->cpi.speed = VCPU_CPI_DEF_SPEED;
+    cpu->cpi.core_id = 0;
+    cpu->cpi.num_cores = 1;
 }
 
 void shutdown_vcpu(struct vcpu *cpu)
 {
     if(!(cpu->runtime_flags & RUNTIME_FLAG_SHARED_MEMORY))
         free(cpu->memory);
+    free(cpu->decoded);
+    free(cpu->hooks);
+#if defined(VCPU_JIT)
+    if(cpu->jit)
+        vcpu_jit_destroy(cpu->jit);
+#endif
     memset(cpu, 0, sizeof(struct vcpu));
 }
 
+void reset_vcpu(struct vcpu *cpu)
+{
+    size_t i;
+
+    for(i = 0; i < VCPU_PAGE_COUNT; i++) {
+        if(cpu->pages[i] & VCPU_PAGE_CODE)
+            vcpu_drop_decoded(cpu, (unsigned short)(i * VCPU_PAGE_SIZE), VCPU_PAGE_SIZE);
+        cpu->pages[i] &= VCPU_PAGE_READ | VCPU_PAGE_WRITE;
+    }
+
+    /* Memory reloaded from here on is not tracked */
+    cpu->snapshot = NULL;
+
+    cpu->runtime_flags &= RUNTIME_FLAG_SHARED_MEMORY | RUNTIME_FLAG_READ_HOOKS;
+    memset(cpu->regs, 0, sizeof(cpu->regs));
+    vcpu_clear_interrupts(&cpu->interrupts);
+    cpu->regs[VCPU_REGISTER_SP] = 0xFFFF;
+    cpu->instret = 0;
+}
+
+void vcpu_invalidate(struct vcpu *cpu, unsigned short addr, size_t count)
+{
+    size_t i, pages = (addr % VCPU_PAGE_SIZE + count + VCPU_PAGE_SIZE - 1) / VCPU_PAGE_SIZE;
+
+    for(i = 0; i < pages && i < VCPU_PAGE_COUNT; i++)
+        vcpu_mark_dirty(cpu, (unsigned short)(addr + i * VCPU_PAGE_SIZE));
+
+    vcpu_drop_decoded(cpu, addr, count);
+    if(cpu->smp)
+        vcpu_smp_stale(cpu, addr, count);
+}
+
+void vcpu_drop_decoded(struct vcpu *cpu, unsigned short addr, size_t count)
+{
+    size_t i;
+
+#if defined(VCPU_JIT)
+    if(cpu->jit)
+        vcpu_jit_invalidate(cpu->jit, addr, count);
+#endif
+
+    addr -= DECODED_MAX_SPAN - 1;
+    count += DECODED_MAX_SPAN - 1;
+    for(i = 0; i < count && i < VCPU_MEM_SIZE; i++)
+        cpu->decoded[(addr + i) & 0xFFFF].length = 0;
+}
+
+/* Producers claim a position by advancing the tail and publish the
+ * message through the slot's sequence, so a consumer never sees a
+ * claimed slot before its message is in. */
 void vcpu_interrupt(struct vcpu *cpu, unsigned short message)
 {
-    if(cpu->interrupts.enabled) {
-        if(cpu->interrupts.queue_size >= VCPU_MAX_INTERRUPTS) {
-            cpu->runtime_flags |= RUNTIME_FLAG_HALT;
-            cpu->interrupts.enabled = 0;
+    struct vcpu_interrupt_queue *interrupts = &cpu->interrupts;
+    struct vcpu_interrupt_slot *slot;
+    unsigned int pos, sequence;
+    int diff;
+
+    if(!vcpu_atomic_load(&interrupts->enabled)) {
+        vcpu_atomic_add(&interrupts->masked, 1);
+        return;
+    }
+
+    pos = vcpu_atomic_load(&interrupts->tail);
+    for(;;) {
+        slot = interrupts->queue + (pos & (VCPU_MAX_INTERRUPTS - 1));
+        sequence = vcpu_atomic_load(&slot->sequence);
+        diff = (int)(sequence - pos);
+        if(diff == 0) {
+            if(vcpu_atomic_cas(&interrupts->tail, &pos, pos + 1))
+                break;
+        }
+        else if(diff < 0) {
+            vcpu_atomic_add(&interrupts->dropped, 1);
+            if(interrupts->overflow == VCPU_INTERRUPT_HALT)
+                vcpu_atomic_store(&interrupts->overflowed, 1);
             return;
         }
-
-        cpu->runtime_flags &= ~RUNTIME_FLAG_HALT;
-        cpu->interrupts.queue[cpu->interrupts.queue_size++] = message;
+        else {
+            pos = vcpu_atomic_load(&interrupts->tail);
+        }
     }
+
+    slot->message = message;
+    vcpu_atomic_store(&slot->sequence, pos + 1);
+}
+
+int vcpu_interrupt_pending(const struct vcpu *cpu)
+{
+    return vcpu_interrupt_ready(&cpu->interrupts);
+}
+
+int vcpu_interrupt_poll(const struct vcpu *cpu)
+{
+    const struct vcpu_interrupt_queue *interrupts = &cpu->interrupts;
+    if(vcpu_atomic_load(&interrupts->overflowed))
+        return 1;
+    return interrupts->enabled && !interrupts->busy && vcpu_interrupt_ready(interrupts);
+}
+
+void vcpu_yield(struct vcpu *cpu)
+{
+    cpu->runtime_flags |= RUNTIME_FLAG_YIELD;
 }
 
 int vcpu_step(struct vcpu *cpu)
 {
-    int result = 1;
-    unsigned short scratch;
+    return vcpu_run(cpu, 1) != VCPU_RUN_FATAL;
+}
+
+int vcpu_run(struct vcpu *cpu, unsigned long budget)
+{
+#if defined(VCPU_PERF)
+    if(cpu->perf)
+        return vcpu_perf_run(cpu, budget);
+#endif
+    return vcpu_execute(cpu, budget);
+}
+
+int vcpu_execute(struct vcpu *cpu, unsigned long budget)
+{
+    if(cpu->profile)
+        return vcpu_profile_run(cpu, budget);
+#if defined(VCPU_JIT)
+    /* Translated loads do not look at the page flags */
+    if(cpu->jit && !(cpu->runtime_flags & RUNTIME_FLAG_READ_HOOKS))
+        return vcpu_jit_run(cpu, budget);
+#endif
+    return vcpu_interpret(cpu, budget);
+}
+
+void vcpu_map(struct vcpu *cpu, unsigned short addr, size_t count, vcpu_page_read_t on_read, vcpu_page_write_t on_write, void *context)
+{
+    size_t i, page, pages = (addr % VCPU_PAGE_SIZE + count + VCPU_PAGE_SIZE - 1) / VCPU_PAGE_SIZE;
+    unsigned char flags = (on_read ? VCPU_PAGE_READ : 0) | (on_write ? VCPU_PAGE_WRITE : 0);
+
+    if(!cpu->hooks) {
+        cpu->hooks = calloc(VCPU_PAGE_COUNT, sizeof(struct vcpu_page_hook));
+        assert(("Out of memory!", cpu->hooks));
+    }
+
+    for(i = 0; i < pages && i < VCPU_PAGE_COUNT; i++) {
+        page = (addr / VCPU_PAGE_SIZE + i) % VCPU_PAGE_COUNT;
+        cpu->hooks[page].on_read = on_read;
+        cpu->hooks[page].on_write = on_write;
+        cpu->hooks[page].context = context;
+        cpu->pages[page] = (cpu->pages[page] & ~(VCPU_PAGE_READ | VCPU_PAGE_WRITE)) | flags;
+    }
+
+    cpu->runtime_flags &= ~RUNTIME_FLAG_READ_HOOKS;
+    for(i = 0; i < VCPU_PAGE_COUNT; i++) {
+        if(cpu->pages[i] & VCPU_PAGE_READ)
+            cpu->runtime_flags |= RUNTIME_FLAG_READ_HOOKS;
+    }
+}
+
+int vcpu_coverage_enable(struct vcpu *cpu, unsigned char *bitmap, size_t size)
+{
+#if defined(VCPU_COVERAGE)
+    cpu->coverage = bitmap;
+    cpu->coverage_mask = (unsigned short)(size - 1);
+    cpu->coverage_prev = 0;
+    return 1;
+#else
+    (void)cpu;
+    (void)bitmap;
+    (void)size;
+    return 0;
+#endif
+}
+
+int vcpu_jit_enable(struct vcpu *cpu)
+{
+#if defined(VCPU_JIT)
+    if(!cpu->jit)
+        cpu->jit = vcpu_jit_create();
+    return cpu->jit != NULL;
+#else
+    return 0;
+#endif
+}
+
+/* The interpreter comes in two flavours sharing the handlers below:
+ * a portable switch and, with VCPU_COMPUTED_GOTO, a labels-as-values
+ * table where every handler ends in its own indirect jump. */
+/* The jump of a fused pair only runs when the budget has room for
+ * it; otherwise the pair stops after the skip exactly as unfused. */
+#define SKIP_JUMP(condition) do {                                       \
+    if(!(condition)) {                                                  \
+        regs[VCPU_REGISTER_PC] += decoded->fused_length;                \
+        NEXT;                                                           \
+    }                                                                   \
+    if(executed < budget) {                                             \
+        executed++;                                                     \
+        regs[VCPU_REGISTER_PC] = decoded->fused_imm;                    \
+        regs[VCPU_REGISTER_OF] = 0;                                     \
+    }                                                                   \
+    NEXT;                                                               \
+} while(0)
+
+/* AFL-style edge coverage: every pair of consecutively fetched
+ * PCs bumps one counter, shifting keeps A->B apart from B->A */
+#if defined(VCPU_COVERAGE)
+#define COVER() do {                                                    \
+    if(coverage) {                                                      \
+        coverage[(regs[VCPU_REGISTER_PC] ^ coverage_prev) & coverage_mask]++; \
+        coverage_prev = regs[VCPU_REGISTER_PC] >> 1;                    \
+    }                                                                   \
+} while(0)
+#else
+#define COVER()
+#endif
+
+#define FETCH() do {                                                    \
+    COVER();                                                            \
+    decoded = cpu->decoded + regs[VCPU_REGISTER_PC];                    \
+    if(!decoded->length)                                                \
+        decoded = vcpu_decode(cpu, regs[VCPU_REGISTER_PC]);             \
+    executed++;                                                         \
+} while(0)
+
+#if defined(VCPU_COMPUTED_GOTO)
+#define DISPATCH() goto *dispatch_table[decoded->uop];
+#define CASE(x) op_##x: vcpu_parse(regs, decoded, &instruction);
+#define CASE_UOP(x) uop_##x: vcpu_parse(regs, decoded, &instruction);
+#define CASE_DEFAULT op_default: vcpu_parse(regs, decoded, &instruction);
+#define NEXT do { if(executed >= budget || poll) goto loop; FETCH(); DISPATCH(); } while(0)
+#else
+#define DISPATCH() vcpu_parse(regs, decoded, &instruction); switch(decoded->uop)
+#define CASE(x) case VCPU_OPCODE_##x:
+#define CASE_UOP(x) case UOP_##x:
+#define CASE_DEFAULT default:
+#define NEXT goto loop
+#endif
+
+/* Registers live in a local copy for the duration of the call and
+ * are only written back around I/O handlers and on exit. Interrupts
+ * can only become deliverable on entry and after INT, STI, RFI and
+ * I/O instructions, so the queue is polled there and nowhere else. */
+int vcpu_interpret(struct vcpu *cpu, unsigned long budget)
+{
+    unsigned short regs[OPERAND_SLOTS];
+    unsigned long executed = 0;
+    int poll = 1;
+    int reason = VCPU_RUN_BUDGET;
+    const struct vcpu_decoded *decoded;
     struct instruction_internal instruction;
+#if defined(VCPU_COVERAGE)
+    unsigned char *coverage = cpu->coverage;
+    unsigned short coverage_mask = cpu->coverage_mask;
+    unsigned short coverage_prev = cpu->coverage_prev;
+#endif
+
+#if defined(VCPU_COMPUTED_GOTO)
+    static const void *dispatch_table[UOP_COUNT] = {
+        &&op_NOP,     &&op_HLT,     &&op_PTS,     &&op_PFS,     &&op_CAL,     &&op_RET,     &&op_IOR,     &&op_IOW,
+        &&op_MRD,     &&op_MWR,     &&op_CLI,     &&op_STI,     &&op_INT,     &&op_RFI,     &&op_XCH,     &&op_IPI,
+        &&op_default, &&op_default, &&op_default, &&op_default, &&op_default, &&op_default, &&op_default, &&op_default,
+        &&op_default, &&op_default, &&op_default, &&op_default, &&op_default, &&op_default, &&op_CPI,     &&op_default,
+        &&op_IEQ,     &&op_INE,     &&op_IGT,     &&op_IGE,     &&op_ILT,     &&op_ILE,     &&op_default, &&op_default,
+        &&op_default, &&op_default, &&op_default, &&op_default, &&op_default, &&op_default, &&op_default, &&op_default,
+        &&op_MOV,     &&op_ADD,     &&op_SUB,     &&op_MUL,     &&op_DIV,     &&op_MOD,     &&op_SHL,     &&op_SHR,
+        &&op_AND,     &&op_BOR,     &&op_XOR,     &&op_NOT,     &&op_INC,     &&op_DEC,     &&op_default, &&op_default,
+        &&uop_IEQ_JUMP, &&uop_INE_JUMP, &&uop_IGT_JUMP, &&uop_IGE_JUMP, &&uop_ILT_JUMP, &&uop_ILE_JUMP, &&uop_MRD_AND
+    };
+#endif
+
+    memcpy(regs, cpu->regs, sizeof(cpu->regs));
 
-    if(cpu->runtime_flags & RUNTIME_FLAG_HALT)
-        return cpu->interrupts.enabled;
+loop:
+    if(executed >= budget)
+        goto done;
 
-    if(cpu->interrupts.enabled && !cpu->interrupts.busy && cpu->interrupts.queue_size > 0) {
-        cpu->interrupts.busy = 1;
-        (*cpu->memory)[cpu->regs[VCPU_REGISTER_SP]--] = cpu->regs[VCPU_REGISTER_PC];
-        (*cpu->memory)[cpu->regs[VCPU_REGISTER_SP]--] = cpu->regs[VCPU_REGISTER_R0];
-        cpu->regs[VCPU_REGISTER_PC] = cpu->regs[VCPU_REGISTER_IA];
-        cpu->regs[VCPU_REGISTER_R0] = cpu->interrupts.queue[--cpu->interrupts.queue_size];
+    if(poll) {
+        /* The queue overflowing under VCPU_INTERRUPT_HALT is
+         * reported by the producer and acted upon here */
+        if(vcpu_atomic_load(&cpu->interrupts.overflowed)) {
+            vcpu_atomic_store(&cpu->interrupts.overflowed, 0);
+            vcpu_atomic_store(&cpu->interrupts.enabled, 0);
+            cpu->runtime_flags |= RUNTIME_FLAG_HALT;
+        }
+
+        if(cpu->runtime_flags & RUNTIME_FLAG_HALT) {
+            if(!cpu->interrupts.enabled || !vcpu_interrupt_ready(&cpu->interrupts)) {
+                reason = cpu->interrupts.enabled ? VCPU_RUN_HALT : VCPU_RUN_FATAL;
+                goto done;
+            }
+            cpu->runtime_flags &= ~RUNTIME_FLAG_HALT;
+        }
+
+        vcpu_enter_interrupt(cpu, regs);
+        poll = 0;
     }
 
-    vcpu_parse(cpu, &instruction);
-    switch(instruction.instruction.opcode) {
-        case VCPU_OPCODE_NOP:
-            return 1;
-        case VCPU_OPCODE_HLT:
-            if(!cpu->interrupts.enabled)
-                return 0;
+    FETCH();
+    DISPATCH() {
+        CASE(NOP)
+            NEXT;
+        CASE(HLT)
+            if(!cpu->interrupts.enabled) {
+                reason = VCPU_RUN_FATAL;
+                goto done;
+            }
             cpu->runtime_flags |= RUNTIME_FLAG_HALT;
-            return 1;
-        case VCPU_OPCODE_PTS:
-            (*cpu->memory)[cpu->regs[VCPU_REGISTER_SP]--] = instruction.a.value;
-            return 1;
-        case VCPU_OPCODE_PFS:
-            vcpu_set_value(cpu, (*cpu->memory)[++cpu->regs[VCPU_REGISTER_SP]], instruction.a.ref);
-            return 1;
-        case VCPU_OPCODE_CAL:
-            (*cpu->memory)[cpu->regs[VCPU_REGISTER_SP]--] = cpu->regs[VCPU_REGISTER_PC];
-            cpu->regs[VCPU_REGISTER_PC] = instruction.a.value;
-            return 1;
-        case VCPU_OPCODE_RET:
-            cpu->regs[VCPU_REGISTER_PC] = (*cpu->memory)[++cpu->regs[VCPU_REGISTER_SP]];
-            return 1;
-        case VCPU_OPCODE_IOR:
-            if(cpu->on_ioread && instruction.b.ref)
-                cpu->on_ioread(cpu, instruction.a.value, instruction.b.ref);
-            return 1;
-        case VCPU_OPCODE_IOW:
-            if(cpu->on_iowrite)
+            reason = VCPU_RUN_HALT;
+            goto done;
+        CASE(PTS)
+            vcpu_write(cpu, regs[VCPU_REGISTER_SP]--, instruction.a.value);
+            NEXT;
+        CASE(PFS)
+            vcpu_set_value(regs, vcpu_read(cpu, ++regs[VCPU_REGISTER_SP]), instruction.a.ref);
+            NEXT;
+        CASE(CAL)
+            vcpu_write(cpu, regs[VCPU_REGISTER_SP]--, regs[VCPU_REGISTER_PC]);
+            regs[VCPU_REGISTER_PC] = instruction.a.value;
+            NEXT;
+        CASE(RET)
+            regs[VCPU_REGISTER_PC] = vcpu_read(cpu, ++regs[VCPU_REGISTER_SP]);
+            NEXT;
+        CASE(IOR)
+            if(cpu->on_ioread && !decoded->instruction.b.imm) {
+                memcpy(cpu->regs, regs, sizeof(cpu->regs));
+                cpu->on_ioread(cpu, instruction.a.value, cpu->regs + decoded->instruction.b.reg);
+                memcpy(regs, cpu->regs, sizeof(cpu->regs));
+            }
+            goto io_done;
+        CASE(IOW)
+            if(cpu->on_iowrite) {
+                memcpy(cpu->regs, regs, sizeof(cpu->regs));
                 cpu->on_iowrite(cpu, instruction.b.value, instruction.a.value);
-            return 1;
-        case VCPU_OPCODE_MRD:
-            vcpu_set_value(cpu, (*cpu->memory)[instruction.a.value], instruction.b.ref);
-            return 1;
-        case VCPU_OPCODE_MWR:
-            (*cpu->memory)[instruction.b.value] = instruction.a.value;
-            return 1;
-        case VCPU_OPCODE_CLI:
-            cpu->interrupts.enabled = 0;
-            return 1;
-        case VCPU_OPCODE_STI:
-            cpu->interrupts.enabled = 1;
-            return 1;
-        case VCPU_OPCODE_INT:
+                memcpy(regs, cpu->regs, sizeof(cpu->regs));
+            }
+            goto io_done;
+        CASE(MRD)
+            vcpu_set_value(regs, vcpu_read(cpu, instruction.a.value), instruction.b.ref);
+            NEXT;
+        CASE(MWR)
+            vcpu_write(cpu, instruction.b.value, instruction.a.value);
+            NEXT;
+        CASE(CLI)
+            vcpu_atomic_store(&cpu->interrupts.enabled, 0);
+            NEXT;
+        CASE(STI)
+            vcpu_atomic_store(&cpu->interrupts.enabled, 1);
+            poll = 1;
+            NEXT;
+        CASE(INT)
             vcpu_interrupt(cpu, instruction.a.value);
-            return 1;
-        case VCPU_OPCODE_RFI:
-            cpu->regs[VCPU_REGISTER_R0] = (*cpu->memory)[++cpu->regs[VCPU_REGISTER_SP]];
-            cpu->regs[VCPU_REGISTER_PC] = (*cpu->memory)[++cpu->regs[VCPU_REGISTER_SP]];
+            poll = 1;
+            NEXT;
+        CASE(RFI)
+            regs[VCPU_REGISTER_R0] = vcpu_read(cpu, ++regs[VCPU_REGISTER_SP]);
+            regs[VCPU_REGISTER_PC] = vcpu_read(cpu, ++regs[VCPU_REGISTER_SP]);
             cpu->interrupts.busy = 0;
-            return 1;
-        case VCPU_OPCODE_CPI:
-            cpu->regs[VCPU_REGISTER_R0] = cpu->cpi.vendor_id;
-            cpu->regs[VCPU_REGISTER_R1] = (cpu->cpi.speed >> 16) & 0xFFFF;
-            cpu->regs[VCPU_REGISTER_R2] = cpu->cpi.speed & 0xFFFF;
-            return 1;
-        case VCPU_OPCODE_IEQ:
+            poll = 1;
+            NEXT;
+        CASE(XCH)
+            vcpu_set_value(regs, vcpu_exchange(cpu, instruction.b.value, instruction.a.value), instruction.a.ref);
+            NEXT;
+        CASE(IPI)
+            vcpu_smp_send(cpu, instruction.b.value, instruction.a.value);
+            poll = 1;
+            NEXT;
+        CASE(CPI)
+            if(decoded->instruction.a.imm && instruction.a.value == VCPU_CPI_LEAF_CORE) {
+                regs[VCPU_REGISTER_R0] = cpu->cpi.core_id;
+                regs[VCPU_REGISTER_R1] = cpu->cpi.num_cores;
+                NEXT;
+            }
+            regs[VCPU_REGISTER_R0] = cpu->cpi.vendor_id;
+            regs[VCPU_REGISTER_R1] = (cpu->cpi.speed >> 16) & 0xFFFF;
+            regs[VCPU_REGISTER_R2] = cpu->cpi.speed & 0xFFFF;
+            NEXT;
+        CASE(IEQ)
             if(!(instruction.b.value == instruction.a.value))
-                vcpu_parse(cpu, &instruction);
-            return 1;
-        case VCPU_OPCODE_INE:
+                vcpu_skip(cpu, regs);
+            NEXT;
+        CASE(INE)
             if(!(instruction.b.value != instruction.a.value))
-                vcpu_parse(cpu, &instruction);
-            return 1;
-        case VCPU_OPCODE_IGT:
+                vcpu_skip(cpu, regs);
+            NEXT;
+        CASE(IGT)
             if(!(instruction.b.value > instruction.a.value))
-                vcpu_parse(cpu, &instruction);
-            return 1;
-        case VCPU_OPCODE_IGE:
+                vcpu_skip(cpu, regs);
+            NEXT;
+        CASE(IGE)
             if(!(instruction.b.value >= instruction.a.value))
-                vcpu_parse(cpu, &instruction);
-            return 1;
-        case VCPU_OPCODE_ILT:
+                vcpu_skip(cpu, regs);
+            NEXT;
+        CASE(ILT)
             if(!(instruction.b.value < instruction.a.value))
-                vcpu_parse(cpu, &instruction);
-            return 1;
-        case VCPU_OPCODE_ILE:
+                vcpu_skip(cpu, regs);
+            NEXT;
+        CASE(ILE)
             if(!(instruction.b.value <= instruction.a.value))
-                vcpu_parse(cpu, &instruction);
-            return 1;
-        case VCPU_OPCODE_MOV:
-            vcpu_set_value(cpu, instruction.a.value, instruction.b.ref);
-            return 1;
-        case VCPU_OPCODE_ADD:
-            vcpu_set_value(cpu, instruction.b.value + instruction.a.value, instruction.b.ref);
-            return 1;
-        case VCPU_OPCODE_SUB:
-            vcpu_set_value(cpu, instruction.b.value - instruction.a.value, instruction.b.ref);
-            return 1;
-        case VCPU_OPCODE_MUL:
-            vcpu_set_value(cpu, instruction.b.value * instruction.a.value, instruction.b.ref);
-            return 1;
-        case VCPU_OPCODE_DIV:
-            vcpu_set_value(cpu, instruction.a.value ? (instruction.b.value / instruction.a.value) : 0, instruction.b.ref);
-            return 1;
-        case VCPU_OPCODE_MOD:
-            vcpu_set_value(cpu, instruction.a.value ? (instruction.b.value % instruction.a.value) : instruction.b.value, instruction.b.ref);
-            return 1;
-        case VCPU_OPCODE_SHL:
-            vcpu_set_value(cpu, instruction.b.value << instruction.a.value, instruction.b.ref);
-            return 1;
-        case VCPU_OPCODE_SHR:
-            vcpu_set_value(cpu, instruction.b.value >> instruction.a.value, instruction.b.ref);
-            return 1;
-        case VCPU_OPCODE_AND:
-            vcpu_set_value(cpu, instruction.b.value & instruction.a.value, instruction.b.ref);
-            return 1;
-        case VCPU_OPCODE_BOR:
-            vcpu_set_value(cpu, instruction.b.value | instruction.a.value, instruction.b.ref);
-            return 1;
-        case VCPU_OPCODE_XOR:
-            vcpu_set_value(cpu, instruction.b.value ^ instruction.a.value, instruction.b.ref);
-            return 1;
-        case VCPU_OPCODE_NOT:
-            vcpu_set_value(cpu, ~instruction.a.value, instruction.a.ref);
-            return 1;
-        case VCPU_OPCODE_INC:
-            vcpu_set_value(cpu, instruction.a.value + 1, instruction.a.ref);
-            return 1;
-        case VCPU_OPCODE_DEC:
-            vcpu_set_value(cpu, instruction.a.value - 1, instruction.a.ref);
-            return 1;
+                vcpu_skip(cpu, regs);
+            NEXT;
+        CASE(MOV)
+            vcpu_set_value(regs, instruction.a.value, instruction.b.ref);
+            NEXT;
+        CASE(ADD)
+            vcpu_set_value(regs, instruction.b.value + instruction.a.value, instruction.b.ref);
+            NEXT;
+        CASE(SUB)
+            vcpu_set_value(regs, instruction.b.value - instruction.a.value, instruction.b.ref);
+            NEXT;
+        CASE(MUL)
+            vcpu_set_value(regs, instruction.b.value * instruction.a.value, instruction.b.ref);
+            NEXT;
+        CASE(DIV)
+            vcpu_set_value(regs, instruction.a.value ? (instruction.b.value / instruction.a.value) : 0, instruction.b.ref);
+            NEXT;
+        CASE(MOD)
+            vcpu_set_value(regs, instruction.a.value ? (instruction.b.value % instruction.a.value) : instruction.b.value, instruction.b.ref);
+            NEXT;
+        CASE(SHL)
+            vcpu_set_value(regs, instruction.b.value << instruction.a.value, instruction.b.ref);
+            NEXT;
+        CASE(SHR)
+            vcpu_set_value(regs, instruction.b.value >> instruction.a.value, instruction.b.ref);
+            NEXT;
+        CASE(AND)
+            vcpu_set_value(regs, instruction.b.value & instruction.a.value, instruction.b.ref);
+            NEXT;
+        CASE(BOR)
+            vcpu_set_value(regs, instruction.b.value | instruction.a.value, instruction.b.ref);
+            NEXT;
+        CASE(XOR)
+            vcpu_set_value(regs, instruction.b.value ^ instruction.a.value, instruction.b.ref);
+            NEXT;
+        CASE(NOT)
+            vcpu_set_value(regs, ~instruction.a.value, instruction.a.ref);
+            NEXT;
+        CASE(INC)
+            vcpu_set_value(regs, instruction.a.value + 1, instruction.a.ref);
+            NEXT;
+        CASE(DEC)
+            vcpu_set_value(regs, instruction.a.value - 1, instruction.a.ref);
+            NEXT;
+        CASE_UOP(IEQ_JUMP)
+            SKIP_JUMP(instruction.b.value == instruction.a.value);
+        CASE_UOP(INE_JUMP)
+            SKIP_JUMP(instruction.b.value != instruction.a.value);
+        CASE_UOP(IGT_JUMP)
+            SKIP_JUMP(instruction.b.value > instruction.a.value);
+        CASE_UOP(IGE_JUMP)
+            SKIP_JUMP(instruction.b.value >= instruction.a.value);
+        CASE_UOP(ILT_JUMP)
+            SKIP_JUMP(instruction.b.value < instruction.a.value);
+        CASE_UOP(ILE_JUMP)
+            SKIP_JUMP(instruction.b.value <= instruction.a.value);
+        CASE_UOP(MRD_AND)
+            vcpu_set_value(regs, vcpu_read(cpu, instruction.a.value), instruction.b.ref);
+            if(executed < budget) {
+                executed++;
+                *instruction.b.ref &= decoded->fused_imm;
+                regs[VCPU_REGISTER_PC] += decoded->fused_length;
+            }
+            NEXT;
+        CASE_DEFAULT
+            /* Unassigned opcodes execute as NOP */
+            NEXT;
     }
+
+io_done:
+    poll = 1;
+    if(cpu->runtime_flags & RUNTIME_FLAG_YIELD)
+        reason = VCPU_RUN_YIELD;
+    else
+        NEXT;
+
+done:
+    cpu->runtime_flags &= ~RUNTIME_FLAG_YIELD;
+    memcpy(cpu->regs, regs, sizeof(cpu->regs));
+    cpu->instret += executed;
+#if defined(VCPU_COVERAGE)
+    cpu->coverage_prev = coverage_prev;
+#endif
+    return reason;
 }
+
+#undef FETCH
+#undef COVER
+#undef NEXT
+#undef SKIP_JUMP
+#undef CASE_DEFAULT
+#undef CASE_UOP
+#undef CASE
+#undef DISPATCH
@@ -1,9 +1,24 @@
 #ifndef _VCPU16_H_
 #define _VCPU16_H_ 1
 #include <stddef.h>
+#include <stdio.h>
 
 #define VCPU_MEM_SIZE       0x10000
-#define VCPU_MAX_INTERRUPTS 0x100
+#define VCPU_MAX_INTERRUPTS 0x100 /* Power of two */
+#define VCPU_PAGE_SIZE      0x100
+#define VCPU_PAGE_COUNT     (VCPU_MEM_SIZE / VCPU_PAGE_SIZE)
+#define VCPU_LOCKSTEP_LANES 16 /* One AVX2 register of 16-bit words */
+#define VCPU_COVERAGE_SIZE  0x10000 /* Largest edge coverage bitmap, in bytes */
+#define VCPU_PORT_COUNT     0x10000
+#define VCPU_PROFILE_NODES  0x4000 /* Distinct call stacks one profile tells apart, power of two */
+#define VCPU_PROFILE_DEPTH  0x100 /* Deepest call stack a profile follows */
+#define VCPU_BUS_DEVICES    0xFF /* Most devices one bus holds */
+
+/* Page flags */
+#define VCPU_PAGE_CODE  (1 << 0) /* Page holds predecoded instructions */
+#define VCPU_PAGE_DIRTY (1 << 1) /* Page was written since the last snapshot */
+#define VCPU_PAGE_READ  (1 << 2) /* Guest loads go through the page's on_read */
+#define VCPU_PAGE_WRITE (1 << 3) /* Guest stores are reported to the page's on_write */
 
 #define VCPU_OPCODE_NOP 0x00
 #define VCPU_OPCODE_HLT 0x01
@@ -19,6 +34,8 @@
 #define VCPU_OPCODE_STI 0x0B
 #define VCPU_OPCODE_INT 0x0C
 #define VCPU_OPCODE_RFI 0x0D
+#define VCPU_OPCODE_XCH 0x0E
+#define VCPU_OPCODE_IPI 0x0F
 #define VCPU_OPCODE_CPI 0x1E
 #define VCPU_OPCODE_IEQ 0x20
 #define VCPU_OPCODE_INE 0x21
@@ -58,9 +75,21 @@
 #define VCPU_REGISTER_SP 0x0E
 #define VCPU_REGISTER_PC 0x0F
 
+/* vcpu_run exit reasons */
+#define VCPU_RUN_BUDGET 0 /* The budget is exhausted */
+#define VCPU_RUN_HALT   1 /* HLT, waiting for an interrupt */
+#define VCPU_RUN_FATAL  2 /* HLT with interrupts disabled */
+#define VCPU_RUN_YIELD  3 /* An I/O handler called vcpu_yield */
+
 #define VCPU_CPI_DEF_VENDOR_ID  0x1F00
 #define VCPU_CPI_DEF_SPEED      25000
 
+/* CPI leaves, selected by an immediate first operand. A register
+ * or a missing operand (a bare "cpi" encodes %R0) always selects
+ * VCPU_CPI_LEAF_INFO, so programs from before SMP see no change. */
+#define VCPU_CPI_LEAF_INFO  0x0000 /* R0 vendor ID, R1:R2 speed */
+#define VCPU_CPI_LEAF_CORE  0x0001 /* R0 core ID, R1 number of cores */
+
 struct vcpu_instruction {
     unsigned char opcode;
     struct {
@@ -73,23 +102,77 @@ struct vcpu;
 typedef void(*vcpu_ioread_t)(struct vcpu *cpu, unsigned short port, unsigned short *value);
 typedef void(*vcpu_iowrite_t)(struct vcpu *cpu, unsigned short port, unsigned short value);
 
+/* What vcpu_interrupt does when the queue is full */
+#define VCPU_INTERRUPT_DROP 0 /* Drops the new message */
+#define VCPU_INTERRUPT_HALT 1 /* Drops it and halts the CPU with interrupts disabled */
+
+struct vcpu_interrupt_slot {
+    unsigned int sequence;
+    unsigned short message;
+};
+
+/* Bounded lock-free FIFO: any number of threads post with
+ * vcpu_interrupt, the thread that runs the vcpu takes them out.
+ * A slot is free for the producer that claimed position n when
+ * its sequence is n and holds a message when it is n + 1. */
 struct vcpu_interrupt_queue {
     int busy, enabled;
-    int queue_size;
-    unsigned short queue[VCPU_MAX_INTERRUPTS];
+    int overflow;                   /* VCPU_INTERRUPT_*, kept across resets */
+    int overflowed;
+    unsigned int head, tail;
+    unsigned long dropped;          /* Messages lost to a full queue */
+    unsigned long masked;           /* Messages posted with interrupts disabled */
+    struct vcpu_interrupt_slot queue[VCPU_MAX_INTERRUPTS];
 };
 
 struct vcpu_cpi_data {
     unsigned short vendor_id;
     unsigned int speed;
+    unsigned short core_id;
+    unsigned short num_cores;
 };
 
 typedef unsigned short vcpu_memory_t[VCPU_MEM_SIZE];
 
+/* Predecoded instruction, filled lazily by the core.
+ * A zero length marks an entry that has to be decoded again.
+ * When the instruction and the one after it form a common idiom,
+ * uop selects a fused handler and the fused_ fields describe the
+ * second instruction; otherwise uop is the opcode. */
+struct vcpu_decoded {
+    struct vcpu_instruction instruction;
+    unsigned char length;
+    unsigned char uop;
+    unsigned char fused_length;
+    unsigned short imms[2];
+    unsigned short fused_imm;
+};
+
+struct vcpu_jit;
+struct vcpu_smp;
+struct vcpu_bus;
+struct vcpu_page_hook;
+struct vcpu_perf;
+struct vcpu_profile;
+struct vcpu_snapshot;
+
 struct vcpu {
     int runtime_flags;
     vcpu_memory_t *memory;
+    struct vcpu_decoded *decoded;
+    struct vcpu_jit *jit;
+    struct vcpu_smp *smp;
+    struct vcpu_bus *bus;
+    struct vcpu_page_hook *hooks;   /* VCPU_PAGE_COUNT of them once vcpu_map was called */
+    struct vcpu_profile *profile;
+    struct vcpu_perf *perf;
+    const struct vcpu_snapshot *snapshot;
+    unsigned char *coverage;
+    unsigned short coverage_mask;
+    unsigned short coverage_prev;
+    unsigned char pages[VCPU_PAGE_COUNT];
     unsigned short regs[16];
+    unsigned long instret;
     struct vcpu_interrupt_queue interrupts;
     vcpu_ioread_t on_ioread;
     vcpu_iowrite_t on_iowrite;
@@ -98,9 +181,270 @@ struct vcpu {
 
 void init_vcpu(struct vcpu *cpu, vcpu_memory_t *shared_memory);
 void shutdown_vcpu(struct vcpu *cpu);
+
+/* Brings the registers, interrupt state and instret back to their
+ * power-on values without releasing anything init_vcpu allocated.
+ * Everything predecoded is dropped, so the host may reload memory
+ * freely before the next run. */
+void reset_vcpu(struct vcpu *cpu);
+
+/* Queues an interrupt; safe to call from any thread while
+ * another one runs the vcpu. Messages are delivered in the order
+ * they were queued. Nothing is queued while interrupts are disabled. */
 void vcpu_interrupt(struct vcpu *cpu, unsigned short message);
+
+/* Nonzero when interrupts are waiting to be taken; safe from any thread */
+int vcpu_interrupt_pending(const struct vcpu *cpu);
 int vcpu_step(struct vcpu *cpu);
 
+/* Executes up to budget instructions. Every instruction takes
+ * exactly one cycle, so the budget doubles as a cycle budget.
+ * The number of executed instructions is added to cpu->instret. */
+int vcpu_run(struct vcpu *cpu, unsigned long budget);
+
+/* Runs up to VCPU_LOCKSTEP_LANES vcpus loaded with the same program
+ * side by side, one instruction for all of them at a time. Each vcpu
+ * needs memory of its own. Lanes that branch apart are masked off
+ * until their PCs meet again; lanes that stay apart or load different
+ * code finish on the scalar path. reasons[i] receives what
+ * vcpu_run(cpus[i], budget) would have returned. */
+void vcpu_run_lockstep(struct vcpu **cpus, size_t count, unsigned long budget, int *reasons);
+
+/* Called from I/O handlers to make vcpu_run return
+ * VCPU_RUN_YIELD once the current instruction is done. */
+void vcpu_yield(struct vcpu *cpu);
+
+/* Switches vcpu_run to translating guest basic blocks into host code.
+ * Returns zero when the core was built without the JIT (VCPU_JIT)
+ * or the host refuses executable memory; the interpreter stays in use. */
+int vcpu_jit_enable(struct vcpu *cpu);
+
+/* Makes the interpreter count guest control flow edges into bitmap
+ * (NULL stops it); JIT blocks and lockstep runs are not seen. size
+ * is a power of two up to VCPU_COVERAGE_SIZE: code that stays below
+ * address size hashes its edges below size as well, so a map as small
+ * as the program loses nothing. Returns zero when the core was built
+ * without coverage support (VCPU_COVERAGE). */
+int vcpu_coverage_enable(struct vcpu *cpu, unsigned char *bitmap, size_t size);
+
+/* The core predecodes instructions and keeps them until the guest
+ * writes over them. Writes that bypass the core (loading a ROM after
+ * the first step, another vcpu sharing the memory) must be reported
+ * here so the stale instructions are decoded again. */
+void vcpu_invalidate(struct vcpu *cpu, unsigned short addr, size_t count);
+
+/* Memory hooks, page by page. Every guest load and store tests the
+ * flags of its page, so pages without hooks stay plain RAM at the
+ * cost of that one lookup. On a page with on_read, a load gets the
+ * word in memory and the handler may replace it, which is how device
+ * registers are modelled. On a page with on_write, a store first lands
+ * in memory and is then reported to the handler; that way a framebuffer
+ * learns which cells changed, and a debugger sees writes to code.
+ * Instruction fetches always come from memory. Hooks belong to the vcpu
+ * and only see its own accesses. They run in the middle of vcpu_run,
+ * with the registers and instret as of the start of the call. Read
+ * hooks make vcpu_run use the interpreter even with the JIT enabled. */
+typedef void(*vcpu_page_read_t)(void *context, struct vcpu *cpu, unsigned short addr, unsigned short *value);
+typedef void(*vcpu_page_write_t)(void *context, struct vcpu *cpu, unsigned short addr, unsigned short value);
+
+struct vcpu_page_hook {
+    vcpu_page_read_t on_read;
+    vcpu_page_write_t on_write;
+    void *context;
+};
+
+/* Hooks every page [addr, addr + count) touches, wrapping around
+ * the end of memory; NULL handlers turn them back into plain RAM.
+ * May be called from a hook or I/O handler of the same vcpu, but not
+ * while other cores of an SMP machine run. */
+void vcpu_map(struct vcpu *cpu, unsigned short addr, size_t count, vcpu_page_read_t on_read, vcpu_page_write_t on_write, void *context);
+
+/* Guest profiler. Each instruction takes one cycle, so the count of
+ * a PC is its cycle count too. Calls are followed through CAL and RET
+ * and through interrupt entry and RFI into a tree of call stacks, one
+ * node per stack: the address a routine was entered at, how often
+ * that happened and the cycles spent in it outside of its callees.
+ * A call that would go deeper than VCPU_PROFILE_DEPTH or past
+ * VCPU_PROFILE_NODES stacks stays charged to its caller. */
+struct vcpu_profile_node {
+    unsigned int parent;
+    unsigned int chain;             /* Next node in the same hash bucket */
+    unsigned short entry;
+    unsigned short depth;
+    int interrupt;                  /* Entered by an interrupt, not CAL */
+    unsigned long calls;
+    unsigned long cycles;
+};
+
+struct vcpu_profile {
+    unsigned long counts[VCPU_MEM_SIZE];
+    unsigned int current;           /* Node of the code running now */
+    unsigned int unfollowed;        /* Calls on the stack that were not followed */
+    unsigned long dropped;          /* Calls ever charged to their caller */
+    unsigned int num_nodes;         /* Node 0 is the root at 0x0000 */
+    unsigned int buckets[VCPU_PROFILE_NODES];
+    struct vcpu_profile_node nodes[VCPU_PROFILE_NODES];
+};
+
+void init_vcpu_profile(struct vcpu_profile *profile);
+
+/* Profiles everything vcpu_run executes from now on into profile,
+ * adding to what it holds, from the root of the call tree; NULL
+ * stops it. While profiling, vcpu_run interprets one instruction at
+ * a time; without a profile the only cost is one test per call. */
+void vcpu_profile_enable(struct vcpu *cpu, struct vcpu_profile *profile);
+
+/* Adds the counts and the call tree of src to dst */
+void vcpu_profile_merge(struct vcpu_profile *dst, const struct vcpu_profile *src);
+
+/* Writes one line per call stack in the folded format flame graph
+ * tools read: "0x0000;0x0123;0x0456 cycles". Routines are named by
+ * their entry address, those entered by an interrupt carry an
+ * [interrupt] suffix. */
+void vcpu_profile_write(const struct vcpu_profile *profile, FILE *fp);
+
+/* Host performance counters, read with perf_event_open around the
+ * run loop and divided by the guest instructions it retired. Counting
+ * only the whole run leaves vcpu_run as it is, JIT included. Counting
+ * by opcode class interprets one instruction at a time and reads the
+ * counters around each; the cost of reading them is measured once and
+ * taken off, but entering the interpreter for every instruction stays
+ * in, so those figures compare the classes with each other rather than
+ * with a plain run. Counters only see the thread that opened them. */
+#define VCPU_PERF_CYCLES        0
+#define VCPU_PERF_INSTRUCTIONS  1
+#define VCPU_PERF_BRANCH_MISSES 2
+#define VCPU_PERF_L1_MISSES     3 /* L1 data cache read misses */
+#define VCPU_PERF_EVENTS        4
+
+#define VCPU_PERF_CLASS_CONTROL 0 /* NOP HLT CAL RET CLI STI INT RFI IPI CPI */
+#define VCPU_PERF_CLASS_MEMORY  1 /* MRD MWR PTS PFS XCH */
+#define VCPU_PERF_CLASS_IO      2 /* IOR IOW */
+#define VCPU_PERF_CLASS_COMPARE 3 /* IEQ INE IGT IGE ILT ILE */
+#define VCPU_PERF_CLASS_ALU     4 /* MOV through DEC */
+#define VCPU_PERF_CLASSES       5
+
+struct vcpu_perf_counts {
+    unsigned long instret;
+    unsigned long long events[VCPU_PERF_EVENTS];
+};
+
+struct vcpu_perf {
+    int by_class;
+    int leader;                     /* Group leader or -1 */
+    int fds[VCPU_PERF_EVENTS];      /* -1 for events the host does not count */
+    int counted[VCPU_PERF_EVENTS];
+    unsigned long long overhead[VCPU_PERF_EVENTS];
+    struct vcpu_perf_counts total;
+    struct vcpu_perf_counts classes[VCPU_PERF_CLASSES];
+};
+
+/* Opens the counters for the calling thread. Returns zero when the core
+ * was built without them (VCPU_PERF) or the host counts none of them. */
+int init_vcpu_perf(struct vcpu_perf *perf, int by_class);
+void shutdown_vcpu_perf(struct vcpu_perf *perf);
+
+/* Counts everything vcpu_run executes from now on into perf, which
+ * must have been opened by the thread running the vcpu; NULL stops it */
+void vcpu_perf_enable(struct vcpu *cpu, struct vcpu_perf *perf);
+
+/* Adds the counts of src to dst */
+void vcpu_perf_merge(struct vcpu_perf *dst, const struct vcpu_perf *src);
+
+/* Writes a table of every event per guest instruction */
+void vcpu_perf_write(const struct vcpu_perf *perf, FILE *fp);
+
+/* Everything vcpu_restore needs to bring a vcpu back */
+struct vcpu_snapshot {
+    int runtime_flags;
+    unsigned short regs[16];
+    unsigned long instret;
+    struct vcpu_interrupt_queue interrupts;
+    struct vcpu_cpi_data cpi;
+    vcpu_memory_t memory;
+};
+
+/* Saves the whole state of the vcpu. From then on the core
+ * keeps track of the pages written (by the guest or reported
+ * through vcpu_invalidate) so that restoring the snapshot
+ * taken last only copies those back. Restoring any other
+ * snapshot copies all of memory. Neither may run while another
+ * thread posts interrupts to the vcpu. */
+void vcpu_snapshot(struct vcpu *cpu, struct vcpu_snapshot *snapshot);
+void vcpu_restore(struct vcpu *cpu, const struct vcpu_snapshot *snapshot);
+
+/* SMP: cores sharing one memory image, each run by a host thread.
+ *
+ * Every guest memory access is a single-copy atomic 16-bit access.
+ * Loads (MRD, PFS, RET, RFI) have acquire and stores (MWR, PTS, CAL)
+ * have release semantics: data stored before a flag is visible to a
+ * core that has seen the flag. XCH swaps a register with a memory word
+ * as one sequentially consistent operation and orders everything
+ * around it, which is what guest locks are built from.
+ *
+ * IPI $message, %core posts an interrupt to another core (or to itself,
+ * like INT) straight into its interrupt queue. Code written by one core
+ * is dropped from the decode caches of the others the next time they
+ * call vcpu_smp_sync; a guest must not rewrite code another core is
+ * about to run for the first time without ordering the two through a
+ * lock. */
+typedef void(*vcpu_ipi_t)(struct vcpu_smp *smp, unsigned int core);
+
+struct vcpu_smp {
+    vcpu_memory_t *memory;
+    struct vcpu *cores;
+    unsigned int num_cores;
+    unsigned char *stale;           /* VCPU_PAGE_COUNT flags per core */
+    int *stale_pending;
+    vcpu_ipi_t on_ipi;              /* Called after an IPI is posted, from the sender's thread */
+    void *user;
+};
+
+/* Creates num_cores vcpus over one freshly allocated memory image.
+ * Core i reports i through CPI leaf VCPU_CPI_LEAF_CORE. */
+void init_vcpu_smp(struct vcpu_smp *smp, unsigned int num_cores);
+void shutdown_vcpu_smp(struct vcpu_smp *smp);
+
+/* reset_vcpu for every core */
+void reset_vcpu_smp(struct vcpu_smp *smp);
+
+/* Called by the thread that runs a core, between
+ * vcpu_run calls. Drops code other cores wrote. */
+void vcpu_smp_sync(struct vcpu *cpu);
+
+/* I/O bus: a table from port to the device that claimed it, so
+ * IOR and IOW cost the same however many devices there are.
+ * Ports nobody claimed read as the operand left untouched and
+ * ignore writes. Device 0 is that empty device. */
+typedef void(*vcpu_bus_read_t)(void *context, struct vcpu *cpu, unsigned short port, unsigned short *value);
+typedef void(*vcpu_bus_write_t)(void *context, struct vcpu *cpu, unsigned short port, unsigned short value);
+
+struct vcpu_bus_device {
+    vcpu_bus_read_t on_read;
+    vcpu_bus_write_t on_write;
+    void *context;
+};
+
+struct vcpu_bus {
+    unsigned int num_devices;
+    unsigned char ports[VCPU_PORT_COUNT];
+    struct vcpu_bus_device devices[VCPU_BUS_DEVICES + 1];
+};
+
+void init_vcpu_bus(struct vcpu_bus *bus);
+
+/* Hands ports [first, first + count) to a device; either handler may
+ * be NULL. Returns zero when one of them is taken already or the bus
+ * is full. */
+int vcpu_bus_register(struct vcpu_bus *bus, unsigned short first, size_t count, vcpu_bus_read_t on_read, vcpu_bus_write_t on_write, void *context);
+
+/* Routes the I/O of the vcpu through the bus by making these its
+ * on_ioread/on_iowrite. A host that wraps them (to log accesses, say)
+ * sets cpu->bus itself and calls them from its own handlers. */
+void vcpu_bus_attach(struct vcpu *cpu, struct vcpu_bus *bus);
+void vcpu_bus_ioread(struct vcpu *cpu, unsigned short port, unsigned short *value);
+void vcpu_bus_iowrite(struct vcpu *cpu, unsigned short port, unsigned short value);
+
 #if defined(_WIN32)
 #include <windows.h>
 #define vcpu_be16_to_host(word) htons(word)
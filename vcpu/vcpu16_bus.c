@@ -0,0 +1,48 @@
+#include <string.h>
+#include "vcpu16.h"
+
+void init_vcpu_bus(struct vcpu_bus *bus)
+{
+    memset(bus, 0, sizeof(struct vcpu_bus));
+}
+
+int vcpu_bus_register(struct vcpu_bus *bus, unsigned short first, size_t count, vcpu_bus_read_t on_read, vcpu_bus_write_t on_write, void *context)
+{
+    struct vcpu_bus_device *device;
+    size_t i;
+
+    if(bus->num_devices >= VCPU_BUS_DEVICES || !count || first + count > VCPU_PORT_COUNT)
+        return 0;
+    for(i = 0; i < count; i++) {
+        if(bus->ports[first + i])
+            return 0;
+    }
+
+    device = &bus->devices[++bus->num_devices];
+    device->on_read = on_read;
+    device->on_write = on_write;
+    device->context = context;
+    memset(bus->ports + first, (int)bus->num_devices, count);
+    return 1;
+}
+
+void vcpu_bus_attach(struct vcpu *cpu, struct vcpu_bus *bus)
+{
+    cpu->bus = bus;
+    cpu->on_ioread = &vcpu_bus_ioread;
+    cpu->on_iowrite = &vcpu_bus_iowrite;
+}
+
+void vcpu_bus_ioread(struct vcpu *cpu, unsigned short port, unsigned short *value)
+{
+    const struct vcpu_bus_device *device = &cpu->bus->devices[cpu->bus->ports[port]];
+    if(device->on_read)
+        device->on_read(device->context, cpu, port, value);
+}
+
+void vcpu_bus_iowrite(struct vcpu *cpu, unsigned short port, unsigned short value)
+{
+    const struct vcpu_bus_device *device = &cpu->bus->devices[cpu->bus->ports[port]];
+    if(device->on_write)
+        device->on_write(device->context, cpu, port, value);
+}
@@ -0,0 +1,82 @@
+#ifndef _VCPU16_INTERNAL_H_
+#define _VCPU16_INTERNAL_H_ 1
+#include "vcpu16.h"
+
+/* Shared between the translation units of the core, not installed */
+
+#define RUNTIME_FLAG_HALT           (1 << 0)
+#define RUNTIME_FLAG_SHARED_MEMORY  (1 << 1)
+#define RUNTIME_FLAG_YIELD          (1 << 2)
+#define RUNTIME_FLAG_READ_HOOKS     (1 << 3) /* Some page has VCPU_PAGE_READ */
+
+/* Guest memory accesses, ordered as described for SMP in vcpu16.h.
+ * On x86 the loads and stores compile to plain moves. */
+#if defined(__GNUC__)
+#define vcpu_atomic_load(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define vcpu_atomic_store(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#define vcpu_atomic_exchange(ptr, value) __atomic_exchange_n((ptr), (value), __ATOMIC_SEQ_CST)
+#define vcpu_atomic_or(ptr, value) __atomic_or_fetch((ptr), (value), __ATOMIC_RELAXED)
+#define vcpu_atomic_add(ptr, value) __atomic_add_fetch((ptr), (value), __ATOMIC_RELAXED)
+#define vcpu_atomic_cas(ptr, expected, value) __atomic_compare_exchange_n((ptr), (expected), (value), 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#else
+/* Without compiler atomics only a single core is safe */
+#define vcpu_atomic_load(ptr) (*(ptr))
+#define vcpu_atomic_store(ptr, value) (*(ptr) = (value))
+#define vcpu_atomic_exchange(ptr, value) vcpu_plain_exchange((ptr), (value))
+#define vcpu_atomic_or(ptr, value) (*(ptr) |= (value))
+#define vcpu_atomic_add(ptr, value) (*(ptr) += (value))
+#define vcpu_atomic_cas(ptr, expected, value) (*(ptr) = (value), 1)
+static unsigned short vcpu_plain_exchange(unsigned short *ptr, unsigned short value)
+{
+    unsigned short old = *ptr;
+    *ptr = value;
+    return old;
+}
+#endif
+
+/* Every guest write goes through here; the flag is set atomically
+ * because other SMP cores may be setting VCPU_PAGE_CODE meanwhile */
+#define vcpu_mark_dirty(cpu, addr) do {                                 \
+    unsigned char *_page = (cpu)->pages + (addr) / VCPU_PAGE_SIZE;      \
+    if(!(*_page & VCPU_PAGE_DIRTY))                                     \
+        vcpu_atomic_or(_page, VCPU_PAGE_DIRTY);                         \
+} while(0)
+
+/* The slow path of a guest store that already landed in memory
+ * and hit a code page or a page with a write hook */
+void vcpu_written(struct vcpu *cpu, unsigned short addr, unsigned short value);
+
+const struct vcpu_decoded *vcpu_decode(struct vcpu *cpu, unsigned short pc);
+int vcpu_interpret(struct vcpu *cpu, unsigned long budget);
+
+/* Nonzero when the interrupt state needs the interpreter's
+ * attention: an interrupt can be taken or the queue overflowed */
+int vcpu_interrupt_poll(const struct vcpu *cpu);
+
+/* vcpu_invalidate without telling the other cores */
+void vcpu_drop_decoded(struct vcpu *cpu, unsigned short addr, size_t count);
+
+/* Marks a page as code on every core so that writes to it
+ * from any of them take the invalidating path */
+void vcpu_smp_code(struct vcpu_smp *smp, unsigned int page);
+void vcpu_smp_stale(struct vcpu *cpu, unsigned short addr, size_t count);
+void vcpu_smp_send(struct vcpu *cpu, unsigned short core, unsigned short message);
+
+/* vcpu_run while a profile is attached */
+int vcpu_profile_run(struct vcpu *cpu, unsigned long budget);
+
+/* vcpu_run without the host performance counters */
+int vcpu_execute(struct vcpu *cpu, unsigned long budget);
+
+#if defined(VCPU_PERF)
+int vcpu_perf_run(struct vcpu *cpu, unsigned long budget);
+#endif
+
+#if defined(VCPU_JIT)
+struct vcpu_jit *vcpu_jit_create(void);
+void vcpu_jit_destroy(struct vcpu_jit *jit);
+void vcpu_jit_invalidate(struct vcpu_jit *jit, unsigned short addr, size_t count);
+int vcpu_jit_run(struct vcpu *cpu, unsigned long budget);
+#endif
+
+#endif
@@ -0,0 +1,483 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "vcpu16.h"
+#include "vcpu16_internal.h"
+
+/* x86-64 (System V) basic block translator.
+ *
+ * A block is a straight run of guest instructions ending at a write
+ * to %PC, CAL, RET or a conditional skip. Instructions that touch the
+ * interrupt controller, I/O ports or the halt state (HLT, IOR, IOW,
+ * CLI, STI, INT, RFI, XCH, IPI, CPI) are never translated: a block ends right
+ * before them and the interpreter executes them, so interrupts can
+ * only become deliverable between blocks. A PC that starts with one
+ * gets an empty block, so later visits go straight to the interpreter.
+ *
+ * Generated code works on the architectural register file in place:
+ *  rdi - cpu->regs
+ *  rsi - guest memory
+ *  r8  - cpu->pages
+ *  r9  - where to report the address of a write that hit code
+ * and returns the number of instructions it executed. */
+
+#define JIT_CODE_SIZE       (8 << 20)
+#define JIT_MAX_BLOCKS      0x10000
+#define JIT_MAX_INSNS       64
+#define JIT_MAX_INSN_CODE   96
+#define JIT_MAX_SPAN        ((JIT_MAX_INSNS + 1) * 3)
+
+/* Set in the return value when a store hit a code or write hooked page */
+#define JIT_EXIT_WRITTEN    0x10000
+
+#define REG_OFFSET(reg) ((reg) * 2)
+
+typedef unsigned int(*jit_code_t)(unsigned short *regs, unsigned short *memory, const unsigned char *pages, unsigned short *written);
+
+/* A block without code marks a PC whose first instruction cannot be
+ * translated; it covers the words that decided so, like any block */
+struct jit_block {
+    unsigned short start;
+    unsigned short span;
+    unsigned int count;
+    jit_code_t code;
+};
+
+struct vcpu_jit {
+    unsigned char *code;
+    size_t code_used;
+    size_t num_blocks;
+    struct jit_block pool[JIT_MAX_BLOCKS];
+    struct jit_block *blocks[VCPU_MEM_SIZE];
+    unsigned short cover[VCPU_MEM_SIZE];
+};
+
+static void emit8(unsigned char **p, unsigned int value)
+{
+    *(*p)++ = value & 0xFF;
+}
+
+static void emit16(unsigned char **p, unsigned int value)
+{
+    emit8(p, value);
+    emit8(p, value >> 8);
+}
+
+static void emit32(unsigned char **p, unsigned int value)
+{
+    emit16(p, value);
+    emit16(p, value >> 16);
+}
+
+/* mov word [rdi + reg], imm16 */
+static void emit_store_reg_imm(unsigned char **p, unsigned int reg, unsigned short value)
+{
+    emit8(p, 0x66); emit8(p, 0xC7); emit8(p, 0x47); emit8(p, REG_OFFSET(reg));
+    emit16(p, value);
+}
+
+/* Loads an operand into eax (host = 0) or ecx (host = 1) */
+static void emit_load_operand(unsigned char **p, int host, int imm, unsigned int reg, unsigned short imm_value, unsigned short pc_value)
+{
+    if(imm || reg == VCPU_REGISTER_PC) {
+        /* mov r32, imm32 */
+        emit8(p, 0xB8 + host);
+        emit32(p, imm ? imm_value : pc_value);
+        return;
+    }
+
+    /* movzx r32, word [rdi + reg] */
+    emit8(p, 0x0F); emit8(p, 0xB7); emit8(p, 0x47 | (host << 3)); emit8(p, REG_OFFSET(reg));
+}
+
+/* vcpu_set_value: the low word of eax goes to the destination
+ * register (unless it is an immediate), the high word to %OF.
+ * Returns nonzero when the destination is %PC. */
+static int emit_set_value(unsigned char **p, int imm, unsigned int reg)
+{
+    if(!imm) {
+        /* mov word [rdi + reg], ax */
+        emit8(p, 0x66); emit8(p, 0x89); emit8(p, 0x47); emit8(p, REG_OFFSET(reg));
+    }
+
+    /* shr eax, 16 ; mov word [rdi + OF], ax */
+    emit8(p, 0xC1); emit8(p, 0xE8); emit8(p, 0x10);
+    emit8(p, 0x66); emit8(p, 0x89); emit8(p, 0x47); emit8(p, REG_OFFSET(VCPU_REGISTER_OF));
+
+    return !imm && reg == VCPU_REGISTER_PC;
+}
+
+/* Marks the page of the store to the address in eax dirty and leaves
+ * the block when it holds code or a write hook, so the host can
+ * invalidate what was built from it or call the hook. */
+static void emit_check_write(unsigned char **p, int set_pc, unsigned short next_pc, unsigned int count)
+{
+    /* mov edx, eax ; shr edx, 8 */
+    emit8(p, 0x89); emit8(p, 0xC2);
+    emit8(p, 0xC1); emit8(p, 0xEA); emit8(p, 0x08);
+
+    /* test byte [r8 + rdx], VCPU_PAGE_DIRTY ; jnz +6 ; lock or byte [r8 + rdx], VCPU_PAGE_DIRTY */
+    emit8(p, 0x41); emit8(p, 0xF6); emit8(p, 0x04); emit8(p, 0x10); emit8(p, VCPU_PAGE_DIRTY);
+    emit8(p, 0x75); emit8(p, 0x06);
+    emit8(p, 0xF0); emit8(p, 0x41); emit8(p, 0x80); emit8(p, 0x0C); emit8(p, 0x10); emit8(p, VCPU_PAGE_DIRTY);
+
+    /* test byte [r8 + rdx], VCPU_PAGE_CODE | VCPU_PAGE_WRITE */
+    emit8(p, 0x41); emit8(p, 0xF6); emit8(p, 0x04); emit8(p, 0x10); emit8(p, VCPU_PAGE_CODE | VCPU_PAGE_WRITE);
+
+    /* jz over the exit */
+    emit8(p, 0x74); emit8(p, (set_pc ? 6 : 0) + 10);
+    if(set_pc)
+        emit_store_reg_imm(p, VCPU_REGISTER_PC, next_pc);
+
+    /* mov word [r9], ax ; mov eax, count | JIT_EXIT_WRITTEN ; ret */
+    emit8(p, 0x66); emit8(p, 0x41); emit8(p, 0x89); emit8(p, 0x01);
+    emit8(p, 0xB8); emit32(p, count | JIT_EXIT_WRITTEN);
+    emit8(p, 0xC3);
+}
+
+/* SP in eax, the decremented SP written back */
+static void emit_push_sp(unsigned char **p)
+{
+    /* movzx eax, word [rdi + SP] ; lea edx, [rax - 1] ; mov word [rdi + SP], dx */
+    emit8(p, 0x0F); emit8(p, 0xB7); emit8(p, 0x47); emit8(p, REG_OFFSET(VCPU_REGISTER_SP));
+    emit8(p, 0x8D); emit8(p, 0x50); emit8(p, 0xFF);
+    emit8(p, 0x66); emit8(p, 0x89); emit8(p, 0x57); emit8(p, REG_OFFSET(VCPU_REGISTER_SP));
+}
+
+/* Pre-incremented SP in eax, written back */
+static void emit_pop_sp(unsigned char **p)
+{
+    /* movzx eax, word [rdi + SP] ; inc ax ; mov word [rdi + SP], ax */
+    emit8(p, 0x0F); emit8(p, 0xB7); emit8(p, 0x47); emit8(p, REG_OFFSET(VCPU_REGISTER_SP));
+    emit8(p, 0x66); emit8(p, 0xFF); emit8(p, 0xC0);
+    emit8(p, 0x66); emit8(p, 0x89); emit8(p, 0x47); emit8(p, REG_OFFSET(VCPU_REGISTER_SP));
+}
+
+static int jit_translatable(unsigned char opcode)
+{
+    switch(opcode) {
+        case VCPU_OPCODE_HLT:
+        case VCPU_OPCODE_IOR:
+        case VCPU_OPCODE_IOW:
+        case VCPU_OPCODE_CLI:
+        case VCPU_OPCODE_STI:
+        case VCPU_OPCODE_INT:
+        case VCPU_OPCODE_RFI:
+        case VCPU_OPCODE_XCH:
+        case VCPU_OPCODE_IPI:
+        case VCPU_OPCODE_CPI:
+            return 0;
+    }
+
+    return 1;
+}
+
+static int jit_is_skip(unsigned char opcode)
+{
+    return opcode >= VCPU_OPCODE_IEQ && opcode <= VCPU_OPCODE_ILE;
+}
+
+/* Emits one instruction; count includes it. Returns nonzero
+ * when the instruction ends the block. */
+static int jit_emit(unsigned char **p, const struct vcpu_decoded *decoded, unsigned short pc, unsigned short skip_length, unsigned int count)
+{
+    const struct vcpu_instruction *insn = &decoded->instruction;
+    unsigned short next_pc = pc + decoded->length;
+
+    #define _load_a(host) emit_load_operand(p, host, insn->a.imm, insn->a.reg, decoded->imms[0], pc + 1)
+    #define _load_b(host) emit_load_operand(p, host, insn->b.imm, insn->b.reg, decoded->imms[1], next_pc)
+    #define _binary(op) _load_b(0); _load_a(1); op; return emit_set_value(p, insn->b.imm, insn->b.reg)
+
+    switch(insn->opcode) {
+        case VCPU_OPCODE_PTS:
+            _load_a(1);
+            emit_push_sp(p);
+            /* mov word [rsi + rax * 2], cx */
+            emit8(p, 0x66); emit8(p, 0x89); emit8(p, 0x0C); emit8(p, 0x46);
+            emit_check_write(p, 1, next_pc, count);
+            return 0;
+        case VCPU_OPCODE_PFS:
+            emit_pop_sp(p);
+            /* movzx eax, word [rsi + rax * 2] */
+            emit8(p, 0x0F); emit8(p, 0xB7); emit8(p, 0x04); emit8(p, 0x46);
+            return emit_set_value(p, insn->a.imm, insn->a.reg);
+        case VCPU_OPCODE_CAL:
+            _load_a(1);
+            emit_push_sp(p);
+            /* mov word [rsi + rax * 2], next_pc */
+            emit8(p, 0x66); emit8(p, 0xC7); emit8(p, 0x04); emit8(p, 0x46); emit16(p, next_pc);
+            /* mov word [rdi + PC], cx */
+            emit8(p, 0x66); emit8(p, 0x89); emit8(p, 0x4F); emit8(p, REG_OFFSET(VCPU_REGISTER_PC));
+            emit_check_write(p, 0, next_pc, count);
+            return 1;
+        case VCPU_OPCODE_RET:
+            emit_pop_sp(p);
+            /* movzx ecx, word [rsi + rax * 2] ; mov word [rdi + PC], cx */
+            emit8(p, 0x0F); emit8(p, 0xB7); emit8(p, 0x0C); emit8(p, 0x46);
+            emit8(p, 0x66); emit8(p, 0x89); emit8(p, 0x4F); emit8(p, REG_OFFSET(VCPU_REGISTER_PC));
+            return 1;
+        case VCPU_OPCODE_MRD:
+            _load_a(1);
+            /* movzx eax, word [rsi + rcx * 2] */
+            emit8(p, 0x0F); emit8(p, 0xB7); emit8(p, 0x04); emit8(p, 0x4E);
+            return emit_set_value(p, insn->b.imm, insn->b.reg);
+        case VCPU_OPCODE_MWR:
+            _load_b(0);
+            _load_a(1);
+            /* mov word [rsi + rax * 2], cx */
+            emit8(p, 0x66); emit8(p, 0x89); emit8(p, 0x0C); emit8(p, 0x46);
+            emit_check_write(p, 1, next_pc, count);
+            return 0;
+        case VCPU_OPCODE_IEQ:
+        case VCPU_OPCODE_INE:
+        case VCPU_OPCODE_IGT:
+        case VCPU_OPCODE_IGE:
+        case VCPU_OPCODE_ILT:
+        case VCPU_OPCODE_ILE:
+            _load_b(0);
+            _load_a(1);
+            /* cmp eax, ecx ; mov edx, next_pc ; mov r10d, next_pc + skip_length */
+            emit8(p, 0x39); emit8(p, 0xC8);
+            emit8(p, 0xBA); emit32(p, next_pc);
+            emit8(p, 0x41); emit8(p, 0xBA); emit32(p, (next_pc + skip_length) & 0xFFFF);
+            /* cmovcc edx, r10d when the condition does not hold */
+            emit8(p, 0x41); emit8(p, 0x0F);
+            switch(insn->opcode) {
+                case VCPU_OPCODE_IEQ: emit8(p, 0x45); break; /* cmovne */
+                case VCPU_OPCODE_INE: emit8(p, 0x44); break; /* cmove */
+                case VCPU_OPCODE_IGT: emit8(p, 0x46); break; /* cmovbe */
+                case VCPU_OPCODE_IGE: emit8(p, 0x42); break; /* cmovb */
+                case VCPU_OPCODE_ILT: emit8(p, 0x43); break; /* cmovae */
+                case VCPU_OPCODE_ILE: emit8(p, 0x47); break; /* cmova */
+            }
+            emit8(p, 0xD2);
+            /* mov word [rdi + PC], dx */
+            emit8(p, 0x66); emit8(p, 0x89); emit8(p, 0x57); emit8(p, REG_OFFSET(VCPU_REGISTER_PC));
+            return 1;
+        case VCPU_OPCODE_MOV:
+            _load_a(0);
+            return emit_set_value(p, insn->b.imm, insn->b.reg);
+        case VCPU_OPCODE_ADD:
+            _binary((emit8(p, 0x01), emit8(p, 0xC8)));
+        case VCPU_OPCODE_SUB:
+            _binary((emit8(p, 0x29), emit8(p, 0xC8)));
+        case VCPU_OPCODE_MUL:
+            _binary((emit8(p, 0x0F), emit8(p, 0xAF), emit8(p, 0xC1)));
+        case VCPU_OPCODE_DIV:
+            /* test ecx, ecx ; jz 1f ; xor edx, edx ; div ecx ; jmp 2f ; 1: xor eax, eax ; 2: */
+            _binary((emit8(p, 0x85), emit8(p, 0xC9), emit8(p, 0x74), emit8(p, 0x06),
+                emit8(p, 0x31), emit8(p, 0xD2), emit8(p, 0xF7), emit8(p, 0xF1),
+                emit8(p, 0xEB), emit8(p, 0x02), emit8(p, 0x31), emit8(p, 0xC0)));
+        case VCPU_OPCODE_MOD:
+            /* test ecx, ecx ; jz 1f ; xor edx, edx ; div ecx ; mov eax, edx ; 1: */
+            _binary((emit8(p, 0x85), emit8(p, 0xC9), emit8(p, 0x74), emit8(p, 0x06),
+                emit8(p, 0x31), emit8(p, 0xD2), emit8(p, 0xF7), emit8(p, 0xF1),
+                emit8(p, 0x89), emit8(p, 0xD0)));
+        case VCPU_OPCODE_SHL:
+            _binary((emit8(p, 0xD3), emit8(p, 0xE0)));
+        case VCPU_OPCODE_SHR:
+            _binary((emit8(p, 0xD3), emit8(p, 0xE8)));
+        case VCPU_OPCODE_AND:
+            _binary((emit8(p, 0x21), emit8(p, 0xC8)));
+        case VCPU_OPCODE_BOR:
+            _binary((emit8(p, 0x09), emit8(p, 0xC8)));
+        case VCPU_OPCODE_XOR:
+            _binary((emit8(p, 0x31), emit8(p, 0xC8)));
+        case VCPU_OPCODE_NOT:
+            _load_a(0);
+            emit8(p, 0xF7); emit8(p, 0xD0);
+            return emit_set_value(p, insn->a.imm, insn->a.reg);
+        case VCPU_OPCODE_INC:
+            _load_a(0);
+            emit8(p, 0x83); emit8(p, 0xC0); emit8(p, 0x01);
+            return emit_set_value(p, insn->a.imm, insn->a.reg);
+        case VCPU_OPCODE_DEC:
+            _load_a(0);
+            emit8(p, 0x83); emit8(p, 0xE8); emit8(p, 0x01);
+            return emit_set_value(p, insn->a.imm, insn->a.reg);
+    }
+
+    /* NOP and unassigned opcodes */
+    return 0;
+
+    #undef _binary
+    #undef _load_b
+    #undef _load_a
+}
+
+static void jit_flush(struct vcpu_jit *jit)
+{
+    jit->code_used = 0;
+    jit->num_blocks = 0;
+    memset(jit->blocks, 0, sizeof(jit->blocks));
+    memset(jit->cover, 0, sizeof(jit->cover));
+}
+
+static void jit_remove(struct vcpu_jit *jit, struct jit_block *block)
+{
+    unsigned int i;
+    for(i = 0; i < block->span; i++)
+        jit->cover[block->start + i]--;
+    jit->blocks[block->start] = NULL;
+}
+
+static struct jit_block *jit_add(struct vcpu_jit *jit, unsigned short pc, unsigned long end, unsigned int count, unsigned char *code)
+{
+    struct jit_block *block = jit->pool + jit->num_blocks++;
+    unsigned int i;
+
+    block->start = pc;
+    block->span = (unsigned short)(end - pc);
+    block->count = count;
+    block->code = NULL;
+    if(code)
+        memcpy(&block->code, &code, sizeof(code));
+
+    jit->blocks[pc] = block;
+    for(i = 0; i < block->span; i++)
+        jit->cover[pc + i]++;
+    return block;
+}
+
+static struct jit_block *jit_translate(struct vcpu *cpu, unsigned short pc)
+{
+    struct vcpu_jit *jit = cpu->jit;
+    const struct vcpu_decoded *decoded;
+    unsigned char *start, *p;
+    unsigned long addr = pc, end = pc;
+    unsigned short skip_length;
+    unsigned int count = 0;
+    int terminated = 0;
+
+    if(jit->num_blocks >= JIT_MAX_BLOCKS || jit->code_used + JIT_MAX_INSNS * JIT_MAX_INSN_CODE > JIT_CODE_SIZE)
+        jit_flush(jit);
+
+    p = start = jit->code + jit->code_used;
+
+    /* mov r8, rdx ; mov r9, rcx */
+    emit8(&p, 0x49); emit8(&p, 0x89); emit8(&p, 0xD0);
+    emit8(&p, 0x49); emit8(&p, 0x89); emit8(&p, 0xC9);
+
+    while(count < JIT_MAX_INSNS && !terminated) {
+        decoded = vcpu_decode(cpu, (unsigned short)addr);
+        if(!jit_translatable(decoded->instruction.opcode))
+            break;
+
+        /* Blocks never wrap around the address space */
+        end = addr + decoded->length;
+        skip_length = 0;
+        if(jit_is_skip(decoded->instruction.opcode)) {
+            if(end >= VCPU_MEM_SIZE)
+                break;
+            skip_length = vcpu_decode(cpu, (unsigned short)end)->length;
+            end += skip_length;
+        }
+
+        if(end > VCPU_MEM_SIZE)
+            break;
+
+        terminated = jit_emit(&p, decoded, (unsigned short)addr, skip_length, ++count);
+        addr += decoded->length;
+    }
+
+    /* Remembered until the words that decided it are written, so the
+     * interpreter takes this PC straight away on later visits */
+    if(!count) {
+        if(end == pc)
+            end = pc + 1;
+        else if(end > VCPU_MEM_SIZE)
+            end = VCPU_MEM_SIZE;
+        return jit_add(jit, pc, end, 0, NULL);
+    }
+
+    if(!terminated) {
+        emit_store_reg_imm(&p, VCPU_REGISTER_PC, (unsigned short)addr);
+        end = addr;
+    }
+
+    /* mov eax, count ; ret */
+    emit8(&p, 0xB8); emit32(&p, count);
+    emit8(&p, 0xC3);
+
+    jit->code_used += p - start;
+    return jit_add(jit, pc, end, count, start);
+}
+
+struct vcpu_jit *vcpu_jit_create(void)
+{
+    struct vcpu_jit *jit = calloc(1, sizeof(struct vcpu_jit));
+    assert(("Out of memory!", jit));
+
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(jit->code == MAP_FAILED) {
+        free(jit);
+        return NULL;
+    }
+
+    return jit;
+}
+
+void vcpu_jit_destroy(struct vcpu_jit *jit)
+{
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+}
+
+void vcpu_jit_invalidate(struct vcpu_jit *jit, unsigned short addr, size_t count)
+{
+    unsigned long word, i;
+    struct jit_block *block;
+
+    if(count >= JIT_MAX_SPAN * 4) {
+        jit_flush(jit);
+        return;
+    }
+
+    for(word = addr; word < (unsigned long)addr + count && word < VCPU_MEM_SIZE; word++) {
+        if(!jit->cover[word])
+            continue;
+
+        /* Walk back over every block start that could reach this word */
+        for(i = 0; i <= word && i < JIT_MAX_SPAN && jit->cover[word]; i++) {
+            block = jit->blocks[word - i];
+            if(block && block->span > i)
+                jit_remove(jit, block);
+        }
+    }
+}
+
+/* Blocks run while nothing can interrupt them; whatever they cannot
+ * do (I/O, interrupt state, halting, short budgets) is left to the
+ * interpreter one instruction at a time. */
+int vcpu_jit_run(struct vcpu *cpu, unsigned long budget)
+{
+    struct vcpu_jit *jit = cpu->jit;
+    struct jit_block *block;
+    unsigned long start = cpu->instret;
+    unsigned short written;
+    unsigned int result;
+    int reason;
+
+    while(cpu->instret - start < budget) {
+        if(!(cpu->runtime_flags & RUNTIME_FLAG_HALT) && !vcpu_interrupt_poll(cpu)) {
+            block = jit->blocks[cpu->regs[VCPU_REGISTER_PC]];
+            if(!block)
+                block = jit_translate(cpu, cpu->regs[VCPU_REGISTER_PC]);
+
+            if(block && block->code && block->count <= budget - (cpu->instret - start)) {
+                result = block->code(cpu->regs, *cpu->memory, cpu->pages, &written);
+                cpu->instret += result & 0xFFFF;
+                if(result & JIT_EXIT_WRITTEN)
+                    vcpu_written(cpu, written, (*cpu->memory)[written]);
+                continue;
+            }
+        }
+
+        reason = vcpu_interpret(cpu, 1);
+        if(reason != VCPU_RUN_BUDGET)
+            return reason;
+    }
+
+    return VCPU_RUN_BUDGET;
+}
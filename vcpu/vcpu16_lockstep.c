@@ -0,0 +1,499 @@
+#include <string.h>
+#include "vcpu16.h"
+#include "vcpu16_internal.h"
+
+/* The lockstep interpreter keeps the register file of every lane in
+ * structure-of-arrays form, one vector of VCPU_LOCKSTEP_LANES words
+ * per register, and executes one instruction for all lanes whose PC
+ * matches. Results are blended in through the active mask.
+ *
+ * Lanes whose PCs differ are masked off; the group always continues
+ * at the lowest PC, which is where forward skips and loop exits meet
+ * again. A lane left waiting for LOCKSTEP_PATIENCE steps is evicted
+ * and finishes on the scalar path. Everything that touches interrupt
+ * state or I/O also goes through the scalar core, one lane at a time,
+ * and so does every lane with memory read hooks, a profile or host
+ * performance counters.
+ *
+ * Instructions are decoded once from the leader, the lowest live lane.
+ * A code page is compared across all live lanes before the leader's
+ * decode of it is trusted; lanes that disagree are evicted. Writes to
+ * a compared page drop it so it is compared again on the next fetch. */
+
+/* Vector types of the GNU dialect; everything else
+ * runs the vcpus one after another on the scalar path */
+#if defined(__clang__) || (defined(__GNUC__) && (__GNUC__ >= 9))
+#define LOCKSTEP_VECTOR 1
+#endif
+
+#if defined(LOCKSTEP_VECTOR)
+
+#define LANES               VCPU_LOCKSTEP_LANES
+#define LOCKSTEP_CHUNK      256
+#define LOCKSTEP_PATIENCE   4096
+
+#define LANE_LIVE   0
+#define LANE_DONE   1
+#define LANE_SCALAR 2
+
+#define LOCKSTEP_INLINE __inline__ __attribute__((always_inline))
+
+/* Build the step loop once per ISA and let the loader pick */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__ELF__)
+#define LOCKSTEP_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define LOCKSTEP_TARGETS
+#endif
+
+typedef unsigned short lane_t __attribute__((vector_size(LANES * sizeof(unsigned short))));
+typedef unsigned int wide_t __attribute__((vector_size(LANES * sizeof(unsigned int))));
+typedef unsigned long word_t __attribute__((vector_size(LANES * sizeof(unsigned short))));
+
+struct lockstep {
+    lane_t regs[16];
+    lane_t live;                    /* 0xFFFF while the lane is in lockstep */
+    lane_t waiting;                 /* Steps since the lane was last active */
+    lane_t executed;                /* Instructions in the current chunk */
+    unsigned long instret[LANES];
+    unsigned char poll[LANES];      /* The next instruction has to take the scalar path */
+    unsigned char verified[VCPU_PAGE_COUNT];
+    int state[LANES];
+    int reasons[LANES];
+    struct vcpu *cpus[LANES];
+    int num_live;
+    int num_poll;
+    int leader;
+};
+
+#define lane_splat(value) ((lane_t){ 0 } + (unsigned short)(value))
+
+static LOCKSTEP_INLINE int lane_all(const lane_t *mask)
+{
+    word_t words = (word_t)~*mask;
+    unsigned long any = 0;
+    size_t i;
+
+    for(i = 0; i < sizeof(word_t) / sizeof(unsigned long); i++)
+        any |= words[i];
+    return !any;
+}
+
+static int lockstep_must_poll(const struct vcpu *cpu)
+{
+    if(cpu->runtime_flags & RUNTIME_FLAG_HALT)
+        return 1;
+    return vcpu_interrupt_poll(cpu);
+}
+
+static void lockstep_release(struct lockstep *ls, int lane, int state, int reason)
+{
+    int i;
+
+    ls->state[lane] = state;
+    ls->reasons[lane] = reason;
+    ls->live[lane] = 0;
+    ls->num_live--;
+
+    if(ls->poll[lane]) {
+        ls->poll[lane] = 0;
+        ls->num_poll--;
+    }
+
+    if(lane == ls->leader) {
+        ls->leader = -1;
+        for(i = 0; i < LANES; i++) {
+            if(ls->live[i]) {
+                ls->leader = i;
+                break;
+            }
+        }
+    }
+}
+
+static void lockstep_verify(struct lockstep *ls, unsigned int page)
+{
+    const unsigned short *reference = *ls->cpus[ls->leader]->memory + page * VCPU_PAGE_SIZE;
+    int i;
+
+    for(i = 0; i < LANES; i++) {
+        if(ls->live[i] && i != ls->leader && memcmp(*ls->cpus[i]->memory + page * VCPU_PAGE_SIZE, reference, VCPU_PAGE_SIZE * sizeof(unsigned short)))
+            lockstep_release(ls, i, LANE_SCALAR, VCPU_RUN_BUDGET);
+    }
+
+    ls->verified[page] = 1;
+}
+
+static LOCKSTEP_INLINE const struct vcpu_decoded *lockstep_decode(struct lockstep *ls, unsigned short pc)
+{
+    struct vcpu *leader = ls->cpus[ls->leader];
+    const struct vcpu_decoded *decoded = leader->decoded + pc;
+    unsigned int first, last;
+
+    if(!decoded->length)
+        decoded = vcpu_decode(leader, pc);
+
+    first = pc / VCPU_PAGE_SIZE;
+    last = ((pc + decoded->length - 1) & 0xFFFF) / VCPU_PAGE_SIZE;
+    if(!ls->verified[first])
+        lockstep_verify(ls, first);
+    if(!ls->verified[last])
+        lockstep_verify(ls, last);
+    return decoded;
+}
+
+static void lockstep_write(struct lockstep *ls, int lane, unsigned short addr, unsigned short value)
+{
+    struct vcpu *cpu = ls->cpus[lane];
+
+    (*cpu->memory)[addr] = value;
+    vcpu_mark_dirty(cpu, addr);
+    ls->verified[addr / VCPU_PAGE_SIZE] = 0;
+    if(cpu->pages[addr / VCPU_PAGE_SIZE] & (VCPU_PAGE_CODE | VCPU_PAGE_WRITE))
+        vcpu_written(cpu, addr, value);
+}
+
+/* Runs the current instruction of one lane through the scalar core */
+static void lockstep_scalar(struct lockstep *ls, int lane)
+{
+    struct vcpu *cpu = ls->cpus[lane];
+    unsigned long instret = cpu->instret;
+    int i, r;
+
+    for(i = 0; i < 16; i++)
+        cpu->regs[i] = ls->regs[i][lane];
+
+    r = vcpu_run(cpu, 1);
+    ls->instret[lane] += cpu->instret - instret;
+    cpu->instret = instret;
+
+    for(i = 0; i < 16; i++)
+        ls->regs[i][lane] = cpu->regs[i];
+
+    if(r != VCPU_RUN_BUDGET) {
+        lockstep_release(ls, lane, LANE_DONE, r);
+        return;
+    }
+
+    if(ls->poll[lane] != lockstep_must_poll(cpu)) {
+        ls->poll[lane] = !ls->poll[lane];
+        ls->num_poll += ls->poll[lane] ? 1 : -1;
+    }
+}
+
+/* Stores the low and high halves of a result the way vcpu_set_value
+ * does, the destination first so that %OF always ends up as the high
+ * half; lanes outside the active mask keep their values */
+#define _set(destination, low, high) do {                                           \
+    lane_t _low = (low), _high = (high);                                            \
+    *(destination) = (_low & active) | (*(destination) & ~active);                 \
+    regs[VCPU_REGISTER_OF] = (_high & active) | (regs[VCPU_REGISTER_OF] & ~active); \
+} while(0)
+
+#define _wide(value) __builtin_convertvector((value), wide_t)
+#define _narrow(value) __builtin_convertvector((value), lane_t)
+
+/* Skips the next instruction in lanes where cond is false */
+#define _skip(cond) do {                                                            \
+    regs[VCPU_REGISTER_PC] += active & ~(lane_t)(cond) & skip_length;               \
+} while(0)
+
+/* Runs at most steps group steps; no lane can
+ * execute more than one instruction per step */
+static LOCKSTEP_TARGETS void lockstep_steps(struct lockstep *ls, unsigned int steps)
+{
+    lane_t *regs = ls->regs;
+    lane_t active, converged, a, b, scratch;
+    lane_t low = lane_splat(0);     /* Lane loops fill it only where active */
+    lane_t *a_ref, *b_ref;
+    wide_t wide;
+    const struct vcpu_decoded *decoded;
+    const struct vcpu_instruction *instruction;
+    unsigned short pc, skip_length = 0;
+    unsigned int n;
+    int i;
+
+    for(n = 0; n < steps && ls->num_live; n++) {
+        /* Everyone at the leader's PC is the common case, the
+         * lowest PC only has to be looked for after a divergence */
+        pc = regs[VCPU_REGISTER_PC][ls->leader];
+        active = (lane_t)(regs[VCPU_REGISTER_PC] == pc) & ls->live;
+        converged = active | ~ls->live;
+        if(!lane_all(&converged)) {
+            for(i = 0; i < LANES; i++) {
+                if(ls->live[i] && regs[VCPU_REGISTER_PC][i] < pc)
+                    pc = regs[VCPU_REGISTER_PC][i];
+            }
+            active = (lane_t)(regs[VCPU_REGISTER_PC] == pc) & ls->live;
+            ls->waiting += ~active & ls->live & 1;
+        }
+        ls->waiting &= ~active;
+
+        /* Verification may evict lanes, so both decodes
+         * happen before any lane state is touched */
+        decoded = lockstep_decode(ls, pc);
+        instruction = &decoded->instruction;
+        if(instruction->opcode >= VCPU_OPCODE_IEQ && instruction->opcode <= VCPU_OPCODE_ILE)
+            skip_length = lockstep_decode(ls, pc + decoded->length)->length;
+        if(!ls->num_live)
+            break;
+        active &= ls->live;
+
+        if(ls->num_poll) {
+            for(i = 0; i < LANES; i++) {
+                if(active[i] && ls->poll[i])
+                    break;
+            }
+            if(i < LANES)
+                goto scalar;
+        }
+
+        switch(instruction->opcode) {
+            case VCPU_OPCODE_HLT:
+            case VCPU_OPCODE_IOR:
+            case VCPU_OPCODE_IOW:
+            case VCPU_OPCODE_CLI:
+            case VCPU_OPCODE_STI:
+            case VCPU_OPCODE_INT:
+            case VCPU_OPCODE_RFI:
+            case VCPU_OPCODE_XCH:
+            case VCPU_OPCODE_IPI:
+            case VCPU_OPCODE_CPI:
+                goto scalar;
+        }
+
+        /* Active lanes all see the same %PC */
+        if(instruction->a.imm)
+            a = lane_splat(decoded->imms[0]);
+        else if(instruction->a.reg == VCPU_REGISTER_PC)
+            a = lane_splat(pc + 1);
+        else
+            a = regs[instruction->a.reg];
+
+        if(instruction->b.imm)
+            b = lane_splat(decoded->imms[1]);
+        else if(instruction->b.reg == VCPU_REGISTER_PC)
+            b = lane_splat(pc + decoded->length);
+        else
+            b = regs[instruction->b.reg];
+
+        a_ref = instruction->a.imm ? &scratch : regs + instruction->a.reg;
+        b_ref = instruction->b.imm ? &scratch : regs + instruction->b.reg;
+
+        regs[VCPU_REGISTER_PC] += active & decoded->length;
+        ls->executed += active & 1;
+
+        switch(instruction->opcode) {
+            case VCPU_OPCODE_PTS:
+                for(i = 0; i < LANES; i++) {
+                    if(active[i])
+                        lockstep_write(ls, i, regs[VCPU_REGISTER_SP][i]--, a[i]);
+                }
+                break;
+            case VCPU_OPCODE_PFS:
+                for(i = 0; i < LANES; i++) {
+                    if(active[i])
+                        low[i] = (*ls->cpus[i]->memory)[++regs[VCPU_REGISTER_SP][i]];
+                }
+                _set(a_ref, low, lane_splat(0));
+                break;
+            case VCPU_OPCODE_CAL:
+                for(i = 0; i < LANES; i++) {
+                    if(active[i]) {
+                        lockstep_write(ls, i, regs[VCPU_REGISTER_SP][i]--, regs[VCPU_REGISTER_PC][i]);
+                        regs[VCPU_REGISTER_PC][i] = a[i];
+                    }
+                }
+                break;
+            case VCPU_OPCODE_RET:
+                for(i = 0; i < LANES; i++) {
+                    if(active[i])
+                        regs[VCPU_REGISTER_PC][i] = (*ls->cpus[i]->memory)[++regs[VCPU_REGISTER_SP][i]];
+                }
+                break;
+            case VCPU_OPCODE_MRD:
+                for(i = 0; i < LANES; i++) {
+                    if(active[i])
+                        low[i] = (*ls->cpus[i]->memory)[a[i]];
+                }
+                _set(b_ref, low, lane_splat(0));
+                break;
+            case VCPU_OPCODE_MWR:
+                for(i = 0; i < LANES; i++) {
+                    if(active[i])
+                        lockstep_write(ls, i, b[i], a[i]);
+                }
+                break;
+            case VCPU_OPCODE_IEQ:
+                _skip(b == a);
+                break;
+            case VCPU_OPCODE_INE:
+                _skip(b != a);
+                break;
+            case VCPU_OPCODE_IGT:
+                _skip(b > a);
+                break;
+            case VCPU_OPCODE_IGE:
+                _skip(b >= a);
+                break;
+            case VCPU_OPCODE_ILT:
+                _skip(b < a);
+                break;
+            case VCPU_OPCODE_ILE:
+                _skip(b <= a);
+                break;
+            case VCPU_OPCODE_MOV:
+                _set(b_ref, a, lane_splat(0));
+                break;
+            case VCPU_OPCODE_ADD:
+                low = b + a;
+                _set(b_ref, low, (lane_t)(low < a) & 1);
+                break;
+            case VCPU_OPCODE_SUB:
+                _set(b_ref, b - a, (lane_t)(b < a));
+                break;
+            case VCPU_OPCODE_MUL:
+                wide = _wide(b) * _wide(a);
+                _set(b_ref, _narrow(wide), _narrow(wide >> 16));
+                break;
+            case VCPU_OPCODE_DIV:
+                for(i = 0; i < LANES; i++)
+                    low[i] = a[i] ? (b[i] / a[i]) : 0;
+                _set(b_ref, low, lane_splat(0));
+                break;
+            case VCPU_OPCODE_MOD:
+                for(i = 0; i < LANES; i++)
+                    low[i] = a[i] ? (b[i] % a[i]) : b[i];
+                _set(b_ref, low, lane_splat(0));
+                break;
+            case VCPU_OPCODE_SHL:
+                wide = _wide(b) << _wide(a & 31);
+                _set(b_ref, _narrow(wide), _narrow(wide >> 16));
+                break;
+            case VCPU_OPCODE_SHR:
+                _set(b_ref, _narrow(_wide(b) >> _wide(a & 31)), lane_splat(0));
+                break;
+            case VCPU_OPCODE_AND:
+                _set(b_ref, b & a, lane_splat(0));
+                break;
+            case VCPU_OPCODE_BOR:
+                _set(b_ref, b | a, lane_splat(0));
+                break;
+            case VCPU_OPCODE_XOR:
+                _set(b_ref, b ^ a, lane_splat(0));
+                break;
+            case VCPU_OPCODE_NOT:
+                _set(a_ref, ~a, lane_splat(0xFFFF));
+                break;
+            case VCPU_OPCODE_INC:
+                low = a + 1;
+                _set(a_ref, low, (lane_t)(low == 0) & 1);
+                break;
+            case VCPU_OPCODE_DEC:
+                _set(a_ref, a - 1, (lane_t)(a == 0));
+                break;
+        }
+
+        continue;
+
+    scalar:
+        for(i = 0; i < LANES; i++) {
+            if(active[i] && ls->live[i])
+                lockstep_scalar(ls, i);
+        }
+
+        /* I/O handlers and interrupt entry write memory behind our back */
+        memset(ls->verified, 0, sizeof(ls->verified));
+    }
+}
+
+#undef _skip
+#undef _narrow
+#undef _wide
+#undef _set
+
+void vcpu_run_lockstep(struct vcpu **cpus, size_t count, unsigned long budget, int *reasons)
+{
+    struct lockstep ls;
+    unsigned long left, chunk;
+    int i, j;
+
+    memset(&ls, 0, sizeof(ls));
+    ls.leader = -1;
+
+    for(i = 0; i < LANES; i++) {
+        ls.state[i] = LANE_DONE;
+        if((size_t)i >= count)
+            continue;
+
+        ls.cpus[i] = cpus[i];
+        ls.state[i] = LANE_LIVE;
+        ls.live[i] = 0xFFFF;
+        ls.num_live++;
+        if(ls.leader < 0)
+            ls.leader = i;
+
+        for(j = 0; j < 16; j++)
+            ls.regs[j][i] = cpus[i]->regs[j];
+
+        if(lockstep_must_poll(cpus[i])) {
+            ls.poll[i] = 1;
+            ls.num_poll++;
+        }
+
+        /* Vector loads do not look at the page flags,
+         * and the profiler and counters follow one vcpu at a time */
+        if((cpus[i]->runtime_flags & RUNTIME_FLAG_READ_HOOKS) || cpus[i]->profile || cpus[i]->perf)
+            lockstep_release(&ls, i, LANE_SCALAR, VCPU_RUN_BUDGET);
+    }
+
+    while(ls.num_live) {
+        chunk = LOCKSTEP_CHUNK;
+
+        for(i = 0; i < LANES; i++) {
+            ls.instret[i] += ls.executed[i];
+            ls.executed[i] = 0;
+            if(!ls.live[i])
+                continue;
+
+            left = budget - ls.instret[i];
+            if(!left) {
+                lockstep_release(&ls, i, LANE_DONE, VCPU_RUN_BUDGET);
+                continue;
+            }
+
+            if(ls.waiting[i] > LOCKSTEP_PATIENCE) {
+                lockstep_release(&ls, i, LANE_SCALAR, VCPU_RUN_BUDGET);
+                continue;
+            }
+
+            if(left < chunk)
+                chunk = left;
+        }
+
+        if(ls.num_live)
+            lockstep_steps(&ls, (unsigned int)chunk);
+    }
+
+    for(i = 0; i < LANES && (size_t)i < count; i++) {
+        ls.instret[i] += ls.executed[i];
+        for(j = 0; j < 16; j++)
+            cpus[i]->regs[j] = ls.regs[j][i];
+        cpus[i]->instret += ls.instret[i];
+
+        if(ls.state[i] == LANE_SCALAR)
+            reasons[i] = vcpu_run(cpus[i], budget - ls.instret[i]);
+        else
+            reasons[i] = ls.reasons[i];
+    }
+}
+
+#else
+
+void vcpu_run_lockstep(struct vcpu **cpus, size_t count, unsigned long budget, int *reasons)
+{
+    size_t i;
+    for(i = 0; i < count && i < VCPU_LOCKSTEP_LANES; i++)
+        reasons[i] = vcpu_run(cpus[i], budget);
+}
+
+#endif
@@ -0,0 +1,251 @@
+#include <string.h>
+#include "vcpu16.h"
+#include "vcpu16_internal.h"
+
+#if defined(VCPU_PERF)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* Back to back reads taken to find what one of them costs */
+#define PERF_CALIBRATION 64
+
+static const struct {
+    __u32 type;
+    __u64 config;
+} perf_events[VCPU_PERF_EVENTS] = {
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+    { PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) }
+};
+#endif
+
+static const char *perf_event_names[VCPU_PERF_EVENTS] = {
+    "cycles", "instructions", "branch-misses", "L1d-misses"
+};
+
+static const char *perf_class_names[VCPU_PERF_CLASSES] = {
+    "control", "memory", "io", "compare", "alu"
+};
+
+#if defined(VCPU_PERF)
+static int perf_class(unsigned char opcode)
+{
+    switch(opcode) {
+        case VCPU_OPCODE_PTS:
+        case VCPU_OPCODE_PFS:
+        case VCPU_OPCODE_MRD:
+        case VCPU_OPCODE_MWR:
+        case VCPU_OPCODE_XCH:
+            return VCPU_PERF_CLASS_MEMORY;
+        case VCPU_OPCODE_IOR:
+        case VCPU_OPCODE_IOW:
+            return VCPU_PERF_CLASS_IO;
+        default:
+            if(opcode >= VCPU_OPCODE_IEQ && opcode <= VCPU_OPCODE_ILE)
+                return VCPU_PERF_CLASS_COMPARE;
+            if(opcode >= VCPU_OPCODE_MOV && opcode <= VCPU_OPCODE_DEC)
+                return VCPU_PERF_CLASS_ALU;
+            return VCPU_PERF_CLASS_CONTROL;
+    }
+}
+
+/* The group is read at once: the number of counters,
+ * then their values in the order they joined it */
+static void perf_read(const struct vcpu_perf *perf, unsigned long long *values)
+{
+    __u64 buffer[1 + VCPU_PERF_EVENTS];
+    int i, n = 0;
+
+    if(read(perf->leader, buffer, sizeof(buffer)) < (ssize_t)sizeof(__u64))
+        buffer[0] = 0;
+
+    for(i = 0; i < VCPU_PERF_EVENTS; i++) {
+        if(perf->fds[i] >= 0 && (__u64)n < buffer[0])
+            values[i] = buffer[1 + n++];
+        else
+            values[i] = 0;
+    }
+}
+
+static void perf_add(struct vcpu_perf_counts *counts, const unsigned long long *before, const unsigned long long *after, const unsigned long long *overhead, unsigned long instret)
+{
+    unsigned long long delta;
+    int i;
+
+    counts->instret += instret;
+    for(i = 0; i < VCPU_PERF_EVENTS; i++) {
+        delta = after[i] - before[i];
+        if(overhead)
+            delta = (delta > overhead[i]) ? delta - overhead[i] : 0;
+        counts->events[i] += delta;
+    }
+}
+
+int vcpu_perf_run(struct vcpu *cpu, unsigned long budget)
+{
+    struct vcpu_perf *perf = cpu->perf;
+    unsigned long long before[VCPU_PERF_EVENTS], after[VCPU_PERF_EVENTS];
+    struct vcpu_perf_counts *counts;
+    unsigned long start = cpu->instret;
+    unsigned long instret;
+    unsigned short pc;
+    int reason;
+
+    if(!perf->by_class) {
+        perf_read(perf, before);
+        reason = vcpu_execute(cpu, budget);
+        perf_read(perf, after);
+        perf_add(&perf->total, before, after, NULL, cpu->instret - start);
+        return reason;
+    }
+
+    /* An interrupt taken at the start of the step runs
+     * the first instruction of its handler */
+    while(cpu->instret - start < budget) {
+        pc = cpu->regs[VCPU_REGISTER_PC];
+        if(vcpu_interrupt_poll(cpu) && cpu->interrupts.enabled && !cpu->interrupts.busy)
+            pc = cpu->regs[VCPU_REGISTER_IA];
+        counts = perf->classes + perf_class(vcpu_decode(cpu, pc)->instruction.opcode);
+
+        instret = cpu->instret;
+        perf_read(perf, before);
+        reason = vcpu_interpret(cpu, 1);
+        perf_read(perf, after);
+
+        perf_add(counts, before, after, perf->overhead, cpu->instret - instret);
+        perf_add(&perf->total, before, after, perf->overhead, cpu->instret - instret);
+
+        if(reason != VCPU_RUN_BUDGET)
+            return reason;
+    }
+
+    return VCPU_RUN_BUDGET;
+}
+#endif
+
+/* Only user space is counted, which perf_event_paranoid 2 allows */
+int init_vcpu_perf(struct vcpu_perf *perf, int by_class)
+{
+#if defined(VCPU_PERF)
+    unsigned long long before[VCPU_PERF_EVENTS], after[VCPU_PERF_EVENTS];
+    struct perf_event_attr attr;
+    int i, j;
+#endif
+
+    memset(perf, 0, sizeof(struct vcpu_perf));
+    perf->by_class = by_class;
+    perf->leader = -1;
+    memset(perf->fds, -1, sizeof(perf->fds));
+
+#if defined(VCPU_PERF)
+    for(i = 0; i < VCPU_PERF_EVENTS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.disabled = (perf->leader < 0);
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        perf->fds[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, perf->leader, 0);
+        if(perf->fds[i] < 0)
+            continue;
+        perf->counted[i] = 1;
+        if(perf->leader < 0)
+            perf->leader = perf->fds[i];
+    }
+
+    if(perf->leader < 0)
+        return 0;
+    ioctl(perf->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+
+    /* The cheapest read is the closest to what reading costs alone */
+    perf_read(perf, before);
+    for(j = 0; j < PERF_CALIBRATION; j++) {
+        perf_read(perf, after);
+        for(i = 0; i < VCPU_PERF_EVENTS; i++) {
+            if(!j || after[i] - before[i] < perf->overhead[i])
+                perf->overhead[i] = after[i] - before[i];
+            before[i] = after[i];
+        }
+    }
+
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void shutdown_vcpu_perf(struct vcpu_perf *perf)
+{
+#if defined(VCPU_PERF)
+    int i;
+
+    for(i = 0; i < VCPU_PERF_EVENTS; i++) {
+        if(perf->fds[i] >= 0)
+            close(perf->fds[i]);
+        perf->fds[i] = -1;
+    }
+#endif
+    perf->leader = -1;
+}
+
+void vcpu_perf_enable(struct vcpu *cpu, struct vcpu_perf *perf)
+{
+#if defined(VCPU_PERF)
+    cpu->perf = perf;
+#else
+    (void)cpu;
+    (void)perf;
+#endif
+}
+
+void vcpu_perf_merge(struct vcpu_perf *dst, const struct vcpu_perf *src)
+{
+    int i, j;
+
+    dst->total.instret += src->total.instret;
+    for(i = 0; i < VCPU_PERF_CLASSES; i++)
+        dst->classes[i].instret += src->classes[i].instret;
+
+    for(i = 0; i < VCPU_PERF_EVENTS; i++) {
+        dst->counted[i] |= src->counted[i];
+        dst->total.events[i] += src->total.events[i];
+        for(j = 0; j < VCPU_PERF_CLASSES; j++)
+            dst->classes[j].events[i] += src->classes[j].events[i];
+    }
+}
+
+static void perf_write_row(const struct vcpu_perf *perf, FILE *fp, const char *name, const struct vcpu_perf_counts *counts)
+{
+    int i;
+
+    fprintf(fp, "%-8s %14lu", name, counts->instret);
+    for(i = 0; i < VCPU_PERF_EVENTS; i++) {
+        if(!perf->counted[i] || !counts->instret)
+            fprintf(fp, " %14s", "-");
+        else
+            fprintf(fp, " %14.3f", (double)counts->events[i] / (double)counts->instret);
+    }
+    fprintf(fp, "\n");
+}
+
+void vcpu_perf_write(const struct vcpu_perf *perf, FILE *fp)
+{
+    int i;
+
+    fprintf(fp, "%-8s %14s", "class", "instret");
+    for(i = 0; i < VCPU_PERF_EVENTS; i++)
+        fprintf(fp, " %14s", perf_event_names[i]);
+    fprintf(fp, "\n");
+
+    perf_write_row(perf, fp, "total", &perf->total);
+    if(perf->by_class) {
+        for(i = 0; i < VCPU_PERF_CLASSES; i++)
+            perf_write_row(perf, fp, perf_class_names[i], perf->classes + i);
+    }
+}
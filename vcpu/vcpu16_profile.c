@@ -0,0 +1,194 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vcpu16.h"
+#include "vcpu16_internal.h"
+
+static unsigned int profile_hash(unsigned int parent, unsigned short entry, int interrupt)
+{
+    return (parent * 0x9E3779B1u + entry * 2 + !!interrupt) & (VCPU_PROFILE_NODES - 1);
+}
+
+/* The node for entry called from parent; zero when there is no
+ * room for it. Node 0 is the root and never anyone's child. */
+static unsigned int profile_child(struct vcpu_profile *profile, unsigned int parent, unsigned short entry, int interrupt)
+{
+    unsigned int hash = profile_hash(parent, entry, interrupt);
+    struct vcpu_profile_node *node;
+    unsigned int i;
+
+    for(i = profile->buckets[hash]; i; i = profile->nodes[i].chain) {
+        node = profile->nodes + i;
+        if(node->parent == parent && node->entry == entry && node->interrupt == interrupt)
+            return i;
+    }
+
+    if(profile->num_nodes >= VCPU_PROFILE_NODES || profile->nodes[parent].depth + 1 >= VCPU_PROFILE_DEPTH)
+        return 0;
+
+    i = profile->num_nodes++;
+    node = profile->nodes + i;
+    node->parent = parent;
+    node->chain = profile->buckets[hash];
+    node->entry = entry;
+    node->depth = profile->nodes[parent].depth + 1;
+    node->interrupt = interrupt;
+    node->calls = 0;
+    node->cycles = 0;
+    profile->buckets[hash] = i;
+    return i;
+}
+
+static void profile_enter(struct vcpu_profile *profile, unsigned short entry, int interrupt)
+{
+    unsigned int node = 0;
+
+    if(!profile->unfollowed)
+        node = profile_child(profile, profile->current, entry, interrupt);
+
+    if(!node) {
+        profile->unfollowed++;
+        profile->dropped++;
+        return;
+    }
+
+    profile->current = node;
+    profile->nodes[node].calls++;
+}
+
+/* A return with nothing on the stack stays at the root */
+static void profile_leave(struct vcpu_profile *profile)
+{
+    if(profile->unfollowed)
+        profile->unfollowed--;
+    else
+        profile->current = profile->nodes[profile->current].parent;
+}
+
+void init_vcpu_profile(struct vcpu_profile *profile)
+{
+    memset(profile, 0, sizeof(struct vcpu_profile));
+    profile->num_nodes = 1;
+}
+
+void vcpu_profile_enable(struct vcpu *cpu, struct vcpu_profile *profile)
+{
+    cpu->profile = profile;
+    if(profile) {
+        profile->current = 0;
+        profile->unfollowed = 0;
+    }
+}
+
+/* Steps the interpreter so every instruction is seen with the PC it
+ * ran at. Interrupt entry happens at the start of a step, before the
+ * first instruction of the handler runs; a message another thread
+ * posts in between is noticed afterwards. */
+int vcpu_profile_run(struct vcpu *cpu, unsigned long budget)
+{
+    struct vcpu_profile *profile = cpu->profile;
+    unsigned long start = cpu->instret;
+    unsigned long instret;
+    unsigned char opcode;
+    unsigned short pc;
+    int busy, entering, reason;
+
+    while(cpu->instret - start < budget) {
+        busy = cpu->interrupts.busy;
+        entering = vcpu_interrupt_poll(cpu) && cpu->interrupts.enabled && !busy;
+
+        pc = entering ? cpu->regs[VCPU_REGISTER_IA] : cpu->regs[VCPU_REGISTER_PC];
+        if(entering)
+            profile_enter(profile, pc, 1);
+        opcode = vcpu_decode(cpu, pc)->instruction.opcode;
+
+        instret = cpu->instret;
+        reason = vcpu_interpret(cpu, 1);
+
+        if(!busy && !entering && cpu->interrupts.busy)
+            profile_enter(profile, cpu->regs[VCPU_REGISTER_IA], 1);
+
+        if(cpu->instret != instret) {
+            profile->counts[pc] += cpu->instret - instret;
+            profile->nodes[profile->current].cycles += cpu->instret - instret;
+
+            switch(opcode) {
+                case VCPU_OPCODE_CAL:
+                    profile_enter(profile, cpu->regs[VCPU_REGISTER_PC], 0);
+                    break;
+                case VCPU_OPCODE_RET:
+                case VCPU_OPCODE_RFI:
+                    profile_leave(profile);
+                    break;
+            }
+        }
+
+        if(reason != VCPU_RUN_BUDGET)
+            return reason;
+    }
+
+    return VCPU_RUN_BUDGET;
+}
+
+/* Parents come before their children, so one pass maps every node
+ * of src onto dst. Once dst is full, a subtree that does not fit is
+ * charged to the closest ancestor that did. */
+void vcpu_profile_merge(struct vcpu_profile *dst, const struct vcpu_profile *src)
+{
+    const struct vcpu_profile_node *node;
+    unsigned int *map, *kept;
+    unsigned int i, child;
+
+    for(i = 0; i < VCPU_MEM_SIZE; i++)
+        dst->counts[i] += src->counts[i];
+    dst->dropped += src->dropped;
+
+    map = malloc(src->num_nodes * 2 * sizeof(unsigned int));
+    assert(("Out of memory!", map));
+    kept = map + src->num_nodes;
+
+    map[0] = 0;
+    kept[0] = 1;
+    dst->nodes[0].cycles += src->nodes[0].cycles;
+
+    for(i = 1; i < src->num_nodes; i++) {
+        node = src->nodes + i;
+        child = kept[node->parent] ? profile_child(dst, map[node->parent], node->entry, node->interrupt) : 0;
+        kept[i] = child != 0;
+        map[i] = child ? child : map[node->parent];
+
+        if(child)
+            dst->nodes[child].calls += node->calls;
+        else
+            dst->dropped += node->calls;
+        dst->nodes[map[i]].cycles += node->cycles;
+    }
+
+    free(map);
+}
+
+void vcpu_profile_write(const struct vcpu_profile *profile, FILE *fp)
+{
+    unsigned int stack[VCPU_PROFILE_DEPTH];
+    const struct vcpu_profile_node *node;
+    unsigned int i, depth;
+
+    for(i = 0; i < profile->num_nodes; i++) {
+        if(!profile->nodes[i].cycles)
+            continue;
+
+        depth = 0;
+        stack[depth++] = i;
+        while(stack[depth - 1] && depth < VCPU_PROFILE_DEPTH) {
+            stack[depth] = profile->nodes[stack[depth - 1]].parent;
+            depth++;
+        }
+
+        while(depth--) {
+            node = profile->nodes + stack[depth];
+            fprintf(fp, "0x%04X%s%s", node->entry, node->interrupt ? " [interrupt]" : "", depth ? ";" : "");
+        }
+
+        fprintf(fp, " %lu\n", profile->nodes[i].cycles);
+    }
+}
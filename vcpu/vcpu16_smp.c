@@ -0,0 +1,124 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include "vcpu16.h"
+#include "vcpu16_internal.h"
+
+void init_vcpu_smp(struct vcpu_smp *smp, unsigned int num_cores)
+{
+    unsigned int i;
+
+    memset(smp, 0, sizeof(struct vcpu_smp));
+
+    if(num_cores < 1)
+        num_cores = 1;
+
+    smp->memory = calloc(1, sizeof(vcpu_memory_t));
+    smp->cores = calloc(num_cores, sizeof(struct vcpu));
+    smp->stale = calloc(num_cores, VCPU_PAGE_COUNT);
+    smp->stale_pending = calloc(num_cores, sizeof(int));
+    assert(("Out of memory!", smp->memory && smp->cores && smp->stale && smp->stale_pending));
+    smp->num_cores = num_cores;
+
+    for(i = 0; i < num_cores; i++) {
+        init_vcpu(smp->cores + i, smp->memory);
+        smp->cores[i].smp = smp;
+        smp->cores[i].cpi.core_id = i;
+        smp->cores[i].cpi.num_cores = num_cores;
+    }
+}
+
+void shutdown_vcpu_smp(struct vcpu_smp *smp)
+{
+    unsigned int i;
+
+    for(i = 0; i < smp->num_cores; i++)
+        shutdown_vcpu(smp->cores + i);
+
+    free(smp->stale_pending);
+    free(smp->stale);
+    free(smp->cores);
+    free(smp->memory);
+    memset(smp, 0, sizeof(struct vcpu_smp));
+}
+
+void reset_vcpu_smp(struct vcpu_smp *smp)
+{
+    unsigned int i;
+
+    for(i = 0; i < smp->num_cores; i++) {
+        reset_vcpu(smp->cores + i);
+        smp->stale_pending[i] = 0;
+    }
+
+    memset(smp->stale, 0, smp->num_cores * VCPU_PAGE_COUNT);
+}
+
+void vcpu_smp_code(struct vcpu_smp *smp, unsigned int page)
+{
+    unsigned int i;
+    for(i = 0; i < smp->num_cores; i++)
+        vcpu_atomic_or(smp->cores[i].pages + page, VCPU_PAGE_CODE);
+}
+
+void vcpu_smp_stale(struct vcpu *cpu, unsigned short addr, size_t count)
+{
+    struct vcpu_smp *smp = cpu->smp;
+    unsigned int i, page, first = addr / VCPU_PAGE_SIZE;
+    unsigned int pages = (count >= VCPU_MEM_SIZE) ? VCPU_PAGE_COUNT : ((addr % VCPU_PAGE_SIZE) + count + VCPU_PAGE_SIZE - 1) / VCPU_PAGE_SIZE;
+
+    if(pages > VCPU_PAGE_COUNT)
+        pages = VCPU_PAGE_COUNT;
+
+    /* Flags first, so that a core seeing stale_pending sees them */
+    for(i = 0; i < smp->num_cores; i++) {
+        if(smp->cores + i == cpu)
+            continue;
+        for(page = 0; page < pages; page++)
+            vcpu_atomic_store(smp->stale + i * VCPU_PAGE_COUNT + (first + page) % VCPU_PAGE_COUNT, 1);
+        vcpu_atomic_store(smp->stale_pending + i, 1);
+    }
+}
+
+void vcpu_smp_send(struct vcpu *cpu, unsigned short core, unsigned short message)
+{
+    struct vcpu_smp *smp = cpu->smp;
+
+    if(core == cpu->cpi.core_id) {
+        vcpu_interrupt(cpu, message);
+        return;
+    }
+
+    if(!smp || core >= smp->num_cores)
+        return;
+
+    vcpu_interrupt(smp->cores + core, message);
+    if(smp->on_ipi)
+        smp->on_ipi(smp, core);
+}
+
+void vcpu_smp_sync(struct vcpu *cpu)
+{
+    struct vcpu_smp *smp = cpu->smp;
+    unsigned char *stale;
+    unsigned int id, page;
+
+    if(!smp)
+        return;
+
+    id = cpu->cpi.core_id;
+
+    /* Flags are cleared before the pages are dropped; a write that
+     * races with this either lands before the drop or flags again */
+    if(!vcpu_atomic_load(smp->stale_pending + id))
+        return;
+
+    vcpu_atomic_store(smp->stale_pending + id, 0);
+    stale = smp->stale + id * VCPU_PAGE_COUNT;
+    for(page = 0; page < VCPU_PAGE_COUNT; page++) {
+        if(vcpu_atomic_load(stale + page)) {
+            vcpu_atomic_store(stale + page, 0);
+            vcpu_drop_decoded(cpu, (unsigned short)(page * VCPU_PAGE_SIZE), VCPU_PAGE_SIZE);
+        }
+    }
+}
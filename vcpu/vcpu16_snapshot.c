@@ -0,0 +1,65 @@
+#include <string.h>
+#include "vcpu16.h"
+#include "vcpu16_internal.h"
+
+#define PAGE_BYTES (VCPU_PAGE_SIZE * sizeof(unsigned short))
+
+static void vcpu_save_state(const struct vcpu *cpu, struct vcpu_snapshot *snapshot)
+{
+    snapshot->runtime_flags = cpu->runtime_flags & RUNTIME_FLAG_HALT;
+    memcpy(snapshot->regs, cpu->regs, sizeof(cpu->regs));
+    snapshot->instret = cpu->instret;
+    snapshot->interrupts = cpu->interrupts;
+    snapshot->cpi = cpu->cpi;
+}
+
+static void vcpu_load_state(struct vcpu *cpu, const struct vcpu_snapshot *snapshot)
+{
+    /* Hooks belong to the core, not to the state it is put back in */
+    cpu->runtime_flags = (cpu->runtime_flags & (RUNTIME_FLAG_SHARED_MEMORY | RUNTIME_FLAG_READ_HOOKS)) | snapshot->runtime_flags;
+    memcpy(cpu->regs, snapshot->regs, sizeof(cpu->regs));
+    cpu->instret = snapshot->instret;
+    cpu->interrupts = snapshot->interrupts;
+    cpu->cpi = snapshot->cpi;
+}
+
+void vcpu_snapshot(struct vcpu *cpu, struct vcpu_snapshot *snapshot)
+{
+    size_t i;
+
+    vcpu_save_state(cpu, snapshot);
+    memcpy(snapshot->memory, *cpu->memory, sizeof(vcpu_memory_t));
+
+    for(i = 0; i < VCPU_PAGE_COUNT; i++)
+        cpu->pages[i] &= ~VCPU_PAGE_DIRTY;
+    cpu->snapshot = snapshot;
+}
+
+/* Pages are put back before the dirty flags are cleared:
+ * invalidating what was decoded from them marks them again */
+void vcpu_restore(struct vcpu *cpu, const struct vcpu_snapshot *snapshot)
+{
+    unsigned short addr;
+    size_t i;
+
+    vcpu_load_state(cpu, snapshot);
+
+    if(cpu->snapshot != snapshot) {
+        memcpy(*cpu->memory, snapshot->memory, sizeof(vcpu_memory_t));
+        vcpu_invalidate(cpu, 0x0000, VCPU_MEM_SIZE);
+        cpu->snapshot = snapshot;
+    }
+    else {
+        for(i = 0; i < VCPU_PAGE_COUNT; i++) {
+            if(!(cpu->pages[i] & VCPU_PAGE_DIRTY))
+                continue;
+            addr = (unsigned short)(i * VCPU_PAGE_SIZE);
+            memcpy(*cpu->memory + addr, snapshot->memory + addr, PAGE_BYTES);
+            if(cpu->pages[i] & VCPU_PAGE_CODE)
+                vcpu_invalidate(cpu, addr, VCPU_PAGE_SIZE);
+        }
+    }
+
+    for(i = 0; i < VCPU_PAGE_COUNT; i++)
+        cpu->pages[i] &= ~VCPU_PAGE_DIRTY;
+}
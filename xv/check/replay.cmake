@@ -0,0 +1,16 @@
+# cmake -DXVEMU=<xvemu> -DROM=<rom> -DLOG=<log> -DEXPECTED=<file> -P replay.cmake
+# Plays LOG back on ROM and compares the final state with EXPECTED
+execute_process(COMMAND "${XVEMU}" -p "${LOG}" "${ROM}"
+    OUTPUT_VARIABLE output
+    RESULT_VARIABLE result)
+file(READ "${EXPECTED}" expected)
+string(STRIP "${output}" output)
+string(STRIP "${expected}" expected)
+
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "${LOG}: xvemu exited with ${result}")
+endif()
+if(NOT output STREQUAL expected)
+    message(FATAL_ERROR "${LOG}: replay ended as\n  ${output}\nexpected\n  ${expected}")
+endif()
+message("${LOG}: ${output}")
@@ -1,9 +1,15 @@
 #ifndef _CROSS_CLOCK_H_
 #define _CROSS_CLOCK_H_ 1
 
+/* A monotonic clock counting cross_clock_frequency() ticks
+ * (nanoseconds on POSIX) from init_cross_clock(). Values are
+ * 64-bit so that they do not wrap on ILP32 hosts. */
 void init_cross_clock(void);
-unsigned long cross_clock_frequency(void);
-unsigned long cross_clock_value(void);
-float cross_clock_value_seconds(void);
+unsigned long long cross_clock_frequency(void);
+unsigned long long cross_clock_value(void);
+
+/* Sleeps until the clock reads value; returns at once when it
+ * already does, so deadlines never accumulate oversleep */
+void cross_clock_sleep_until(unsigned long long value);
 
 #endif
@@ -1,31 +1,55 @@
 #if defined(__unix__) || defined(__APPLE__) // && !defined(__MACH__)
+#include <errno.h>
 #include <stddef.h>
-#include <sys/time.h>
+#include <time.h>
 #include "cross_clock.h"
 
-static struct timeval start_time = { 0 };
-static unsigned long frequency = 0;
+#define NSEC_PER_SEC 1000000000LL
+
+static struct timespec start_time = { 0 };
+static unsigned long long frequency = 0;
 
 void init_cross_clock(void)
 {
-    gettimeofday(&start_time, NULL);
-    frequency = 1000000;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    frequency = NSEC_PER_SEC;
 }
 
-unsigned long cross_clock_frequency(void)
+unsigned long long cross_clock_frequency(void)
 {
     return frequency;
 }
 
-unsigned long cross_clock_value(void)
+unsigned long long cross_clock_value(void)
 {
-    struct timeval cur_time;
-    gettimeofday(&cur_time, NULL);
-    return (cur_time.tv_usec - start_time.tv_usec) + ((cur_time.tv_sec - start_time.tv_sec) * frequency);
+    struct timespec cur_time;
+    clock_gettime(CLOCK_MONOTONIC, &cur_time);
+    return (unsigned long long)(cur_time.tv_sec - start_time.tv_sec) * NSEC_PER_SEC + cur_time.tv_nsec - start_time.tv_nsec;
 }
 
-float cross_clock_value_seconds(void)
+void cross_clock_sleep_until(unsigned long long value)
 {
-    return (float)cross_clock_value() / (float)frequency;
+    struct timespec deadline;
+
+    deadline.tv_sec = start_time.tv_sec + (time_t)(value / NSEC_PER_SEC);
+    deadline.tv_nsec = start_time.tv_nsec + (long)(value % NSEC_PER_SEC);
+    if(deadline.tv_nsec >= NSEC_PER_SEC) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= NSEC_PER_SEC;
+    }
+
+#if defined(__APPLE__)
+    /* No clock_nanosleep; a relative sleep is the closest */
+    {
+        unsigned long long now = cross_clock_value();
+        if(now >= value)
+            return;
+        deadline.tv_sec = (time_t)((value - now) / NSEC_PER_SEC);
+        deadline.tv_nsec = (long)((value - now) % NSEC_PER_SEC);
+        while(nanosleep(&deadline, &deadline) == -1 && errno == EINTR);
+    }
+#else
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+#endif
 }
 #endif
@@ -1,7 +1,6 @@
 #include <ncurses.h>
 #include "dev/kb.h"
-
-#define KB_BUFFER_SIZE 16
+#include "replay.h"
 
 #define EXT_BACKSPACE_1 127
 #define EXT_BACKSPACE_2 '\b'
@@ -13,19 +12,29 @@
 #define EXT_TAB_1 '\t'
 #define EXT_TAB_2 KEY_STAB
 
-static unsigned short buffer[KB_BUFFER_SIZE];
-static int buffer_size;
+static void kb_ioread(void *context, struct vcpu *cpu, unsigned short port, unsigned short *value)
+{
+    struct kb *kb = context;
+
+    if(kb->buffer_size > 0)
+        *value = kb->buffer[--kb->buffer_size];
+}
+
+int init_kb(struct kb *kb, struct vcpu *cpu)
+{
+    kb->buffer_size = 0;
+    return vcpu_bus_register(cpu->bus, KB_IOPORT, 1, &kb_ioread, NULL, kb);
+}
 
-void init_kb(void)
+void init_kb_terminal(void)
 {
     cbreak();
     nodelay(stdscr, TRUE);
     noecho();
     keypad(stdscr, TRUE);
-    buffer_size = 0;
 }
 
-void kb_update(struct vcpu *cpu)
+void kb_update(struct kb *kb, struct vcpu *cpu)
 {
     unsigned short fx;
     unsigned short key;
@@ -84,20 +93,36 @@ void kb_update(struct vcpu *cpu)
     return;
 
 done:
-    if(buffer_size < KB_BUFFER_SIZE) {
-        buffer[buffer_size++] = key;
-        vcpu_interrupt(cpu, KB_HARDWARE_ID);
+    kb_push(kb, cpu, key);
+}
+
+void kb_push(struct kb *kb, struct vcpu *cpu, unsigned short key)
+{
+    if(kb->buffer_size < KB_BUFFER_SIZE) {
+        kb->buffer[kb->buffer_size++] = key;
+        replay_interrupt(cpu, KB_HARDWARE_ID);
     }
 }
 
-int kb_ioread(struct vcpu *cpu, unsigned short port, unsigned short *value)
+int kb_feed(struct kb *kb, struct vcpu *cpu, FILE *script)
 {
-    switch(port) {
-        case KB_IOPORT:
-            if(buffer_size > 0)
-                *value = buffer[--buffer_size];
+    int ch = fgetc(script);
+
+    switch(ch) {
+        case EOF:
+            return 0;
+        case EXT_BACKSPACE_1:
+        case EXT_BACKSPACE_2:
+            kb_push(kb, cpu, KB_CHR_BACKSP);
+            return 1;
+        case EXT_RETURN_1:
+            kb_push(kb, cpu, KB_CHR_RETURN);
+            return 1;
+        case EXT_TAB_1:
+            kb_push(kb, cpu, KB_CHR_TAB);
             return 1;
     }
 
-    return 0;
+    kb_push(kb, cpu, ch & 0xFF);
+    return 1;
 }
@@ -1,5 +1,6 @@
 #ifndef _DEV_KB_H_
 #define _DEV_KB_H_ 1
+#include <stdio.h>
 #include <vcpu16.h>
 
 #define KB_HARDWARE_ID  0x000F
@@ -16,9 +17,24 @@
 #define KB_CHR_CTRL     0xFF0A
 #define KB_CHR_TAB      0xFF0B
 #define KB_CHR_FX       0xFF10 /* 0xFF10 to 0xFF1F */
+#define KB_BUFFER_SIZE  16
 
-void init_kb(void);
-void kb_update(struct vcpu *cpu);
-int kb_ioread(struct vcpu *cpu, unsigned short port, unsigned short *value);
+struct kb {
+    unsigned short buffer[KB_BUFFER_SIZE];
+    int buffer_size;
+};
+
+/* Claims the keyboard port on the bus of the vcpu;
+ * returns zero when it is taken */
+int init_kb(struct kb *kb, struct vcpu *cpu);
+
+/* Puts the curses terminal into the input mode kb_update expects */
+void init_kb_terminal(void);
+void kb_update(struct kb *kb, struct vcpu *cpu);
+void kb_push(struct kb *kb, struct vcpu *cpu, unsigned short key);
+
+/* Pushes the next byte of a key script, translating newlines,
+ * tabs and backspaces; returns zero once the script is over */
+int kb_feed(struct kb *kb, struct vcpu *cpu, FILE *script);
 
 #endif
@@ -1,14 +1,10 @@
 #include <ctype.h>
 #include <ncurses.h>
+#include <string.h>
 #include "dev/lpm20.h"
 
 #define MAX_COLORS 8
 
-static int width = 0;
-static int height = 0;
-static unsigned short text_off = 0;
-static unsigned short cursor_pos = 0;
-
 static const short colormap[MAX_COLORS] = {
     COLOR_BLACK,
     COLOR_BLUE,
@@ -20,89 +16,187 @@ static const short colormap[MAX_COLORS] = {
     COLOR_WHITE
 };
 
+/* LPM20 color indices are the curses ones, not the ANSI ones */
+static const int ansimap[MAX_COLORS] = { 0, 4, 2, 6, 1, 5, 3, 7 };
+
 static short calc_pair_id(short bg, short fg)
 {
     return ((bg & 7) << 4) | (fg & 7);
 }
 
-void init_lpm20(void)
+/* Queues the cell a guest store hit for the next draw */
+static void lpm20_observe(void *context, struct vcpu *cpu, unsigned short addr, unsigned short value)
 {
-    short i, j;
+    struct lpm20 *lpm = context;
+    unsigned short cell = addr - lpm->text_off;
+
+    if(cell < lpm->width * lpm->height && !lpm->stale[cell]) {
+        lpm->stale[cell] = 1;
+        lpm->dirty[lpm->num_dirty++] = cell;
+    }
+}
+
+static void lpm20_map(struct lpm20 *lpm, struct vcpu *cpu, int on)
+{
+    if(lpm->observe)
+        vcpu_map(cpu, lpm->text_off, lpm->width * lpm->height, NULL, on ? &lpm20_observe : NULL, lpm);
+}
 
-    width = getmaxx(stdscr);
-    height = getmaxy(stdscr);
+static void lpm20_ioread(void *context, struct vcpu *cpu, unsigned short port, unsigned short *value)
+{
+    const struct lpm20 *lpm = context;
+
+    switch(port) {
+        case LPM20_IOPORT_TEXT_OFF:
+            *value = lpm->text_off;
+            break;
+        case LPM20_IOPORT_CUR_POS:
+            *value = lpm->cursor_pos;
+            break;
+        case LPM20_IOPORT_SCR_DIMS:
+            *value = ((lpm->width & 0xFF) << 8) | (lpm->height & 0xFF);
+            break;
+    }
+}
+
+static void lpm20_iowrite(void *context, struct vcpu *cpu, unsigned short port, unsigned short value)
+{
+    struct lpm20 *lpm = context;
+
+    switch(port) {
+        case LPM20_IOPORT_TEXT_OFF:
+            if(lpm->text_off != value) {
+                lpm20_map(lpm, cpu, 0);
+                lpm->text_off = value;
+                lpm20_map(lpm, cpu, 1);
+                lpm->redraw = 1;
+            }
+            break;
+        case LPM20_IOPORT_CUR_POS:
+            lpm->cursor_pos = value;
+            break;
+    }
+}
+
+static int lpm20_setup(struct lpm20 *lpm, struct vcpu *cpu, int w, int h, int observe)
+{
+    lpm->width = w;
+    lpm->height = h;
 
     /* Limit the screen height */
-    if((width * height) >= LPM20_MAX_MEMORY)
-        height = LPM20_MAX_MEMORY / width;
+    if((lpm->width * lpm->height) >= LPM20_MAX_MEMORY)
+        lpm->height = LPM20_MAX_MEMORY / lpm->width;
+
+    lpm->text_off = 0x8000;
+    lpm->cursor_pos = 0;
+    lpm->observe = observe;
+    lpm->redraw = 1;
+    lpm->num_dirty = 0;
+    memset(lpm->stale, 0, sizeof(lpm->stale));
+
+    if(!vcpu_bus_register(cpu->bus, LPM20_IOPORT_TEXT_OFF, 3, &lpm20_ioread, &lpm20_iowrite, lpm))
+        return 0;
+    lpm20_map(lpm, cpu, 1);
+    return 1;
+}
 
-    text_off = 0x8000;
+int init_lpm20(struct lpm20 *lpm, struct vcpu *cpu)
+{
+    short i, j;
 
     for(i = 0; i < MAX_COLORS; i++) for(j = 0; j < MAX_COLORS; j++)
         init_pair(calc_pair_id(i, j), j, i);
+
+    return lpm20_setup(lpm, cpu, getmaxx(stdscr), getmaxy(stdscr), 1);
 }
 
-void shutdown_lpm20(void)
+int init_lpm20_headless(struct lpm20 *lpm, struct vcpu *cpu, int w, int h)
 {
-    width = 0;
-    height = 0;
-    text_off = 0;
+    return lpm20_setup(lpm, cpu, w, h, 0);
 }
 
-void lpm20_draw(const struct vcpu *cpu)
+void shutdown_lpm20(struct lpm20 *lpm, struct vcpu *cpu)
 {
-    int i, j;
-    unsigned short word;
-    unsigned char abyte, cbyte;
-    int attrib;
-
-    for(i = 0; i < height; i++) {
-        for(j = 0; j < width; j++) {
-            word = (*cpu->memory)[(text_off + (i * width) + j) & 0xFFFF];
-            abyte = (word >> 8) & 0xFF;
-            cbyte = word & 0xFF;
-            attrib = 0;
-            attrib |= COLOR_PAIR(calc_pair_id((abyte >> 4) & 7, abyte & 7));
-            if(abyte & (1 << 3))
-                attrib |= A_BOLD;
-            if(abyte & (1 << 7))
-                attrib |= A_REVERSE;
-            attron(attrib);
-            mvaddch(i, j, isprint(cbyte) ? cbyte : ' ');
-            attroff(attrib);
-        }
-    }
+    lpm20_map(lpm, cpu, 0);
+    lpm->width = 0;
+    lpm->height = 0;
+    lpm->text_off = 0;
+    lpm->observe = 0;
+}
 
-    move(cursor_pos / width, cursor_pos % width);
+static void lpm20_draw_cell(const struct lpm20 *lpm, const struct vcpu *cpu, int cell)
+{
+    unsigned short word = (*cpu->memory)[(lpm->text_off + cell) & 0xFFFF];
+    unsigned char abyte = (word >> 8) & 0xFF;
+    unsigned char cbyte = word & 0xFF;
+    int attrib = 0;
+
+    attrib |= COLOR_PAIR(calc_pair_id((abyte >> 4) & 7, abyte & 7));
+    if(abyte & (1 << 3))
+        attrib |= A_BOLD;
+    if(abyte & (1 << 7))
+        attrib |= A_REVERSE;
+    attron(attrib);
+    mvaddch(cell / lpm->width, cell % lpm->width, isprint(cbyte) ? cbyte : ' ');
+    attroff(attrib);
 }
 
-int lpm20_ioread(struct vcpu *cpu, unsigned short port, unsigned short *value)
+void lpm20_draw(struct lpm20 *lpm, const struct vcpu *cpu)
 {
-    switch(port) {
-        case LPM20_IOPORT_TEXT_OFF:
-            *value = text_off;
-            return 1;
-        case LPM20_IOPORT_CUR_POS:
-            *value = cursor_pos;
-            return 1;
-        case LPM20_IOPORT_SCR_DIMS:
-            *value = ((width & 0xFF) << 8) | (height & 0xFF);
-            return 1;
+    size_t i;
+    int cell;
+
+    if(lpm->redraw) {
+        for(cell = 0; cell < lpm->width * lpm->height; cell++)
+            lpm20_draw_cell(lpm, cpu, cell);
+    }
+    else {
+        for(i = 0; i < lpm->num_dirty; i++)
+            lpm20_draw_cell(lpm, cpu, lpm->dirty[i]);
     }
 
-    return 0;
+    for(i = 0; i < lpm->num_dirty; i++)
+        lpm->stale[lpm->dirty[i]] = 0;
+    lpm->num_dirty = 0;
+    lpm->redraw = 0;
+
+    move(lpm->cursor_pos / lpm->width, lpm->cursor_pos % lpm->width);
 }
 
-int lpm20_iowrite(struct vcpu *cpu, unsigned short port, unsigned short value)
+void lpm20_dump(const struct lpm20 *lpm, const struct vcpu *cpu, FILE *fp, int ansi)
 {
-    switch(port) {
-        case LPM20_IOPORT_TEXT_OFF:
-            text_off = value;
-            return 1;
-        case LPM20_IOPORT_CUR_POS:
-            cursor_pos = value;
-            return 1;
-    }
+    int i, j, n;
+    unsigned short word;
+    unsigned char abyte, cbyte;
+    int attrib;
 
-    return 0;
+    for(i = 0; i < lpm->height; i++) {
+        /* Trailing blanks only matter when they are colored */
+        for(n = lpm->width; n > 0; n--) {
+            word = (*cpu->memory)[(lpm->text_off + (i * lpm->width) + n - 1) & 0xFFFF];
+            if(ansi || isgraph(word & 0xFF))
+                break;
+        }
+
+        attrib = -1;
+        for(j = 0; j < n; j++) {
+            word = (*cpu->memory)[(lpm->text_off + (i * lpm->width) + j) & 0xFFFF];
+            abyte = (word >> 8) & 0xFF;
+            cbyte = word & 0xFF;
+            if(ansi && abyte != attrib) {
+                fprintf(fp, "\033[0;%d;%d", 30 + ansimap[abyte & 7], 40 + ansimap[(abyte >> 4) & 7]);
+                if(abyte & (1 << 3))
+                    fputs(";1", fp);
+                if(abyte & (1 << 7))
+                    fputs(";7", fp);
+                fputc('m', fp);
+                attrib = abyte;
+            }
+            fputc(isprint(cbyte) ? cbyte : ' ', fp);
+        }
+
+        if(ansi)
+            fputs("\033[0m", fp);
+        fputc('\n', fp);
+    }
 }
@@ -1,5 +1,6 @@
 #ifndef _DEV_LPM20_H_
 #define _DEV_LPM20_H_ 1
+#include <stdio.h>
 #include <vcpu16.h>
 
 #define LPM20_FREQUENCY         50
@@ -8,10 +9,34 @@
 #define LPM20_IOPORT_CUR_POS    0x1F02
 #define LPM20_IOPORT_SCR_DIMS   0x1F03
 
-void init_lpm20(void);
-void shutdown_lpm20(void);
-void lpm20_draw(const struct vcpu *cpu);
-int lpm20_ioread(struct vcpu *cpu, unsigned short port, unsigned short *value);
-int lpm20_iowrite(struct vcpu *cpu, unsigned short port, unsigned short value);
+#define LPM20_DEF_WIDTH         80
+#define LPM20_DEF_HEIGHT        25
+
+/* The interactive LPM20 hooks the pages of its text window and only
+ * redraws the cells the guest stored to; memory changed behind the
+ * core's back is not seen until the window moves */
+struct lpm20 {
+    int width, height;
+    unsigned short text_off;
+    unsigned short cursor_pos;
+    int observe;
+    int redraw;                                 /* Every cell is stale */
+    size_t num_dirty;
+    unsigned short dirty[LPM20_MAX_MEMORY];     /* Cells written since the last draw */
+    unsigned char stale[LPM20_MAX_MEMORY];      /* Whether a cell is in dirty already */
+};
+
+/* Both claim the LPM20 ports on the bus of the vcpu and return zero
+ * when they are taken; init_lpm20 sizes the screen after the terminal */
+int init_lpm20(struct lpm20 *lpm, struct vcpu *cpu);
+int init_lpm20_headless(struct lpm20 *lpm, struct vcpu *cpu, int w, int h);
+void shutdown_lpm20(struct lpm20 *lpm, struct vcpu *cpu);
+
+/* Redraws the cells that changed since the last call */
+void lpm20_draw(struct lpm20 *lpm, const struct vcpu *cpu);
+
+/* Writes the text buffer out a row per line, either as plain text
+ * without trailing blanks or with its attributes as ANSI escapes */
+void lpm20_dump(const struct lpm20 *lpm, const struct vcpu *cpu, FILE *fp, int ansi);
 
 #endif
@@ -1,5 +1,8 @@
+#include <assert.h>
 #include <errno.h>
+#include <getopt.h>
 #include <ncurses.h>
+#include <signal.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,49 +11,174 @@
 #include "dev/kb.h"
 #include "dev/lpm20.h"
 #include "cross_clock.h"
+#include "replay.h"
 
-static void xv_ioread(struct vcpu *cpu, unsigned short port, unsigned short *value)
+/* Instructions between SIGINT checks when headless */
+#define XV_HEADLESS_SLICE 0x100000
+
+/* Frames a stalled host may run late by before the rest is dropped */
+#define XV_MAX_LAG 5
+
+static volatile sig_atomic_t running = 0;
+
+static struct vcpu_bus bus;
+static struct kb kb;
+static struct lpm20 lpm20;
+static struct vcpu_profile *profile = NULL;
+static const char *profile_path = NULL;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    running = 0;
+}
+
+static void xv_profile_write(void)
 {
-    if(kb_ioread(cpu, port, value))
+    FILE *outfile;
+
+    if(!profile)
         return;
-    if(lpm20_ioread(cpu, port, value))
+
+    outfile = fopen(profile_path, "w");
+    if(!outfile) {
+        fprintf(stderr, "%s: %s!\n", profile_path, strerror(errno));
         return;
+    }
+
+    vcpu_profile_write(profile, outfile);
+    fclose(outfile);
+    free(profile);
+    profile = NULL;
 }
 
-static void xv_iowrite(struct vcpu *cpu, unsigned short port, unsigned short value)
+/* A replay answers every IOR from the log */
+static void xv_ioread(struct vcpu *cpu, unsigned short port, unsigned short *value)
 {
-    if(lpm20_iowrite(cpu, port, value))
-        return;
+    if(replay_mode() != REPLAY_PLAY)
+        vcpu_bus_ioread(cpu, port, value);
+    replay_ioread(cpu, port, value);
+}
+
+/* Runs until the instruction limit (if any) is reached, the guest
+ * dies, or it halts waiting for a key when the script has none left */
+static void xv_headless(struct vcpu *cpu, unsigned long limit, FILE *script)
+{
+    unsigned long budget;
+    int r;
+
+    for(running = 1; running;) {
+        budget = XV_HEADLESS_SLICE;
+        if(limit) {
+            if(cpu->instret >= limit)
+                break;
+            if(limit - cpu->instret < budget)
+                budget = limit - cpu->instret;
+        }
+
+        r = vcpu_run(cpu, budget);
+        if(r == VCPU_RUN_FATAL)
+            break;
+        if(r == VCPU_RUN_HALT && !(script && kb_feed(&kb, cpu, script)))
+            break;
+    }
 }
 
 int main(int argc, char **argv)
 {
     struct vcpu cpu;
-    FILE *infile;
+    FILE *infile, *script;
     long size, i;
-    WINDOW *window;
-    int running;
-    float vcpu_dt, vcpu_clock;
-    float curtime, lasttime, dt;
+    int mode, r;
+    int headless, ansi, width, height;
+    const char *log_path, *script_path;
+    unsigned long limit;
+    char *s;
+    unsigned long budget, instret, remainder;
+    unsigned long long period, deadline, now;
 
     init_vcpu(&cpu, NULL);
+    init_vcpu_bus(&bus);
+    cpu.bus = &bus;
     cpu.on_ioread = &xv_ioread;
-    cpu.on_iowrite = &xv_iowrite;
+    cpu.on_iowrite = &vcpu_bus_iowrite;
+
+    /* Falls back to the interpreter when not built in */
+    vcpu_jit_enable(&cpu);
 
-    if(argc < 2) {
+    mode = REPLAY_OFF;
+    log_path = NULL;
+    headless = 0;
+    ansi = 0;
+    width = LPM20_DEF_WIDTH;
+    height = LPM20_DEF_HEIGHT;
+    script_path = NULL;
+    script = NULL;
+    limit = 0;
+
+    while((r = getopt(argc, argv, "r:p:Hn:k:g:aP:h")) != EOF) {
+        switch(r) {
+            case 'r':
+                mode = REPLAY_RECORD;
+                log_path = optarg;
+                break;
+            case 'p':
+                mode = REPLAY_PLAY;
+                log_path = optarg;
+                break;
+            case 'H':
+                headless = 1;
+                break;
+            case 'n':
+                limit = strtoul(optarg, NULL, 10);
+                break;
+            case 'k':
+                script_path = optarg;
+                break;
+            case 'g':
+                width = (int)strtol(optarg, &s, 10);
+                height = (*s == 'x') ? (int)strtol(s + 1, NULL, 10) : 0;
+                if(width < 1 || width > 0xFF || height < 1 || height > 0xFF) {
+                    fprintf(stderr, "%s: %s: invalid screen size!\n", argv[0], optarg);
+                    return 1;
+                }
+                break;
+            case 'a':
+                ansi = 1;
+                break;
+            case 'P':
+                profile_path = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-r <log>] [-p <log>] [-H] [-n <count>] [-k <script>] [-g <cols>x<rows>] [-a] [-P <outfile>] [-h] <infile> [speed]\n", argv[0]);
+                fprintf(stderr, "Options:\n");
+                fprintf(stderr, "   -r <log>        : Record I/O reads and interrupts to a log.\n");
+                fprintf(stderr, "   -p <log>        : Play a log back without a terminal, as fast as possible.\n");
+                fprintf(stderr, "   -H              : Run without a terminal or throttling, then dump the screen.\n");
+                fprintf(stderr, "   -n <count>      : Stop a headless run after this many instructions.\n");
+                fprintf(stderr, "   -k <script>     : Type a file in headless, a key each time the guest halts.\n");
+                fprintf(stderr, "   -g <cols>x<rows>: Headless screen size (default: 80x25).\n");
+                fprintf(stderr, "   -a              : Dump the screen with ANSI colors.\n");
+                fprintf(stderr, "   -P <outfile>    : Profile the guest, write folded call stacks on exit.\n");
+                fprintf(stderr, "   -h              : Write this message and exit.\n");
+                return (r == 'h') ? 0 : 1;
+        }
+    }
+
+    if(optind >= argc) {
         fprintf(stderr, "%s: argument required!\n", argv[0]);
         return 1;
     }
 
-    if(argc >= 3) {
-        cpu.cpi.speed = strtoul(argv[2], NULL, 10);
+    if(optind + 1 < argc) {
+        cpu.cpi.speed = strtoul(argv[optind + 1], NULL, 10);
         if(!cpu.cpi.speed)
             cpu.cpi.speed = VCPU_CPI_DEF_SPEED;
     }
 
-    infile = fopen(argv[1], "rb");
+    infile = fopen(argv[optind], "rb");
     if(!infile) {
-        fprintf(stderr, "%s: %s!\n", argv[1], strerror(errno));
+        fprintf(stderr, "%s: %s!\n", argv[optind], strerror(errno));
         return 1;
     }
 
@@ -68,40 +196,111 @@ int main(int argc, char **argv)
     for(i = 0; i < VCPU_MEM_SIZE; i++)
         (*cpu.memory)[i] = vcpu_be16_to_host((*cpu.memory)[i]);
 
+    init_replay(&cpu, mode, log_path);
+
+    if(profile_path) {
+        profile = malloc(sizeof(struct vcpu_profile));
+        assert(("Out of memory!", profile));
+        init_vcpu_profile(profile);
+        vcpu_profile_enable(&cpu, profile);
+    }
+
+    /* The log stands in for the terminal and the clock */
+    if(mode == REPLAY_PLAY) {
+        replay_run(&cpu);
+        printf("instret=%lu regs=", cpu.instret);
+        for(i = 0; i < 16; i++)
+            printf(i ? ",%04X" : "%04X", cpu.regs[i]);
+        printf("\n");
+        xv_profile_write();
+        shutdown_replay(&cpu);
+        shutdown_vcpu(&cpu);
+        return 0;
+    }
+
+    signal(SIGINT, &on_signal);
+
+    if(headless) {
+        if(script_path) {
+            script = fopen(script_path, "rb");
+            if(!script) {
+                fprintf(stderr, "%s: %s!\n", script_path, strerror(errno));
+                return 1;
+            }
+        }
+
+        if(!init_kb(&kb, &cpu) || !init_lpm20_headless(&lpm20, &cpu, width, height)) {
+            fprintf(stderr, "%s: device ports are taken!\n", argv[0]);
+            return 1;
+        }
+
+        xv_headless(&cpu, limit, script);
+        lpm20_dump(&lpm20, &cpu, stdout, ansi);
+
+        if(script)
+            fclose(script);
+        xv_profile_write();
+        shutdown_lpm20(&lpm20, &cpu);
+        shutdown_replay(&cpu);
+        shutdown_vcpu(&cpu);
+        return 0;
+    }
+
     initscr();
     if(has_colors())
         start_color();
     noecho();
 
-    init_kb();
-    init_lpm20();
-
-    vcpu_dt = 1.0 / (float)cpu.cpi.speed;;
-    vcpu_clock = 0.0;
+    init_kb_terminal();
+    if(!init_kb(&kb, &cpu) || !init_lpm20(&lpm20, &cpu)) {
+        endwin();
+        fprintf(stderr, "%s: device ports are taken!\n", argv[0]);
+        return 1;
+    }
 
     init_cross_clock();
-    lasttime = cross_clock_value_seconds();
+    period = cross_clock_frequency() / LPM20_FREQUENCY;
+    deadline = cross_clock_value();
+    remainder = 0;
 
     for(running = 1; running;) {
-        curtime = cross_clock_value_seconds();
-        dt = curtime - lasttime;
-        lasttime = curtime;
+        /* Exactly cpi.speed cycles a second: whatever does not
+         * divide into frames is carried into the next ones */
+        budget = cpu.cpi.speed / LPM20_FREQUENCY;
+        remainder += cpu.cpi.speed % LPM20_FREQUENCY;
+        if(remainder >= LPM20_FREQUENCY) {
+            remainder -= LPM20_FREQUENCY;
+            budget++;
+        }
+
+        while(budget) {
+            instret = cpu.instret;
+            r = vcpu_run(&cpu, budget);
+            budget -= cpu.instret - instret;
 
-        vcpu_clock += dt;
-        while(vcpu_clock >= vcpu_dt) {
-            if(!vcpu_step(&cpu))
+            if(r == VCPU_RUN_FATAL)
                 running = 0;
-            vcpu_clock -= vcpu_dt;
+            if(r == VCPU_RUN_HALT || r == VCPU_RUN_FATAL)
+                break;
         }
 
-        lpm20_draw(&cpu);
-        kb_update(&cpu);
+        lpm20_draw(&lpm20, &cpu);
+        kb_update(&kb, &cpu);
         refresh();
 
-        napms(20);
+        /* Late frames run back to back to catch up, but a host
+         * stall longer than XV_MAX_LAG frames is not made up for */
+        deadline += period;
+        now = cross_clock_value();
+        if(now > deadline + XV_MAX_LAG * period)
+            deadline = now - XV_MAX_LAG * period;
+        cross_clock_sleep_until(deadline);
     }
 
     endwin();
+    xv_profile_write();
+    shutdown_lpm20(&lpm20, &cpu);
+    shutdown_replay(&cpu);
     shutdown_vcpu(&cpu);
     return 0;
 }
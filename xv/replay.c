@@ -0,0 +1,202 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "replay.h"
+
+/* vcpu_run budget while nothing is scheduled */
+#define REPLAY_SLICE 0x1000000
+
+struct replay_event {
+    int type;
+    unsigned long at;
+    unsigned short port;
+    unsigned short value;
+};
+
+static int mode = REPLAY_OFF;
+static FILE *file = NULL;
+static const char *file_name = NULL;
+static unsigned long last_at = 0;
+static struct replay_event next;
+
+static void replay_fatal(const char *what)
+{
+    fprintf(stderr, "%s: %s\n", file_name, what);
+    exit(1);
+}
+
+static void write_word(unsigned short word)
+{
+    fputc((word >> 8) & 0xFF, file);
+    fputc(word & 0xFF, file);
+}
+
+static unsigned short read_word(void)
+{
+    int hi = fgetc(file);
+    int lo = fgetc(file);
+    if(hi == EOF || lo == EOF)
+        replay_fatal("truncated log");
+    return (unsigned short)((hi << 8) | lo);
+}
+
+static void write_event(const struct vcpu *cpu, int type)
+{
+    unsigned long delta = cpu->instret - last_at;
+
+    last_at = cpu->instret;
+    fputc(type, file);
+    do {
+        fputc((delta & 0x7F) | ((delta > 0x7F) ? 0x80 : 0), file);
+        delta >>= 7;
+    } while(delta);
+}
+
+/* A log without an end record (the recorder crashed) ends the
+ * replay at its last event */
+static void read_event(void)
+{
+    unsigned long delta = 0;
+    int shift = 0, c;
+
+    next.type = fgetc(file);
+    if(next.type == EOF) {
+        next.type = REPLAY_EVENT_END;
+        next.at = last_at;
+        return;
+    }
+
+    do {
+        if((c = fgetc(file)) == EOF)
+            replay_fatal("truncated log");
+        delta |= (unsigned long)(c & 0x7F) << shift;
+        shift += 7;
+    } while(c & 0x80);
+
+    next.at = last_at = last_at + delta;
+
+    switch(next.type) {
+        case REPLAY_EVENT_IOR:
+            next.port = read_word();
+            next.value = read_word();
+            break;
+        case REPLAY_EVENT_INT:
+            next.value = read_word();
+            break;
+        case REPLAY_EVENT_END:
+            break;
+        default:
+            replay_fatal("corrupted log");
+    }
+}
+
+void init_replay(struct vcpu *cpu, int replay_mode, const char *path)
+{
+    char magic[4];
+
+    mode = replay_mode;
+    file_name = path;
+    last_at = cpu->instret;
+
+    if(mode == REPLAY_OFF)
+        return;
+
+    file = fopen(path, (mode == REPLAY_RECORD) ? "wb" : "rb");
+    if(!file) {
+        fprintf(stderr, "%s: %s!\n", path, strerror(errno));
+        exit(1);
+    }
+
+    if(mode == REPLAY_RECORD) {
+        fwrite(REPLAY_MAGIC, 1, 4, file);
+        write_word(REPLAY_VERSION);
+        write_word(cpu->cpi.speed >> 16);
+        write_word(cpu->cpi.speed & 0xFFFF);
+        return;
+    }
+
+    if(fread(magic, 1, 4, file) != 4 || memcmp(magic, REPLAY_MAGIC, 4))
+        replay_fatal("not a replay log");
+    if(read_word() != REPLAY_VERSION)
+        replay_fatal("unsupported log version");
+    cpu->cpi.speed = (unsigned int)read_word() << 16;
+    cpu->cpi.speed |= read_word();
+    read_event();
+}
+
+void shutdown_replay(struct vcpu *cpu)
+{
+    if(mode == REPLAY_RECORD)
+        write_event(cpu, REPLAY_EVENT_END);
+    if(file)
+        fclose(file);
+    file = NULL;
+    mode = REPLAY_OFF;
+}
+
+int replay_mode(void)
+{
+    return mode;
+}
+
+void replay_interrupt(struct vcpu *cpu, unsigned short message)
+{
+    if(mode == REPLAY_RECORD) {
+        write_event(cpu, REPLAY_EVENT_INT);
+        write_word(message);
+    }
+
+    vcpu_interrupt(cpu, message);
+}
+
+/* The handler runs in the middle of vcpu_run, where instret
+ * has not been brought up to date yet: the IOR in progress is
+ * the one instruction that has not retired, so the logged count
+ * is only a hint here and the order of the reads is what counts */
+void replay_ioread(struct vcpu *cpu, unsigned short port, unsigned short *value)
+{
+    if(mode == REPLAY_RECORD) {
+        write_event(cpu, REPLAY_EVENT_IOR);
+        write_word(port);
+        write_word(*value);
+    }
+    else if(mode == REPLAY_PLAY) {
+        if(next.type != REPLAY_EVENT_IOR || next.port != port)
+            replay_fatal("the guest diverged from the log");
+        *value = next.value;
+        read_event();
+
+        /* replay_run gave the run a whole slice while waiting for
+         * this read; the event after it needs a budget of its own */
+        vcpu_yield(cpu);
+    }
+}
+
+void replay_run(struct vcpu *cpu)
+{
+    unsigned long budget;
+    int r;
+
+    for(;;) {
+        while(next.type == REPLAY_EVENT_INT && next.at <= cpu->instret) {
+            vcpu_interrupt(cpu, next.value);
+            read_event();
+        }
+
+        if(next.type == REPLAY_EVENT_END && cpu->instret >= next.at)
+            return;
+
+        budget = REPLAY_SLICE;
+        if(next.type != REPLAY_EVENT_IOR && next.at > cpu->instret && next.at - cpu->instret < budget)
+            budget = next.at - cpu->instret;
+
+        r = vcpu_run(cpu, budget);
+        if(r == VCPU_RUN_FATAL)
+            return;
+        if(r == VCPU_RUN_HALT && next.type != REPLAY_EVENT_INT)
+            return;
+        if(r == VCPU_RUN_HALT && next.at > cpu->instret)
+            replay_fatal("the guest diverged from the log");
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef _REPLAY_H_
+#define _REPLAY_H_ 1
+#include <vcpu16.h>
+
+#define REPLAY_OFF      0
+#define REPLAY_RECORD   1
+#define REPLAY_PLAY     2
+
+/* The log is "XVRL", the version and the CPI speed as big endian
+ * words, then one record per event. Every record starts with its
+ * type and the instructions retired since the previous record as
+ * an unsigned LEB128:
+ *  REPLAY_EVENT_IOR <port:16> <value:16> - what IOR read
+ *  REPLAY_EVENT_INT <message:16>         - an interrupt was raised
+ *  REPLAY_EVENT_END                      - the recording stopped */
+#define REPLAY_MAGIC        "XVRL"
+#define REPLAY_VERSION      1
+#define REPLAY_EVENT_IOR    0x01
+#define REPLAY_EVENT_INT    0x02
+#define REPLAY_EVENT_END    0x03
+
+/* Recording stores the CPI speed of the vcpu, playing it back sets it */
+void init_replay(struct vcpu *cpu, int mode, const char *path);
+void shutdown_replay(struct vcpu *cpu);
+int replay_mode(void);
+
+/* Devices raise interrupts through here so they end up in the log */
+void replay_interrupt(struct vcpu *cpu, unsigned short message);
+
+/* Called after the devices answered an IOR; logs the value when
+ * recording and replaces it with the logged one when playing */
+void replay_ioread(struct vcpu *cpu, unsigned short port, unsigned short *value);
+
+/* Plays the log back at full speed. Returns once the recording
+ * ends or the guest halts with nothing left to wake it up. */
+void replay_run(struct vcpu *cpu);
+
+#endif